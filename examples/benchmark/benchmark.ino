@@ -0,0 +1,378 @@
+/*  benchmark.ino - Measures the cost of MkWifiDev logging on the device
+
+    Logging is directed to a stream which discards its output, so the results show the time
+    taken by the library itself (formatting, timestamps, colouring etc) rather than the time
+    spent waiting for the serial port. The following are measured:
+      - Messages per second & ns per message for each combination of display flags
+      - Hex dump throughput for the standard, ASCII & wide layouts
+      - The additional cost of each output (sink) - log file, backlog, async queue & binary records
+      - Structured (DBG_xxx_KV) messages as text & as JSON Lines
+      - Typed argument formatting (as used by DBG_xxx) against the same messages passed as varargs
+      - Rendering of the Command Mode menu & status line
+      - The stack used by a single call of each kind of message (high-water mark)
+      - Compression of typical log output, as sent to remote terminals that ask for it
+
+    Each result is printed on Serial as one line of JSON, eg
+      {"bench":"report","case":"TS|MS|COL","n":2000,"ns":10450,"per_s":95693}
+    Use tools/benchreport.py to tabulate them, save a baseline & check later builds against it:
+      python3 tools/benchreport.py /dev/ttyUSB0 --save baseline.jsonl
+      python3 tools/benchreport.py /dev/ttyUSB0 --baseline baseline.jsonl
+
+    In platformio.ini set 'src_dir = examples/benchmark'. WiFi is not started so the timings
+    aren't disturbed by network activity. The sketch can also be run on a Linux host (see test/host).
+
+    This file is part of MkWifiDev, a library which simplifies cable-free development. It
+    enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+    updates.  Available at https://github.com/zaddi/MkWifiDev
+
+    MkWifiDev is distributed under the MIT License
+*/
+
+#ifndef LOCAL_SERIAL_ONLY
+  #define LOCAL_SERIAL_ONLY     // Keep WiFi interrupts out of the measurements
+#endif
+
+#include "MkWifiDev.h"
+
+#define MESSAGES    2000        // Messages logged per measurement
+#define RUNS        3           // Each measurement is repeated & the fastest kept
+#define DUMP_SIZE   4096
+#define STACK_PROBE 1536        // Bytes of stack below the caller checked by stackUsed()
+
+// Discards everything written to it & counts the bytes. Input can be supplied to simulate key presses
+class NullStream : public Stream {
+  public:
+    uint32_t bytes = 0;
+    const char *input = "";
+
+    size_t write(uint8_t) override { bytes++; return 1; }
+    size_t write(const uint8_t *, size_t len) override { bytes += len; return len; }
+    int available() override { return strlen(input); }
+    int read() override { return *input ? *input++ : -1; }
+    int peek() override { return *input ? *input : -1; }
+    void flush() override { }
+};
+
+NullStream nullOut;
+NullStream nullFile;
+uint8_t dumpData[DUMP_SIZE];
+
+// Prints one result line. Serial is used directly as WifiDev's output is discarded
+void result(const char *bench, const char *name, uint32_t n, uint32_t us, uint32_t bytes = 0) {
+  char line[160];
+  uint32_t ns = (uint64_t)us * 1000 / n;
+  int len = snprintf(line, sizeof(line), "{\"bench\":\"%s\",\"case\":\"%s\",\"n\":%u,\"ns\":%u,\"per_s\":%u",
+                     bench, name, (unsigned)n, (unsigned)ns, (unsigned)(us ? (uint64_t)n * 1000000 / us : 0));
+  if(bytes)
+    snprintf(line + len, sizeof(line) - len, ",\"bytes\":%u,\"kb_per_s\":%u}", (unsigned)bytes,
+             (unsigned)(us ? (uint64_t)bytes * 1000 / 1024 * 1000 / us : 0));
+  else
+    strcpy(line + len, "}");
+  Serial.println(line);
+  Serial.flush();
+}
+
+// Returns the fastest of RUNS runs of MESSAGES typical messages, in us
+uint32_t timeMessages() {
+  uint32_t best = UINT32_MAX;
+  for(int run=0; run<RUNS; run++) {
+    uint32_t t = micros();
+    for(int i=0; i<MESSAGES; i++)
+      DBG_INFO("Sensor %d reading %ld, state %s", i & 7, 1000L + i, "ok");
+    t = micros() - t;
+    WifiDev.flushLogs();
+    if(t < best)
+      best = t;
+    yield();
+  }
+  return best;
+}
+
+void benchDisplayModes() {
+  static const char *names[] = { "TS", "MS", "DATE", "COL", "TYPE" };
+  static const uint8_t flags[] = { MkWifiDev::SHOW_TIMESTAMPS, MkWifiDev::SHOW_MILLISECONDS, MkWifiDev::SHOW_DATE,
+                                   MkWifiDev::SHOW_COLOUR, MkWifiDev::SHOW_TYPE };
+  const uint8_t all = MkWifiDev::SHOW_TIMESTAMPS | MkWifiDev::SHOW_MILLISECONDS | MkWifiDev::SHOW_DATE |
+                      MkWifiDev::SHOW_COLOUR | MkWifiDev::SHOW_TYPE;
+
+  for(int combo=0; combo<32; combo++) {
+    if((combo & 6) && !(combo & 1))
+      continue;     // Milliseconds & date only apply when timestamps are shown
+    char name[32] = "";
+    WifiDev.clearDisplayModeFlags(all);
+    for(int i=0; i<5; i++)
+      if(combo & (1 << i)) {
+        WifiDev.setDisplayModeFlags(flags[i]);
+        if(*name)
+          strcat(name, "|");
+        strcat(name, names[i]);
+      }
+    result("report", *name ? name : "plain", MESSAGES, timeMessages());
+  }
+  WifiDev.clearDisplayModeFlags(all);
+  WifiDev.setDisplayModeFlags(MkWifiDev::SHOW_TIMESTAMPS | MkWifiDev::SHOW_COLOUR);
+}
+
+void benchHexDump() {
+  static const struct { const char *name; uint8_t flags; } modes[] = {
+    { "standard", 0 }, { "ascii", MkWifiDev::HEXDUMP_ASCII }, { "wide", MkWifiDev::WIDE_HEXDUMP },
+    { "wide|ascii", MkWifiDev::WIDE_HEXDUMP | MkWifiDev::HEXDUMP_ASCII } };
+
+  for(auto &m : modes) {
+    WifiDev.clearDisplayModeFlags(MkWifiDev::HEXDUMP_ASCII | MkWifiDev::WIDE_HEXDUMP);
+    WifiDev.setDisplayModeFlags(m.flags);
+    uint32_t best = UINT32_MAX;
+    for(int run=0; run<RUNS; run++) {
+      uint32_t t = micros();
+      DBG_HEXDUMP("Benchmark", dumpData, DUMP_SIZE);
+      t = micros() - t;
+      if(t < best)
+        best = t;
+      yield();
+    }
+    result("hexdump", m.name, DUMP_SIZE, best, DUMP_SIZE);
+  }
+  WifiDev.clearDisplayModeFlags(MkWifiDev::HEXDUMP_ASCII | MkWifiDev::WIDE_HEXDUMP);
+}
+
+// Each case adds an output to the previous ones, so the difference between lines is the cost of that output
+void benchSinks() {
+  result("sinks", "serial", MESSAGES, timeMessages());
+
+  WifiDev.setLogFile(nullFile);
+  WifiDev.setLogFileFlushDelay(0);
+  result("sinks", "+file", MESSAGES, timeMessages());
+
+  WifiDev.setBacklog(16384);
+  result("sinks", "+backlog", MESSAGES, timeMessages());
+
+  // Only the time taken to queue the messages is measured, they're written out by flushLogs() afterwards
+  WifiDev.setAsyncLogging(32768, MkWifiDev::DROP_OLDEST);
+  result("sinks", "+async", MESSAGES, timeMessages());
+
+  WifiDev.setBinaryLogging(true);
+  result("sinks", "+binary", MESSAGES, timeMessages());
+
+  WifiDev.setBinaryLogging(false);
+  WifiDev.setAsyncLogging(0);
+  WifiDev.setBacklog(0);
+  WifiDev.closeLogFile();
+}
+
+// Returns the fastest of RUNS runs of MESSAGES structured messages, in us
+uint32_t timeStructured() {
+  uint32_t best = UINT32_MAX;
+  for(int run=0; run<RUNS; run++) {
+    uint32_t t = micros();
+    for(int i=0; i<MESSAGES; i++)
+      DBG_INFO_KV("Sensor", "id", i & 7, "reading", 1000L + i, "state", "ok");
+    t = micros() - t;
+    if(t < best)
+      best = t;
+    yield();
+  }
+  return best;
+}
+
+// The same messages as text, using printf style & key/value formatting, then as JSON Lines
+void benchStructured() {
+  result("structured", "printf", MESSAGES, timeMessages());
+  result("structured", "kv", MESSAGES, timeStructured());
+
+  WifiDev.setJsonLines(MkWifiDev::SERIAL_OUTPUT);
+  result("structured", "json", MESSAGES, timeMessages());
+  result("structured", "kv json", MESSAGES, timeStructured());
+  WifiDev.setJsonLines(0);
+}
+
+// The varargs Report(), which DBG_xxx messages used before arguments were captured with their types
+typedef void (MkWifiDev::*VarargsReport)(const char*, MkWifiDev::MessageType, const char*, ...);
+static const VarargsReport varargsReport = &MkWifiDev::Report;
+
+// Returns the fastest of RUNS runs of MESSAGES messages of one kind (0 integers, 1 hex, 2 floats), in us
+uint32_t timeFormat(int kind, bool varargs) {
+  static const char *formats[] = { "Sensor %d reading %ld, state %s", "Register %02x = %08lx", "Temperature %.2f humidity %.1f%%" };
+  const char *dbgTAG = nullptr;
+  uint32_t best = UINT32_MAX;
+  for(int run=0; run<RUNS; run++) {
+    uint32_t t = micros();
+    for(int i=0; i<MESSAGES; i++) {
+      if(varargs) {
+        if(kind == 0)       (WifiDev.*varargsReport)(dbgTAG, MkWifiDev::INFO, formats[0], i & 7, 1000L + i, "ok");
+        else if(kind == 1)  (WifiDev.*varargsReport)(dbgTAG, MkWifiDev::INFO, formats[1], i & 0xFF, 0x1000L * i);
+        else                (WifiDev.*varargsReport)(dbgTAG, MkWifiDev::INFO, formats[2], 20 + i * 0.01, 40 + i * 0.1);
+      } else {
+        if(kind == 0)       WifiDev.Report(dbgTAG, MkWifiDev::INFO, formats[0], i & 7, 1000L + i, "ok");
+        else if(kind == 1)  WifiDev.Report(dbgTAG, MkWifiDev::INFO, formats[1], i & 0xFF, 0x1000L * i);
+        else                WifiDev.Report(dbgTAG, MkWifiDev::INFO, formats[2], 20 + i * 0.01, 40 + i * 0.1);
+      }
+    }
+    t = micros() - t;
+    if(t < best)
+      best = t;
+    yield();
+  }
+  return best;
+}
+
+void benchFormat() {
+  static const char *names[] = { "int", "hex", "float" };
+  char name[24];
+  for(int kind=0; kind<3; kind++) {
+    result("format", names[kind], MESSAGES, timeFormat(kind, false));
+    snprintf(name, sizeof(name), "%s varargs", names[kind]);
+    result("format", name, MESSAGES, timeFormat(kind, true));
+  }
+}
+
+// Times loop() handling a key press, ie rendering the full menu (Ctrl-A), the status line or a statistics page
+void benchCommandMode() {
+  static const struct { const char *key; uint8_t result; } keys[] = { { "\x01", 0 }, { "m", 1 }, { "m", 1 }, { "s", 2 } };
+  static const char *names[] = { "menu", "status", "suppression" };
+  uint32_t total[3] = { 0, 0, 0 }, count[3] = { 0, 0, 0 };
+
+  for(int run=0; run<RUNS; run++) {
+    for(auto &k : keys) {   // 'm' is pressed twice so the display mode is unchanged afterwards
+      nullOut.input = k.key;
+      uint32_t t = micros();
+      WifiDev.loop();
+      total[k.result] += micros() - t;
+      count[k.result]++;
+    }
+    nullOut.input = "\x01";   // Back to normal mode
+    WifiDev.loop();
+    yield();
+  }
+  for(int i=0; i<3; i++)
+    result("command", names[i], count[i], total[i]);
+}
+
+// Keeps the first bytes written to it
+class CaptureStream : public NullStream {
+  public:
+    uint8_t data[8192];
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t len) override {
+      size_t n = min(len, sizeof(data) - bytes);
+      memcpy(data + bytes, buf, n);
+      bytes += n;
+      return len;
+    }
+};
+
+// Compresses typical log output in remote terminal sized blocks. The ratio is printed as a plain line, which
+// benchreport.py ignores
+void benchCompress() {
+  static CaptureStream capture;
+  WifiDev.setSerial(capture);
+  WifiDev.setDisplayModeFlags(MkWifiDev::SHOW_MILLISECONDS);
+  for(int i=0; capture.bytes < sizeof(capture.data); i++) {
+    DBG_INFO("Sensor %d reading %ld, state %s", i & 7, 1000L + i, "ok");
+    DBG_DEBUG("Temperature %.2f humidity %.1f%%", 20 + (i % 37) * 0.13, 40 + (i % 11) * 1.7);
+    if(!(i & 7))
+      DBG_WARNING("Retrying connection to %s (attempt %d)", "192.168.1.20", i % 5);
+  }
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_MILLISECONDS);
+  WifiDev.setSerial(nullOut);
+
+  static uint8_t out[MkLzStream::maxOut(MkLzStream::BLOCK)];
+  uint32_t best = UINT32_MAX, zipped = 0;
+  for(int run=0; run<RUNS; run++) {
+    MkLzStream *lz = new MkLzStream();    // New each run, so earlier runs aren't used as history
+    zipped = 0;
+    uint32_t t = micros();
+    for(size_t i=0; i<sizeof(capture.data); i+=MkLzStream::BLOCK)
+      zipped += lz->compress(capture.data + i, min((size_t)MkLzStream::BLOCK, sizeof(capture.data) - i), out);
+    t = micros() - t;
+    delete lz;
+    if(t < best)
+      best = t;
+    yield();
+  }
+  result("compress", "lz77", sizeof(capture.data), best, sizeof(capture.data));
+  Serial.printf("Compressed %u bytes of log output to %u (%.1f:1)\n", (unsigned)sizeof(capture.data), (unsigned)zipped,
+                (float)sizeof(capture.data) / zipped);
+}
+
+// Returns the stack used by fn(), by filling the free stack below this function with a pattern, calling fn() &
+// finding the deepest byte it changed. The fill is an inline loop so nothing is called while it runs. fn() is
+// called once beforehand so one-off initialisation (eg of the C library's float formatting) isn't counted. It mustn't
+// be cloned for each fn, which would let fn's locals be inlined into this frame (& be overwritten by the fill)
+uint32_t __attribute__((noinline, noclone)) stackUsed(void (*fn)()) {
+  fn();
+  volatile uint8_t *top = (volatile uint8_t *)__builtin_frame_address(0) - 64;   // Gap for this function's calls
+  for(int i=1; i<=STACK_PROBE; i++)
+    top[-i] = 0xA5;
+  fn();
+  int deepest = STACK_PROBE;
+  while(deepest > 0 && top[-deepest] == 0xA5)
+    deepest--;
+  return deepest + 64;
+}
+
+void stackResult(const char *name, uint32_t bytes) {
+  char line[80];
+  snprintf(line, sizeof(line), "{\"bench\":\"stack\",\"case\":\"%s\",\"bytes\":%u}", name, (unsigned)bytes);
+  Serial.println(line);
+  Serial.flush();
+}
+
+// Text messages are formatted in MKWIFIDEV_FORMAT_CHUNK pieces, so a long message should use no more stack than a short one
+void benchStack() {
+  static char longText[1001];
+  memset(longText, 'x', sizeof(longText) - 1);
+
+  stackResult("printf", stackUsed([]() { DBG_INFO("Sensor %d reading %ld, state %s", 3, 1000L, "ok"); }));
+  stackResult("float", stackUsed([]() { DBG_INFO("Temperature %.2f humidity %.1f%%", 21.25, 48.5); }));
+  stackResult("long", stackUsed([]() { DBG_INFO("Long message: %s", longText); }));
+  stackResult("kv", stackUsed([]() { DBG_INFO_KV("Sensor", "id", 3, "reading", 1000L, "state", "ok"); }));
+  stackResult("hexdump", stackUsed([]() { DBG_HEXDUMP("Benchmark", dumpData, 256); }));
+
+  WifiDev.setJsonLines(MkWifiDev::SERIAL_OUTPUT);
+  stackResult("json", stackUsed([]() { DBG_INFO("Sensor %d reading %ld, state %s", 3, 1000L, "ok"); }));
+  WifiDev.setJsonLines(0);
+
+  WifiDev.setAsyncLogging(8192, MkWifiDev::DROP_OLDEST);
+  stackResult("async", stackUsed([]() { DBG_INFO("Long message: %s", longText); }));
+  stackResult("drain", stackUsed([]() { WifiDev.flushLogs(); }));
+  WifiDev.setAsyncLogging(0);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(500);
+
+  for(int i=0; i<DUMP_SIZE; i++)
+    dumpData[i] = i * 7;
+
+  Serial.println();
+#if defined(ESP32) || defined(ESP8266)
+  Serial.printf("{\"bench\":\"info\",\"chip\":\"%s\",\"cpu_mhz\":%u,\"messages\":%d,\"runs\":%d}\n",
+  #ifdef ESP32
+                ESP.getChipModel(),
+  #else
+                "ESP8266",
+  #endif
+                (unsigned)ESP.getCpuFreqMHz(), MESSAGES, RUNS);
+#endif
+
+  WifiDev.setSerial(nullOut);
+
+  benchDisplayModes();
+  benchHexDump();
+  benchSinks();
+  benchStructured();
+  benchFormat();
+  benchCommandMode();
+  benchStack();
+  benchCompress();
+
+  WifiDev.setSerial(Serial);
+  Serial.println("{\"bench\":\"done\"}");
+}
+
+void loop() {
+  WifiDev.loop();
+  delay(100);
+}
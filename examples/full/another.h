@@ -16,6 +16,7 @@
 #include "MkWifiDev.h"
 
 //#define DEBUG_SHOW_FILE      // Uncomment this to show the calling filename & line number in output
+//#define DEBUG_SHOW_FILE_ID   // Or this to show a short file ID instead (expanded by tools/mkdecode.py --src)
 //#define DEBUG_SHOW_FUNCTION  // Uncomment this to show the calling function name in output
 
 void another_setup();
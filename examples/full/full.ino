@@ -34,10 +34,15 @@
 #include "another.h"
 
 //#define DEBUG_SHOW_FILE      // Uncomment this to show the calling filename & line number in output
+//#define DEBUG_SHOW_FILE_ID   // Or this to show a short file ID instead (expanded by tools/mkdecode.py --src)
 //#define DEBUG_SHOW_FUNCTION  // Uncomment this to show the calling function name in output
 
 //#define FILE_LOGGING_ENABLED   // Uncomment this (and check SD/SPI settings) to enable logging to file
 
+// The following lines show how to remove messages below a level from this file
+//#undef MKWIFIDEV_MIN_LEVEL
+//  #define MKWIFIDEV_MIN_LEVEL  MkWifiDev::INFO   // Verbose & debug messages will not be built
+
 // The following lines show how to exclude a message type from a build
 //#undef DBG_VERBOSE                  // Undefine first to avoid compiler warning
 //  #define DBG_VERBOSE(...)    { }   // Replaces the log macro with nothing ie removing the log message
@@ -53,7 +58,7 @@
   #define SPI_SCK     GPIO_NUM_11
   #define SPI_SD_CS   GPIO_NUM_42
 
-  File logFile;
+  bool bLogging = false;
 #endif
 
 //#define LED_BUILTIN  GPIO_NUM_?   // If not defined for your board, you can specify a pin here to show wifi status
@@ -96,6 +101,7 @@ void setup() {
 
   WifiDev.setDisplayModeFlags(MkWifiDev::SHOW_MILLISECONDS);    // Show milliseconds in message timestamps
   //WifiDev.setDisplayModeFlags(MkWifiDev::WIDE_HEXDUMP);       // Enable wide hex dump display (32 bytes vs 16)
+  //WifiDev.setTagLevel("JustAnother", MkWifiDev::WARNING);    // Hide messages below warning level from another.cpp
 
   //WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_TIMESTAMPS);   // Hide the timestamps with each message
   //WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);       // Disable message coloring
@@ -106,6 +112,8 @@ void setup() {
   WifiDev.begin(ssid, password, devname);   // Start wifi
 
   WifiDev.configTime(GMT_OFFSET, DAYLIGHT_OFFSET);   // Enable internet time sync
+  //WifiDev.setSyslog("192.168.1.10");     // Also send messages to a syslog server
+  //WifiDev.setMetricsPort();             // Serve metrics for Prometheus at http://<device>:9100/metrics
 
   //ArduinoOTA.setPassword("admin");    // Enable OTA authentication (password required to apply updates)
 
@@ -122,22 +130,24 @@ bool color = true;
 
 void sdcard() {
 #ifdef FILE_LOGGING_ENABLED
-  if(logFile) {
-    logFile.close();
+  if(bLogging) {
+    WifiDev.closeLogFile();
+    bLogging = false;
     DBG_ALERT("Stopped logging to SD Card");
     return;
   }
   SPI.begin(SPI_SCK, SPI_MISO, SPI_MOSI, SPI_SD_CS); // map  SPI pins SCK, MISO, MOSI, SS
 
   if(SD.begin(SPI_SD_CS)) {   
-    DBG_INFO("Mounted SD Card (Size: %d GB)", SD.cardSize() >> 30);
+    DBG_INFO("Mounted SD Card (Size: %u GB)", (unsigned)(SD.cardSize() >> 30));
 
-    logFile = SD.open("/logfile.txt", FILE_WRITE);
+    // Start a new file every 1MB, keeping the last 3 (logfile.txt.0 - logfile.txt.2)
+    bLogging = WifiDev.setLogFile(SD, "/logfile.txt", 1024*1024, 3);
 
-    if(logFile) {
-      WifiDev.setLogFile(logFile);
+    if(bLogging)
       DBG_ALERT("Started logging to 'logfile.txt'");
-    }
+    else
+      DBG_ERROR("Failed to open 'logfile.txt'");
   }
   else {
     DBG_ERROR("Failed to access SD card");
@@ -206,6 +216,11 @@ void loop() {
       case 's' : DBG_HEXDUMP("Test Buffer (First 16 bytes):", testBuffer, 16); break;
       case 'd' : DBG_HEXDUMP("Test Buffer (First 8 bytes):", testBuffer, 8); break;
 
+      // Structured message with key/value fields, and switching the serial port to JSON Lines output
+      case 'k' : DBG_INFO_KV("Status", "uptime", millis()/1000, "heap", ESP.getFreeHeap(), "rssi", WiFi.RSSI()); break;
+      case 'J' : DBG_ALERT("Serial output set to JSON Lines"); WifiDev.setJsonLines(MkWifiDev::SERIAL_OUTPUT); break;
+      case 'j' : WifiDev.setJsonLines(0); DBG_ALERT("Serial output set to text"); break;
+
       // Initiate an internet time sync
       case 'n' : DBG_ALERT("Requesting NTP time from server"); WifiDev.configTime(GMT_OFFSET, DAYLIGHT_OFFSET); break;
 
@@ -213,7 +228,7 @@ void loop() {
       case 't' : DBG_ALERT("dbgTAG set to '%s'", dbgTAG ? "" : "MyModule"); dbgTAG = dbgTAG ? nullptr : "MyModule"; break;
 
       // Default message if key has no associated action
-      default  : DBG_INFO("Keys 1-8 for messages, h)exdump n)tp time t)dbgTAG b)urst c)olour"); break;
+      default  : DBG_INFO("Keys 1-8 for messages, h)exdump k)ey/value n)tp time t)dbgTAG b)urst c)olour J/j)son"); break;
     }
   }
 }
\ No newline at end of file
@@ -9,9 +9,26 @@
 
 #include "Arduino.h"
 #include "MkWifiDev.h"
+#include <limits.h>
+#include <math.h>
+#include <new>
+#if defined(ESP32) && !defined(LOCAL_SERIAL_ONLY)
+  #include <lwip/sockets.h>
+#endif
+#ifdef ESP32
+  #include <esp_heap_caps.h>
+#endif
+#if defined(_GLIBCXX_HAS_GTHREADS) && !defined(ESP8266)
+  #define MKWIFIDEV_THREADS       // Messages may be logged by several threads/tasks at once
+  #include <mutex>
+#endif
 
-#define EVENT_MSG_MAX_LEN   (256)
+#define EVENT_MSG_MAX_LEN   (256)     // Messages built in one piece (JSON Lines, syslog), others are streamed
 #define TERMINAL_WIDTH      (74)
+#define DRAIN_BUDGET_MS     (5)       // Maximum time loop() spends writing out queued messages
+#define BINARY_RECORD_MARK  (0x1E)    // ASCII record separator, starts each binary log record
+
+static_assert(MKWIFIDEV_FORMAT_CHUNK >= 64, "MKWIFIDEV_FORMAT_CHUNK must be at least 64");
 
 const uint8_t colors[] = {  MkWifiDev::White, 
                             MkWifiDev::Cyan, 
@@ -22,6 +39,313 @@ const uint8_t colors[] = {  MkWifiDev::White,
                             MkWifiDev::Red, 
                             MkWifiDev::BrightRed};   
 
+// Color escape sequences for the above & message type flags, so they needn't be formatted for each message
+const char colorCodes[][6] = { "\033[37m", "\033[36m", "\033[32m", "\033[94m", "\033[33m", "\033[35m", "\033[31m", "\033[91m" };
+const char typeFlags[][4] = { "", "[V]", "[D]", "[I]", "[W]", "[A]", "[E]", "[C]" };
+const char *levelNames[] = { "All", "Verbose", "Debug", "Info", "Warning", "Alert", "Error", "Critical" };
+const char *jsonLevels[] = { "print", "verbose", "debug", "info", "warning", "alert", "error", "critical" };
+static const char hexDigits[] = "0123456789ABCDEF";
+#define COLOR_RESET         "\033[0m"
+
+// Adds the time since the last PROFILE_START/PROFILE_ADD to a loop() profile total
+#ifdef MKWIFIDEV_PROFILE_LOOP
+  #define PROFILE_START()     uint32_t tProfile = mkCycleCount()
+  #define PROFILE_ADD(item)   tProfile = profileAdd(item, tProfile)
+#else
+  #define PROFILE_START()
+  #define PROFILE_ADD(item)
+#endif
+
+// Converts a mkCycleCount() interval (CPU cycles, or microseconds if there is no cycle counter)
+static inline float cyclesToMicros(uint64_t cycles) {
+#if defined(ESP32)
+  return (float)cycles / getCpuFrequencyMhz();
+#elif defined(ESP8266)
+  return (float)cycles / ESP.getCpuFreqMHz();
+#else
+  return cycles;
+#endif
+}
+
+#ifdef ESP32
+static const char *resetReasonName(esp_reset_reason_t r) {
+  static const char* esp_reset_strings[] = { "Unknown", "Power On", "Ext Pin", "Software Reset", "Exception/Panic",
+    "Internal Watchdog", "Task Watchdog", "Other Watchdog", "Deep Sleep", "Brown Out", "Reset over SDIO" };
+  return (r >= 0 && r < (int)(sizeof(esp_reset_strings)/sizeof(esp_reset_strings[0]))) ? esp_reset_strings[r] : "Unknown";
+}
+#endif
+
+// True if called from an interrupt handler, where messages can only be logged with DBG_ISR_xxx
+static inline bool inInterrupt() {
+#if defined(ESP32)
+  return xPortInIsrContext();
+#elif defined(ESP8266) && defined(ETS_INTR_WITHINISR)
+  return ETS_INTR_WITHINISR();
+#else
+  return false;
+#endif
+}
+
+// A printf conversion specification, eg "%-08.3lx"
+struct FormatSpec {
+  char flags[6];
+  int width;          // -1 if not given, -2 if '*'
+  int precision;      // -1 if not given, -2 if '*'
+  char length;        // 0, 'H' (hh), 'h', 'l', 'q' (ll), 'L', 'j', 'z' or 't'
+  char conv;          // Conversion character, 0 if the specification is invalid
+};
+
+// Parses the specification following a '%', advancing fmt past it
+static void parseFormatSpec(const char *&fmt, FormatSpec &spec) {
+  uint8_t nflags = 0;
+  while(*fmt && strchr("-+ #0", *fmt) && nflags < sizeof(spec.flags)-1)
+    spec.flags[nflags++] = *fmt++;
+  spec.flags[nflags] = '\0';
+
+  spec.width = -1;
+  if(*fmt == '*') {
+    spec.width = -2;
+    fmt++;
+  } else if(isdigit(*fmt))
+    spec.width = strtol(fmt, (char**)&fmt, 10);
+
+  spec.precision = -1;
+  if(*fmt == '.') {
+    fmt++;
+    if(*fmt == '*') {
+      spec.precision = -2;
+      fmt++;
+    } else
+      spec.precision = strtol(fmt, (char**)&fmt, 10);
+  }
+
+  spec.length = 0;
+  if(*fmt && strchr("hlLjzt", *fmt)) {
+    spec.length = *fmt++;
+    if(spec.length == 'h' && *fmt == 'h') { spec.length = 'H'; fmt++; }
+    if(spec.length == 'l' && *fmt == 'l') { spec.length = 'q'; fmt++; }
+  }
+
+  spec.conv = (*fmt && strchr("diouxXcsfFeEgGaApn%", *fmt)) ? *fmt++ : 0;
+}
+
+// The arguments of a message, read in order as the format's conversions need them. They're either a va_list (from the
+// varargs Report() etc) or the MkArg values captured by the template Report(), which are converted to the type each
+// conversion expects as printf() would. Copies read independently from the same position
+class MkArgs {
+  public:
+    MkArgs(va_list src) : typed(nullptr), n(0) { va_copy(list, src); }
+    MkArgs(const MkArg *args, int nArgs) : typed(args), n(nArgs) { }
+    MkArgs(const MkArgs &other) : typed(other.typed), n(other.n) {
+      if(!typed)
+        va_copy(list, const_cast<MkArgs&>(other).list);   // va_copy() may not take a const source
+    }
+    MkArgs &operator=(const MkArgs &) = delete;
+    ~MkArgs() {
+      if(!typed)
+        va_end(list);
+    }
+
+    // Arguments for * widths & precisions, %c & conversions without a length modifier
+    int getInt() { return getSigned(0); }
+
+    // Integer conversions with the given length modifier (see FormatSpec)
+    int64_t getSigned(char length) {
+      if(!typed) {
+        switch(length) {
+          case 'l': return va_arg(list, long);
+          case 'q': return va_arg(list, long long);
+          case 'j': return va_arg(list, intmax_t);
+          case 'z': return va_arg(list, size_t);
+          case 't': return va_arg(list, ptrdiff_t);
+          default:  return va_arg(list, int);
+        }
+      }
+      int64_t v = integer(next());
+      switch(length) {
+        case 'l': return (long)v;
+        case 'q': return (long long)v;
+        case 'j': return (intmax_t)v;
+        case 'z':
+        case 't': return (ptrdiff_t)v;
+        default:  return (int)v;
+      }
+    }
+
+    uint64_t getUnsigned(char length) {
+      if(!typed) {
+        switch(length) {
+          case 'l': return va_arg(list, unsigned long);
+          case 'q': return va_arg(list, unsigned long long);
+          case 'j': return va_arg(list, uintmax_t);
+          case 'z': return va_arg(list, size_t);
+          case 't': return va_arg(list, ptrdiff_t);
+          default:  return va_arg(list, unsigned int);
+        }
+      }
+      uint64_t v = integer(next());
+      switch(length) {
+        case 'l': return (unsigned long)v;
+        case 'q': return (unsigned long long)v;
+        case 'j': return (uintmax_t)v;
+        case 'z':
+        case 't': return (size_t)v;
+        default:  return (unsigned int)v;
+      }
+    }
+
+    double getDouble(char length) {
+      if(!typed)
+        return (length == 'L') ? va_arg(list, long double) : va_arg(list, double);
+      const MkArg &a = next();
+      return (a.kind == MkArg::DOUBLE) ? a.d : (a.kind == MkArg::INT) ? (double)a.i : (a.kind == MkArg::UINT) ? (double)a.u : 0;
+    }
+
+    // Strings & pointers. Integers are taken as addresses, as from DBG_ISR_xxx messages
+    const void *getPtr() {
+      if(!typed)
+        return va_arg(list, void*);
+      const MkArg &a = next();
+      return (a.kind == MkArg::DOUBLE) ? nullptr : (a.kind == MkArg::STR || a.kind == MkArg::PTR) ? a.p : (const void*)(uintptr_t)a.u;
+    }
+
+    const char *getStr() { return (const char*)getPtr(); }
+
+    // Formats the next conversion (fmt holding only that specification) by vsnprintf(), taking its argument(s)
+    int format(char *buff, size_t size, const char *fmt, const FormatSpec &spec) {
+      if(!typed)
+        return vsnprintf(buff, size, fmt, list);
+
+      int star[2], nStar = 0;
+      if(spec.width == -2)      star[nStar++] = getInt();
+      if(spec.precision == -2)  star[nStar++] = getInt();
+      switch(spec.conv) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+          switch(spec.length) {
+            case 'l': return formatValue(buff, size, fmt, star, nStar, (long)getSigned('l'));
+            case 'q': return formatValue(buff, size, fmt, star, nStar, (long long)getSigned('q'));
+            case 'j': return formatValue(buff, size, fmt, star, nStar, (intmax_t)getSigned('j'));
+            case 'z': return formatValue(buff, size, fmt, star, nStar, (size_t)getUnsigned('z'));
+            case 't': return formatValue(buff, size, fmt, star, nStar, (ptrdiff_t)getSigned('t'));
+            default:  return formatValue(buff, size, fmt, star, nStar, getInt());
+          }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+          if(spec.length == 'L')
+            return formatValue(buff, size, fmt, star, nStar, (long double)getDouble('L'));
+          return formatValue(buff, size, fmt, star, nStar, getDouble(0));
+        case 's':
+        case 'p':
+          return formatValue(buff, size, fmt, star, nStar, getPtr());
+        default:
+          return 0;
+      }
+    }
+
+  private:
+    const MkArg *typed;   // Null if using list
+    int n;
+    va_list list;
+
+    // Next typed argument, or zero if there are no more
+    const MkArg &next() {
+      static const MkArg none = { MkArg::UINT, { 0 } };
+      if(!n)
+        return none;
+      n--;
+      return *typed++;
+    }
+
+    static int64_t integer(const MkArg &a) {
+      return (a.kind == MkArg::DOUBLE) ? (int64_t)a.d : (a.kind == MkArg::STR || a.kind == MkArg::PTR) ? (int64_t)(uintptr_t)a.p : a.i;
+    }
+
+    template<typename T>
+    static int formatValue(char *buff, size_t size, const char *fmt, const int *star, int nStar, T value) {
+      switch(nStar) {
+        case 0:  return snprintf(buff, size, fmt, value);
+        case 1:  return snprintf(buff, size, fmt, star[0], value);
+        default: return snprintf(buff, size, fmt, star[0], star[1], value);
+      }
+    }
+};
+
+// Takes the argument(s) used by one conversion from args, passing the raw value of each to put(data, len, isString).
+// Strings are passed without their terminator. Returns false if put() did, or if the specification is invalid (so
+// what follows can't be known)
+template<typename Put>
+static bool takeArg(const FormatSpec &spec, MkArgs &args, Put put) {
+#define TAKE_ARG(T, value)  { T v = (T)(value); if(!put(&v, sizeof(v), false)) return false; }
+
+  if(spec.width == -2)      TAKE_ARG(int, args.getInt());
+  if(spec.precision == -2)  TAKE_ARG(int, args.getInt());
+
+  switch(spec.conv) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      switch(spec.length) {
+        case 'l': TAKE_ARG(long, args.getSigned('l')); break;
+        case 'q': TAKE_ARG(long long, args.getSigned('q')); break;
+        case 'j': TAKE_ARG(intmax_t, args.getSigned('j')); break;
+        case 'z': TAKE_ARG(size_t, args.getUnsigned('z')); break;
+        case 't': TAKE_ARG(ptrdiff_t, args.getSigned('t')); break;
+        default:  TAKE_ARG(int, args.getInt()); break;
+      }
+      break;
+
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      TAKE_ARG(double, args.getDouble(spec.length));
+      break;
+
+    case 's': {
+      const char *str = args.getStr();
+      if(!str)
+        str = "(null)";
+      return put(str, strlen(str), true);
+    }
+
+    case 'p': TAKE_ARG(uint32_t, (uintptr_t)args.getPtr()); break;
+    case 'n': args.getPtr(); break;
+    case '%': break;
+    default:  return false;
+  }
+#undef TAKE_ARG
+
+  return true;
+}
+
+// Copies the raw values of the arguments used by format into buff, so they can be formatted by the host
+// (see tools/mkdecode.py). Strings are copied including their terminator. Returns the number of bytes used
+static int encodeArgs(uint8_t *buff, int maxLen, const char *format, MkArgs args) {
+  int len = 0;
+  auto put = [&](const void *data, int n, bool str) {
+    if(str)
+      n = min(n, maxLen-len-1);     // Strings are cut short to fit
+    if(n < 0 || len + n + str > maxLen)
+      return false;
+    memcpy(buff+len, data, n);
+    len += n;
+    if(str)
+      buff[len++] = '\0';
+    return true;
+  };
+
+  while((format = strchr(format, '%'))) {
+    FormatSpec spec;
+    format++;
+    parseFormatSpec(format, spec);
+    if(!takeArg(spec, args, put))
+      break;
+  }
+  return len;
+}
+
+// FNV-1a hash, used to recognise repeated messages
+static uint32_t fnv1a(const void *data, size_t len, uint32_t hash = 2166136261u) {
+  const uint8_t *p = (const uint8_t*)data;
+  while(len--)
+    hash = (hash ^ *p++) * 16777619u;
+  return hash;
+}
+
 MkWifiDev &MkWifiDev::getInstance() {
   static MkWifiDev instance;
   return instance;
@@ -33,312 +357,3153 @@ int MkWifiDev::peek() {
   return pCommand->peek();
 }
 
-// Duplicate output to all connected streams
-void MkWifiDev::println(const char *buff) {
-  if(termConnected)
-    pCommand->println(buff);
+// Duplicate output to all connected streams (or the selected ones)
+void MkWifiDev::println(const char *buff, uint8_t outputs) {
+  PROFILE_START();
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & TERMINAL_OUTPUT)
+    termWrite(buff, strlen(buff), true);
+  PROFILE_ADD(PROF_TCP);
+#endif
   
-  pSerial->println(buff);
+  if(outputs & SERIAL_OUTPUT)
+    pSerial->println(buff);
+  PROFILE_ADD(PROF_SERIAL);
 
-  if(logFile) {
-    logFile->println(buff);
-    logFile->flush();
+  if(outputs & FILE_OUTPUT) {
+    fileWrite(buff, strlen(buff));
+    fileWrite("\r\n", 2);
   }
+  PROFILE_ADD(PROF_FILE);
+
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & SYSLOG_OUTPUT)
+    syslogWrite(buff, strlen(buff));
+  PROFILE_ADD(PROF_UDP);
+#endif
 }
 
 // Duplicate output to all connected streams
 void MkWifiDev::print(const char *buff) {
-  if(termConnected)
-    pCommand->print(buff);
+  PROFILE_START();
+#ifndef LOCAL_SERIAL_ONLY
+  termWrite(buff, strlen(buff));
+  PROFILE_ADD(PROF_TCP);
+#endif
   
   pSerial->print(buff);
+  PROFILE_ADD(PROF_SERIAL);
 
-  if(logFile) {
-    logFile->print(buff);
-    logFile->flush();
+  fileWrite(buff, strlen(buff));
+  PROFILE_ADD(PROF_FILE);
+}
+
+// Adds output for the log file, writing it out each time a block is filled. Blocks end on a multiple of
+// MKWIFIDEV_FILE_BUFFER bytes from the start of the file, so the file system can write whole sectors
+void MkWifiDev::fileWrite(const char *data, size_t len) {
+  if(!logFile.stream)
+    return;
+
+  while(len) {
+    size_t room = MKWIFIDEV_FILE_BUFFER - (logFile.size % MKWIFIDEV_FILE_BUFFER) - logFile.len;
+    size_t n = min(len, room);
+    if(!logFile.len)
+      logFile.tFirst = millis();
+    memcpy(logFile.buff + logFile.len, data, n);
+    logFile.len += n;
+    data += n;
+    len -= n;
+
+    if(n == room) {
+      logFile.stream->write((const uint8_t*)logFile.buff, logFile.len);
+      logFile.size += logFile.len;
+      logFile.len = 0;
+    }
   }
 }
 
-#ifndef LOCAL_SERIAL_ONLY
+// Writes out any partial block & flushes the file
+void MkWifiDev::fileFlush() {
+  if(!logFile.stream || !logFile.len)
+    return;
 
-void MkWifiDev::begin(const char *ssid, const char *password, const char *mdns_name) {
-  bOtaBusy = false;
-  mdns_devname = mdns_name;
-  WiFi.hostname(mdns_name);       // Set the host name to the same as the mdns name
-  WiFi.begin(ssid, password);
+  logFile.stream->write((const uint8_t*)logFile.buff, logFile.len);
+  logFile.size += logFile.len;
+  logFile.len = 0;
+  logFile.stream->flush();
 }
 
-void MkWifiDev::setSerial(Stream &serialPort) {
-  
-  if(pCommand == pSerial)   // Make sure command stream updated (if terminal not active)
-    pCommand = &serialPort;
+// Called after each message is output. Serious messages are written straight away (in case they're followed by a crash),
+// and the file is only rotated between messages
+void MkWifiDev::fileEndMessage(MessageType type) {
+  if(!logFile.stream)
+    return;
 
-  pSerial = &serialPort;
+  if(type == ERROR || type == CRITICAL)
+    fileFlush();
+
+#ifdef MKWIFIDEV_HAS_FS
+  if(logFile.fs && logFile.maxSize && (logFile.size + logFile.len) >= logFile.maxSize)
+    rotateLogFile();
+#endif
+}
+
+#ifdef MKWIFIDEV_HAS_FS
+
+// Renames path.0 to path.1 etc, removing the oldest file, then path to path.0 and starts a new file
+void MkWifiDev::rotateLogFile() {
+  fileFlush();
+  logFile.file.close();
+
+  char from[sizeof(logFile.path)+4], to[sizeof(logFile.path)+4];
+  for(int i=logFile.maxFiles-1; i>=0; i--) {
+    snprintf(to, sizeof(to), "%s.%d", logFile.path, i);
+    if(i)
+      snprintf(from, sizeof(from), "%s.%d", logFile.path, i-1);
+    else
+      strcpy(from, logFile.path);
+
+    if(logFile.fs->exists(to))
+      logFile.fs->remove(to);
+    if(logFile.fs->exists(from))
+      logFile.fs->rename(from, to);
+  }
+
+  logFile.file = logFile.fs->open(logFile.path, "w");
+  logFile.size = 0;
+  if(!logFile.file) {   // Can't report this, we're part way through outputting a message
+    logFile.fs = nullptr;
+    logFile.stream = nullptr;
+  }
 }
+#endif
 
 void MkWifiDev::setLogFile(Stream &f) {
-  logFile = &f;
+  closeLogFile();
+  if(!logFile.buff)
+    logFile.buff = new char[MKWIFIDEV_FILE_BUFFER];
+  if(!logFile.buff)
+    return;
+
+  logFile.stream = &f;
+  logFile.size = 0;     // Position unknown, assume the start of a sector
 }
 
-void MkWifiDev::connect_loop()
-{
-  if(WiFi.status() != WL_CONNECTED) {
-    if(conn_state == connected) {
-      DBG_ALERT("Lost WiFi connection. Attempting to reconnect..");
-      conn_state = connecting;
-      pserver->close();
-      WiFi.reconnect();
-    }
-    uint32_t tnow = millis();
-    static uint32_t tprev = tnow;
-    if((tnow-tprev > 5000)) {
-      DBG_INFO("Still attempting to connect to WiFi...");
-      tprev = tnow;
-    }
+#ifdef MKWIFIDEV_HAS_FS
+bool MkWifiDev::setLogFile(fs::FS &fs, const char *path, uint32_t maxSize, uint8_t maxFiles) {
+  closeLogFile();
+  if(strlen(path) >= sizeof(logFile.path))
+    return false;
+  if(!logFile.buff)
+    logFile.buff = new char[MKWIFIDEV_FILE_BUFFER];
+  if(!logFile.buff)
+    return false;
+
+  logFile.file = fs.open(path, "a");
+  if(!logFile.file)
+    return false;
+
+  strcpy(logFile.path, path);
+  logFile.fs = &fs;
+  logFile.maxSize = maxSize;
+  logFile.maxFiles = maxFiles;
+  logFile.size = logFile.file.size();
+  logFile.stream = &logFile.file;
+  return true;
+}
+#endif
+
+void MkWifiDev::closeLogFile() {
+  flushLogs();
+#ifdef MKWIFIDEV_HAS_FS
+  if(logFile.fs)
+    logFile.file.close();
+  logFile.fs = nullptr;
+#endif
+  logFile.stream = nullptr;
+}
+
+void MkWifiDev::setLogFileFlushDelay(uint16_t ms) {
+  logFile.flushMs = ms;
+}
+
+bool MkLogRing::begin(size_t capacity, bool usePsram) {
+  end();
+
+  uint32_t size = 256;
+  while(size*2 <= capacity)
+    size *= 2;
+
+#if defined(ESP32)
+  if(usePsram && psramFound())
+    buf = (uint8_t*)ps_malloc(size);
+#else
+  (void)usePsram;
+#endif
+  if(!buf)
+    buf = (uint8_t*)malloc(size);
+  if(!buf)
+    return false;
+
+  mask = size-1;
+  head = tail = 0;
+  holding = false;
+  dropped = 0;
+  return true;
+}
+
+void MkLogRing::end() {
+  free(buf);
+  buf = nullptr;
+}
+
+void MkLogRing::put(uint32_t pos, const void *src, size_t len) {
+  uint32_t idx = pos & mask;
+  size_t n = min(len, (size_t)(mask+1-idx));    // Split copy if record wraps around end of buffer
+  memcpy(buf+idx, src, n);
+  memcpy(buf, (const uint8_t*)src+n, len-n);
+}
+
+void MkLogRing::get(uint32_t pos, void *dst, size_t len) {
+  uint32_t idx = pos & mask;
+  size_t n = min(len, (size_t)(mask+1-idx));
+  memcpy(dst, buf+idx, n);
+  memcpy((uint8_t*)dst+n, buf, len-n);
+}
+
+bool MkLogRing::push(const void *hdr, uint16_t hdrLen, const void *data, uint16_t len, bool dropOldest) {
+  startRecord(hdr, hdrLen, dropOldest);
+  append(data, len);
+  return commit();
+}
+
+void MkLogRing::startRecord(const void *hdr, uint16_t hdrLen, bool dropOldest) {
+  wrPos = head.load();
+  wrLen = 0;
+  wrOk = true;
+  wrDropOldest = dropOldest;
+  append(hdr, hdrLen);
+}
+
+void MkLogRing::append(const void *data, size_t len) {
+  if(!wrOk)
     return;
-  } 
 
-  // Already connected, nothing more to do
-  if(conn_state == connected)
+  uint16_t reclen = wrLen;
+  if(!buf || wrLen + len > UINT16_MAX || !makeRoom(sizeof(reclen) + wrLen + len)) {
+    wrOk = false;
+    dropped++;
     return;
+  }
+  put(wrPos + sizeof(reclen) + wrLen, data, len);
+  wrLen += len;
+}
 
-  conn_state = connected;
+bool MkLogRing::commit() {
+  if(!wrOk)
+    return false;
 
-  //start server
-#ifdef ESP8266
-  pserver = new WiFiServer(23);
-  pserver->begin();
-#else   // ie esp32
-  pserver = new WiFiServer;
-  pserver->begin(23);
-#endif
-  pserver->setNoDelay(true);
+  uint16_t reclen = wrLen;
+  put(wrPos, &reclen, sizeof(reclen));
+  head.store(wrPos + sizeof(reclen) + reclen);    // Publish the record
+  wrOk = false;
+  return true;
+}
 
-  DBG_ALERT("Wifi Ready! Use client (eg 'PuTTY') & connect to %s port 23", WiFi.localIP().toString().c_str());
+// Makes room for the record being added to grow to need bytes, discarding the oldest records if allowed
+bool MkLogRing::makeRoom(uint32_t need) {
+  if(need > mask+1)
+    return false;
 
-  if(mdns_devname != NULL) {
-    DBG_ALERT("mDNS Enabled - Device may be reached using '%s.local'", mdns_devname);
-    ArduinoOTA.setHostname(mdns_devname);
+  while(true) {
+    uint32_t t = tail.load();
+    bool held = holding.load();
+    uint32_t limit = held ? holdPos.load() : t;   // Can't reuse space the consumer is still reading
+    if(need <= mask+1 - (wrPos-limit))
+      return true;
+
+    if(!wrDropOldest || held || t == wrPos)
+      return false;
+
+    // Discard the oldest record. Fails (and we retry) if the consumer took it first
+    uint16_t n;
+    get(t, &n, sizeof(n));
+    if(tail.compare_exchange_strong(t, t + sizeof(n) + n))
+      dropped++;
   }
+}
 
-  DBG_ALERT("Press Ctrl-A to enter command mode.");
+int MkLogRing::popStart() {
+  while(true) {
+    uint32_t t = tail.load();
+    if(t == head.load()) {
+      holding = false;
+      return -1;
+    }
 
-  ArduinoOTA.onStart([]() {
-    WifiDev.bOtaBusy = true;
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH)
-      type = "sketch";
-    else // U_SPIFFS
-      type = "filesystem";
+    // Mark the record as in use, then make sure the producer didn't discard it in the meantime
+    holdPos = t;
+    holding = true;
+    if(tail.load() != t)
+      continue;
 
-    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-    DBG_ALERT("Started updating %s", type.c_str());
-  });
+    uint16_t n;
+    get(t, &n, sizeof(n));
+    if(!tail.compare_exchange_strong(t, t + sizeof(n) + n))
+      continue;
 
-  ArduinoOTA.onEnd([]() {
-    WifiDev.bOtaBusy = false;
-    DBG_ALERT("OTA update complete!");
-    DBG_ALERT("About to restart, please reconnect remote terminal");
-  });
+    rdPos = t + sizeof(n);
+    return n;
+  }
+}
 
-  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    static uint8_t div = 0;
-    if(!((div++)&0x7))  // Reduce output to 1/8
-      DBG_DEBUG("Progress: %u%%\r", (progress / (total / 100)));
-  });
+void MkLogRing::popRead(uint16_t ofs, void *out, uint16_t len) {
+  get(rdPos + ofs, out, len);
+}
 
-  ArduinoOTA.onError([](ota_error_t error) {
-    WifiDev.bOtaBusy = false;
-    DBG_ALERT("Error[%u]: ", error);
-    if      (error == OTA_AUTH_ERROR)    DBG_ALERT("Auth Failed");
-    else if (error == OTA_BEGIN_ERROR)   DBG_ALERT("Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) DBG_ALERT("Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) DBG_ALERT("Receive Failed");
-    else if (error == OTA_END_ERROR)     DBG_ALERT("End Failed");
-  });
+int MkLogRing::peek(uint32_t &pos, void *out, uint16_t maxLen, uint16_t ofs) {
+  if(pos == head.load())
+    return -1;
 
-  ArduinoOTA.begin();
+  uint16_t n;
+  get(pos, &n, sizeof(n));
+  if(ofs < n)
+    get(pos + sizeof(n) + ofs, out, min((uint16_t)(n - ofs), maxLen));
+  pos += sizeof(n) + n;
+  return n;
 }
 
-void MkWifiDev::configTime(long gmtOffset, int daylightOffset, const char * server) {
-  ::configTime(gmtOffset, daylightOffset, server);
-  nNtpRetries = 3;
+int MkCrashRing::attach(void *mem, size_t size) {
+  ctrl = (Ctrl*)mem;
+  data = (uint8_t*)(ctrl + 2);
+  cap = (size > 2*sizeof(Ctrl)) ? size - 2*sizeof(Ctrl) : 0;
+  adding = false;
+  if(cap < 64) {
+    ctrl = nullptr;
+    data = nullptr;
+    return -1;
+  }
+
+  // Use the copy published last, unless it was being written when the reset happened
+  int newer = (ctrl[1].seq > ctrl[0].seq) ? 1 : 0;
+  for(int i = 0; i < 2; i++) {
+    const Ctrl &c = ctrl[newer ^ i];
+    int lines = validate(c);
+    if(lines >= 0) {
+      seq = c.seq;
+      tail = c.tail;
+      used = c.used;
+      return lines;
+    }
+  }
+  clear();
+  return -1;
 }
 
-void MkWifiDev::getNtpTime() {
-  nNtpRetries = 3;
+void MkCrashRing::clear() {
+  tail = used = 0;
+  adding = false;
+  publish();
+  publish();    // Both copies, so neither can refer to older lines
 }
 
-bool MkWifiDev::isOtaBusy() {
-  return bOtaBusy;
+// Checks that the lines from tail exactly fill used, each with a valid header
+int MkCrashRing::validate(const Ctrl &c) {
+  if(c.magic != MAGIC || c.check != checkOf(c) || c.tail >= cap || c.used > cap)
+    return -1;
+
+  int lines = 0;
+  for(uint32_t ofs = 0; ofs < c.used; lines++) {
+    uint16_t hdr[2];
+    if(c.used - ofs < HDR)
+      return -1;
+    get(c.tail + ofs, hdr, HDR);
+    if(hdr[0] > maxLine() || c.used - ofs - HDR < hdr[0] ||
+       hdr[1] != lineCheck(hdr[0], sumAt(c.tail + ofs + HDR, hdr[0])))
+      return -1;
+    ofs += HDR + hdr[0];
+  }
+  return lines;
 }
 
-#endif
+void MkCrashRing::publish() {
+  Ctrl c = { MAGIC, ++seq, tail, used, 0 };
+  c.check = checkOf(c);
+  ctrl[seq & 1] = c;
+}
 
-int MkWifiDev::available() {
-  if(bCommandMode)
-    return 0;
+void MkCrashRing::begin() {
+  if(!data)
+    return;
+  lineLen = 0;
+  lineSum = 0;
+  adding = true;
+}
 
-  int ret = pCommand->available();
+// Lines are only added after the ones published, so a reset part way through leaves the published ones intact
+void MkCrashRing::append(const char *text, size_t len) {
+  if(!adding)
+    return;
+  len = min(len, (size_t)(maxLine() - lineLen));
+  if(!len)
+    return;
+  makeRoom(HDR + lineLen + len);
+  put(tail + used + HDR + lineLen, text, len);
+  lineLen += len;
+  lineSum = sumOf(lineSum, (const uint8_t*)text, len);
+}
 
-  return (ret && (peek() == 0x01)) ? 0 : ret;   // Hide Ctrl-A from being available to app (loop will handle it)
+void MkCrashRing::commit() {
+  if(!adding)
+    return;
+  makeRoom(HDR + lineLen);
+  uint16_t hdr[2] = { (uint16_t)lineLen, lineCheck(lineLen, lineSum) };
+  put(tail + used, hdr, HDR);
+  used += HDR + lineLen;
+  adding = false;
+  publish();
 }
 
+// Read the line at pos (from first()), copying up to maxLen bytes of it
+int MkCrashRing::read(uint32_t &pos, char *out, size_t maxLen) {
+  if(!data || pos >= used)
+    return -1;
+  uint16_t hdr[2];
+  get(tail + pos, hdr, HDR);
+  get(tail + pos + HDR, out, min((size_t)hdr[0], maxLen));
+  pos += HDR + hdr[0];
+  return hdr[0];
+}
 
-int MkWifiDev::read() {
-  if(bCommandMode)
-    return 0;
+// Drops the oldest lines until there is room for need bytes after the complete ones. The new positions are published
+// before the space is reused
+void MkCrashRing::makeRoom(uint32_t need) {
+  if(cap - used >= need)
+    return;
+  while(used && cap - used < need) {
+    uint16_t hdr[2];
+    get(tail, hdr, HDR);
+    tail = (tail + HDR + hdr[0]) % cap;
+    used -= HDR + hdr[0];
+  }
+  publish();
+}
 
-  return pCommand->read();
+// Fletcher-16 checksum, continued from sum, so a line's text can be checked as well as its length
+uint16_t MkCrashRing::sumOf(uint16_t sum, const uint8_t *p, size_t len) {
+  uint16_t a = sum & 0xFF, b = sum >> 8;
+  while(len--) {
+    a += *p++;
+    if(a >= 255)
+      a -= 255;
+    b += a;
+    if(b >= 255)
+      b -= 255;
+  }
+  return b << 8 | a;
 }
 
-void MkWifiDev::setDisplayModeFlags(uint8_t flags) {
-  dispMode |= flags;
+// Checksum of len bytes of the ring at ofs
+uint16_t MkCrashRing::sumAt(uint32_t ofs, size_t len) {
+  ofs %= cap;
+  size_t n = min(len, (size_t)(cap - ofs));
+  return sumOf(sumOf(0, data + ofs, n), data, len - n);
 }
 
-void MkWifiDev::clearDisplayModeFlags(uint8_t flags) {
-  dispMode &= ~flags;
+void MkCrashRing::put(uint32_t ofs, const void *src, size_t len) {
+  ofs %= cap;
+  size_t n = min(len, (size_t)(cap - ofs));
+  memcpy(data + ofs, src, n);
+  memcpy(data, (const uint8_t*)src + n, len - n);
 }
 
-uint8_t MkWifiDev::toggleTypeEnableFlag(uint8_t flagIndex) {
-  return enableFlags ^= (1 << flagIndex);
+void MkCrashRing::get(uint32_t ofs, void *dst, size_t len) {
+  ofs %= cap;
+  size_t n = min(len, (size_t)(cap - ofs));
+  memcpy(dst, data + ofs, n);
+  memcpy((uint8_t*)dst + n, data, len - n);
 }
 
-bool MkWifiDev::IsMessageMuted(MessageType type) {
-  if(type < 16) {
-    if(bCommandMode)
-      return true;
+static_assert((MKWIFIDEV_ISR_SLOTS & (MKWIFIDEV_ISR_SLOTS-1)) == 0, "MKWIFIDEV_ISR_SLOTS must be a power of 2");
 
-    if(!(enableFlags & (1 << type)))
-      return true;
+MkIsrRing::MkIsrRing() {
+  for(uint32_t i=0; i<MKWIFIDEV_ISR_SLOTS; i++)
+    slots[i].seq.store(i, std::memory_order_relaxed);
+}
+
+// A producer claims the slot at head by moving head past it, fills it, then sets its sequence number to show it's
+// ready. If it's interrupted in between, later records wait behind it rather than being output first
+bool MKWIFIDEV_IRAM MkIsrRing::push(const MkIsrRecord &rec) {
+  uint32_t pos = head.load(std::memory_order_relaxed);
+  while(true) {
+    auto &slot = slots[pos % MKWIFIDEV_ISR_SLOTS];
+    int32_t diff = slot.seq.load(std::memory_order_acquire) - pos;
+    if(diff < 0) {
+      dropped++;      // Full, the consumer hasn't emptied this slot yet
+      return false;
+    }
+    if(diff > 0)
+      pos = head.load(std::memory_order_relaxed);     // Claimed by another producer
+    else if(head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+      // Copied field by field, so no library function is called (which may not be in IRAM)
+      slot.rec.format = rec.format;
+      slot.rec.tag = rec.tag;
+      slot.rec.us = rec.us;
+      slot.rec.type = rec.type;
+      for(int i=0; i<MkIsrRecord::MAX_ARGS; i++)
+        slot.rec.args[i] = rec.args[i];
+      slot.seq.store(pos+1, std::memory_order_release);
+      return true;
+    }
+  }
+}
+
+const MkIsrRecord *MkIsrRing::front() {
+  auto &slot = slots[tail % MKWIFIDEV_ISR_SLOTS];
+  return (slot.seq.load(std::memory_order_acquire) == tail+1) ? &slot.rec : nullptr;
+}
+
+void MkIsrRing::pop() {
+  slots[tail % MKWIFIDEV_ISR_SLOTS].seq.store(tail + MKWIFIDEV_ISR_SLOTS, std::memory_order_release);
+  tail++;
+}
+
+bool MkWifiDev::setAsyncLogging(size_t capacity, QueuePolicy policy) {
+  flushLogs();
+
+  // Other tasks queue messages with the lock held, so it's held while the queue is replaced (after writing out any
+  // they queued since the flush)
+  lockReport();
+  drainLogs(UINT32_MAX);
+  bDropOldest = (policy == DROP_OLDEST);
+  bool ok = true;
+  if(!capacity)
+    logQueue.end();
+  else
+    ok = logQueue.begin(capacity);
+  unlockReport();
+  return ok;
+}
+
+// Starts sending a message (text, or a binary record if text is false) to the outputs. It is written in parts by
+// outputPart(), so it needn't be held in a buffer, and finished by outputEnd(). It's also added to the backlog if
+// it's for remote terminals
+void MkWifiDev::outputBegin(MessageType type, uint8_t outputs, bool text) {
+  outMsg.type = type;
+  outMsg.outputs = outputs;
+  outMsg.text = text;
+
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & TERMINAL_OUTPUT)
+    for(auto &c : terms)
+      if(c.state == TermClient::ACTIVE)
+        clientBeginLine(c);
+  if(outputs & SYSLOG_OUTPUT)
+    syslogBegin();
+#endif
+
+  if((outputs & TERMINAL_OUTPUT) && backlog.isActive()) {
+    lineCount++;
+    backlog.startRecord(&lineCount, sizeof(lineCount), true);
+  }
+}
+
+void MkWifiDev::outputPart(const char *data, size_t len) {
+  uint8_t outputs = outMsg.outputs;
+  PROFILE_START();
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & TERMINAL_OUTPUT)
+    for(auto &c : terms)
+      clientPart(c, data, len);
+  PROFILE_ADD(PROF_TCP);
+#endif
+
+  if(outputs & SERIAL_OUTPUT)
+    pSerial->write((const uint8_t*)data, len);
+  PROFILE_ADD(PROF_SERIAL);
+
+  if(outputs & FILE_OUTPUT)
+    fileWrite(data, len);
+  PROFILE_ADD(PROF_FILE);
+
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & SYSLOG_OUTPUT)
+    syslogPart(data, len);
+  PROFILE_ADD(PROF_UDP);
+#endif
+
+  if((outputs & TERMINAL_OUTPUT) && backlog.isActive())
+    backlog.append(data, len);
+}
+
+void MkWifiDev::outputEnd() {
+  uint8_t outputs = outMsg.outputs;
+  PROFILE_START();
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & TERMINAL_OUTPUT)
+    for(auto &c : terms)
+      clientEndLine(c, outMsg.text);
+  PROFILE_ADD(PROF_TCP);
+#endif
+
+  if((outputs & SERIAL_OUTPUT) && outMsg.text)
+    pSerial->println();
+  PROFILE_ADD(PROF_SERIAL);
+
+  if(outputs & FILE_OUTPUT) {
+    if(outMsg.text)
+      fileWrite("\r\n", 2);
+    fileEndMessage(MessageType(outMsg.type));
+  }
+  PROFILE_ADD(PROF_FILE);
+
+#ifndef LOCAL_SERIAL_ONLY
+  if(outputs & SYSLOG_OUTPUT)
+    syslogEnd();
+  PROFILE_ADD(PROF_UDP);
+#endif
+
+  if((outputs & TERMINAL_OUTPUT) && backlog.isActive())
+    backlog.commit();
+}
+
+// As outputBegin() etc, but the message is queued for loop() if asynchronous logging is enabled
+void MkWifiDev::emitBegin(MessageType type, uint8_t outputs, bool text) {
+#if MKWIFIDEV_CRASH_LOG
+  // Text lines are kept for after a reset, once each (not the JSON Lines copy)
+  if(!crashLog.started)
+    crashLogStart();
+  crashLog.recording = text && (outputs & ~jsonOutputs & CONSOLE_OUTPUTS) && !crashLog.replaying;
+  if(crashLog.recording)
+    crashRing.begin();
+#endif
+
+  bQueueing = logQueue.isActive();
+  if(bQueueing) {
+    uint8_t hdr[2] = { type, outputs };
+    logQueue.startRecord(hdr, sizeof(hdr), bDropOldest);
+    return;
+  }
+
+  // Flush the serial port before sending the next message to prevent overflow of the transmit buffer if
+  // there is a burst of messages (although this will slow down the program creating the output!)
+  PROFILE_START();
+  if(outputs & SERIAL_OUTPUT)
+    pSerial->flush();
+  PROFILE_ADD(PROF_SERIAL);
+
+  outputBegin(type, outputs, text);
+}
+
+void MkWifiDev::emitPart(const char *data, size_t len) {
+#if MKWIFIDEV_CRASH_LOG
+  if(crashLog.recording)
+    crashRing.append(data, len);
+#endif
+  if(bQueueing)
+    logQueue.append(data, len);
+  else
+    outputPart(data, len);
+}
+
+void MkWifiDev::emitEnd() {
+#if MKWIFIDEV_CRASH_LOG
+  if(crashLog.recording)
+    crashRing.commit();
+#endif
+  if(bQueueing)
+    logQueue.commit();
+  else
+    outputEnd();
+}
+
+// Send the line to the outputs now, or queue it for loop() if asynchronous logging is enabled
+void MkWifiDev::emitLine(const char *buff, MessageType type, uint8_t outputs) {
+  emitBegin(type, outputs, true);
+  emitPart(buff, strlen(buff));
+  emitEnd();
+}
+
+void MkWifiDev::emitRecord(const uint8_t *rec, size_t len, MessageType type, uint8_t outputs) {
+  emitBegin(type, outputs, false);
+  emitPart((const char*)rec, len);
+  emitEnd();
+}
+
+void MkWifiDev::drainLogs(uint32_t budgetMs) {
+  if(!logQueue.isActive())
+    return;
+
+  char buff[MKWIFIDEV_FORMAT_CHUNK];
+  uint32_t tstart = millis();
+  do {
+    // The lock is held for each record, so loop() & flushLogs() on another task can't both take from the queue
+    // (it has a single consumer) & other tasks can still queue messages in between
+    lockReport();
+    int len = logQueue.popStart();
+    if(len < 0) {
+      // Queue has recovered, report any messages lost while it was full
+      uint32_t n = logQueue.takeDropped();
+      if(n) {
+        queueDropped += n;
+        Report(nullptr, ALERT, "Log queue full, %u message(s) dropped", n);
+      }
+      unlockReport();
+      if(!n)
+        break;
+      continue;
+    }
+
+    // Records are copied out in chunks. One that fits in buff is released before it's output, a longer one
+    // stays in the queue (so the producer can't overwrite it) until it has all been output
+    int n = min(len, (int)sizeof(buff));
+    logQueue.popRead(0, buff, n);
+    if(n == len)
+      logQueue.popEnd();
+
+    // Skip message type & outputs header
+    outputBegin(MessageType((uint8_t)buff[0]), buff[1], len < 3 || buff[2] != BINARY_RECORD_MARK);
+    outputPart(buff+2, n-2);
+    for(int ofs = n; ofs < len; ofs += n) {
+      n = min(len - ofs, (int)sizeof(buff));
+      logQueue.popRead(ofs, buff, n);
+      outputPart(buff, n);
+    }
+    if(len > (int)sizeof(buff))
+      logQueue.popEnd();
+    outputEnd();
+    unlockReport();
+  } while((millis()-tstart) < budgetMs);
+}
+
+bool MkWifiDev::setBacklog(size_t capacity) {
+  lockReport();
+  bool ok = true;
+  if(!capacity)
+    backlog.end();
+  else
+    ok = backlog.begin(capacity, true);
+  unlockReport();
+  return ok;
+}
+
+void MkWifiDev::flushLogs() {
+  drainIsrLogs();
+  drainLogs(UINT32_MAX);
+  lockReport();
+#ifndef LOCAL_SERIAL_ONLY
+  termFlush();
+#endif
+  fileFlush();
+#ifndef LOCAL_SERIAL_ONLY
+  syslogFlush();
+#endif
+  pSerial->flush();
+  unlockReport();
+}
+
+void MkLzStream::insert(uint16_t at) {
+  uint32_t h = hash(win + at);
+#if MKWIFIDEV_ZIP_CHAIN > 1
+  prev[at] = head[h];
+#endif
+  head[h] = at + 1;
+}
+
+// Moves the last MKWIFIDEV_ZIP_WINDOW bytes to the start of win, making room for a block
+void MkLzStream::slide() {
+  uint16_t shift = pos - MKWIFIDEV_ZIP_WINDOW;
+  memmove(win, win + shift, MKWIFIDEV_ZIP_WINDOW);
+  for(auto &h : head)
+    h = (h > shift) ? h - shift : 0;
+#if MKWIFIDEV_ZIP_CHAIN > 1
+  for(int i=0; i<MKWIFIDEV_ZIP_WINDOW; i++)
+    prev[i] = (prev[i + shift] > shift) ? prev[i + shift] - shift : 0;
+#endif
+  pos = MKWIFIDEV_ZIP_WINDOW;
+}
+
+static uint8_t *lzLiterals(uint8_t *out, const uint8_t *data, size_t len) {
+  while(len) {
+    size_t n = min(len, (size_t)128);
+    *out++ = n - 1;
+    memcpy(out, data, n);
+    out += n;
+    data += n;
+    len -= n;
+  }
+  return out;
+}
+
+size_t MkLzStream::compress(const uint8_t *in, size_t len, uint8_t *out) {
+  if(pos + len > sizeof(win))
+    slide();
+  memcpy(win + pos, in, len);
+
+  uint8_t *start = out;
+  size_t end = pos + len;
+  size_t literals = pos;      // Start of the bytes not yet output
+  while(pos < end) {
+    // Find the longest match amongst the earlier positions with the same hash
+    size_t best = 0, dist = 0;
+    if(end - pos >= MIN_MATCH) {
+      size_t maxLen = min(end - pos, (size_t)MAX_MATCH);
+      uint16_t cand = head[hash(win + pos)];
+      for(int tries = MKWIFIDEV_ZIP_CHAIN; cand && tries--; ) {
+        size_t at = cand - 1;
+        if(pos - at > MKWIFIDEV_ZIP_WINDOW)
+          break;
+        size_t n = 0;
+        while(n < maxLen && win[at + n] == win[pos + n])
+          n++;
+        if(n > best) {
+          best = n;
+          dist = pos - at;
+          if(n == maxLen)
+            break;
+        }
+#if MKWIFIDEV_ZIP_CHAIN > 1
+        cand = prev[at];
+#endif
+      }
+      insert(pos);
+    }
+    if(best < MIN_MATCH) {
+      pos++;
+      continue;
+    }
+
+    out = lzLiterals(out, win + literals, pos - literals);
+    size_t l = best - MIN_MATCH;
+    dist--;
+    *out++ = 0x80 | min(l, (size_t)15) << 3 | dist >> 8;
+    *out++ = dist;
+    if(l >= 15)
+      *out++ = l - 15;
+
+    for(size_t i=1; i<best; i++)    // Positions within the match can be matched later
+      if(end - (pos + i) >= MIN_MATCH)
+        insert(pos + i);
+    pos += best;
+    literals = pos;
+  }
+  return lzLiterals(out, win + literals, end - literals) - start;
+}
+
+void MkWifiLink::begin(uint32_t now) {
+  state = CONNECTING;
+  tDown = now;
+  tNext = now + minWait;
+  backoff = min(2*minWait, maxWait);
+  attempt = 0;
+}
+
+MkWifiLink::Action MkWifiLink::poll(uint32_t now) {
+  uint8_t ev = events.exchange(0, std::memory_order_acquire);
+  if(state == IDLE)
+    return NONE;
+
+  if((ev & LOST) && state == CONNECTED) {
+    state = RECONNECTING;
+    tDown = now;
+    tNext = now;          // First attempt straight away
+    backoff = minWait;
+    attempt = 0;
+    if(linkUp.load(std::memory_order_relaxed))
+      events.fetch_or(GOT_IP, std::memory_order_relaxed);    // Already back, so UP next time
+    return DOWN;
+  }
+
+  if(ev && state != CONNECTED && linkUp.load(std::memory_order_relaxed)) {
+    uint32_t ms = now - tDown;
+    if(state == RECONNECTING) {
+      reconnects++;
+      lastMs = ms;
+      maxMs = max(maxMs, ms);
+      totalMs += ms;
+    } else
+      firstMs = ms;
+    connects++;
+    state = CONNECTED;
+    return UP;
+  }
+
+  if(state != CONNECTED && (int32_t)(now - tNext) >= 0) {
+    attempt++;
+    attempts++;
+    tNext = now + backoff;
+    backoff = min(2*backoff, maxWait);
+    return RETRY;
+  }
+  return NONE;
+}
+
+#ifndef LOCAL_SERIAL_ONLY
+
+// Adds output for all remote terminals. Each line is either added in full or dropped
+void MkWifiDev::termWrite(const char *data, size_t len, bool crlf) {
+  for(auto &c : terms)
+    if(c.state == TermClient::ACTIVE)
+      clientWrite(c, data, len, crlf);
+}
+
+void MkWifiDev::termFlush() {
+  for(auto &c : terms)
+    clientFlush(c);
+}
+
+bool MkWifiDev::clientWrite(TermClient &c, const char *data, size_t len, bool crlf) {
+  clientBeginLine(c);
+  clientPart(c, data, len);
+  bool added = (c.line != TermClient::DROPPED);
+  clientEndLine(c, crlf);
+  return added;
+}
+
+// Starts a line which is added in parts. If the client can't keep up the whole line is removed again & counted as
+// dropped, so it gets whole lines only. A line too long for the buffer is sent as it's added, and cut short if the
+// connection won't take it all
+void MkWifiDev::clientBeginLine(TermClient &c) {
+  c.line = TermClient::ADDING;
+  c.lineStart = c.len;
+  if(c.dropped) {   // Let the client know what it missed, if there's room for this line too
+    char notice[40];
+    clientPart(c, notice, sprintf(notice, "*** %u lines dropped ***\r\n", c.dropped));
+  }
+}
+
+void MkWifiDev::clientPart(TermClient &c, const char *data, size_t len) {
+  const size_t room = sizeof(c.buff) - 2;     // Always leave room for the line end
+  while(len && c.line == TermClient::ADDING) {
+    if(c.len + len > room)
+      clientFlush(c);     // Try to make room
+
+    size_t n = (c.len < room) ? min(len, room - c.len) : 0;   // The backlog replay may have filled it past room
+    if(!n || (n < len && c.lineStart >= 0 && c.len - c.lineStart + len <= room)) {
+      if(c.lineStart >= 0) {
+        c.len = c.lineStart;
+        c.line = TermClient::DROPPED;
+      } else
+        c.line = TermClient::CUT;     // Some has been sent already
+      return;
+    }
+    clientAppend(c, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+void MkWifiDev::clientEndLine(TermClient &c, bool crlf) {
+  if(c.line == TermClient::DROPPED) {
+    c.dropped++;
+    c.droppedTotal++;
+    tcpDropped++;
+  } else if(c.line != TermClient::NO_LINE) {
+    c.dropped = 0;
+    if(crlf)
+      clientAppend(c, "\r\n", 2);
+  }
+  c.line = TermClient::NO_LINE;
+}
+
+void MkWifiDev::clientAppend(TermClient &c, const char *data, size_t len) {
+  if(!c.len)
+    c.tFirst = millis();
+
+  memcpy(c.buff + c.len, data, len);
+  c.len += len;
+
+  if(c.len == sizeof(c.buff))
+    clientFlush(c);
+}
+
+// Sends as much of the buffered output as the connection will take without waiting
+void MkWifiDev::clientFlush(TermClient &c) {
+  if(c.zip) {
+    zipFlush(c);
+    return;
+  }
+  if(!c.len)
+    return;
+
+  int n = clientSend(c, c.buff, c.len);
+  if(n < 0) {
+    c.len = 0;        // Connection failed, loop() will clean up
+    c.lineStart = -1;
+    return;
+  }
+  c.len -= n;
+  memmove(c.buff, c.buff + n, c.len);
+  c.lineStart = (c.lineStart >= n) ? c.lineStart - n : -1;
+}
+
+// As clientFlush() for a compressed terminal. The buffered output is compressed once the previous block has all been
+// sent, and can't be dropped after that
+void MkWifiDev::zipFlush(TermClient &c) {
+  TermZip &z = *c.zip;
+  if(z.sent == z.len && c.len) {
+    uint32_t tStart = mkCycleCount();
+    z.len = z.lz.compress((const uint8_t*)c.buff, c.len, z.out);
+    zipCycles += mkCycleCount() - tStart;
+    zipIn += c.len;
+    zipOut += z.len;
+    z.sent = 0;
+    c.len = 0;
+    c.lineStart = -1;
+  }
+  if(z.sent == z.len)
+    return;
+
+  int n = clientSend(c, z.out + z.sent, z.len - z.sent);
+  z.sent = (n < 0) ? z.len : z.sent + n;
+}
+
+// Sends as much as the connection will take without waiting. Returns the number of bytes sent, or -1 if the
+// connection has failed
+int MkWifiDev::clientSend(TermClient &c, const void *data, size_t len) {
+#if defined(ESP32)
+  int n = send(c.client.fd(), data, len, MSG_DONTWAIT);
+  if(n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+#else
+  int n = min(c.client.availableForWrite(), (int)len);
+  if(n > 0)
+    n = c.client.write((const uint8_t*)data, n);
+#endif
+  if(n <= 0)
+    return 0;
+
+  c.segments++;
+  c.bytesSent += n;
+  tcpSegments++;
+  tcpBytes += n;
+  return n;
+}
+
+// Sent by a client (eg tools/mkzcat.py) as soon as it connects to ask for compressed output, and sent back if the
+// request is accepted
+static const char zipHello[] = "\033MKZ1";
+
+// Checks for a request for compressed output, which must arrive before the welcome message is sent
+void MkWifiDev::zipStart(TermClient &c) {
+  const size_t len = sizeof(zipHello) - 1;
+  if(c.client.peek() != zipHello[0] || c.client.available() < (int)len)
+    return;
+
+  char hello[len];
+  for(auto &ch : hello)
+    ch = c.client.read();
+  if(memcmp(hello, zipHello, len))
+    return;
+
+  TermZip *z = new (std::nothrow) TermZip();
+  if(!z) {
+    DBG_ERROR("Not enough memory for compressed output, sending it uncompressed");
+    return;
+  }
+  clientSend(c, zipHello, len);
+  c.zip = z;
+}
+
+// Sends the next part of the backlog to a newly connected terminal, as much as will fit in its buffer. Live output
+// isn't sent to the terminal until it has caught up, so messages stay in order
+void MkWifiDev::clientReplay(TermClient &c) {
+  uint8_t hdr[sizeof(lineCount) + 1];
+  char notice[64];
+
+  lockReport();
+  if((int32_t)(c.replayPos - backlog.first()) < 0)
+    c.replayPos = backlog.first();      // Overwritten before it could be sent
+
+  while(true) {
+    uint32_t pos = c.replayPos;
+    int len = backlog.peek(pos, hdr, sizeof(hdr));
+    if(len < 0)
+      break;
+
+    uint32_t seq;
+    memcpy(&seq, hdr, sizeof(seq));
+    notice[0] = '\0';
+    if(!c.replaySeq)
+      sprintf(notice, "*** Replaying earlier output from message %u ***\r\n", seq);
+    else if(seq != c.replaySeq)
+      sprintf(notice, "*** Messages %u to %u lost ***\r\n", c.replaySeq, seq-1);
+
+    // The message is copied straight into the client's buffer. One too long for the buffer is cut short
+    bool crlf = (hdr[sizeof(seq)] != BINARY_RECORD_MARK);
+    size_t extra = strlen(notice) + (crlf ? 2 : 0);
+    len = min((size_t)len - sizeof(seq), sizeof(c.buff) - extra);
+    if(extra + len > sizeof(c.buff) - c.len)
+      break;      // Continue on the next call
+
+    clientAppend(c, notice, strlen(notice));
+    if(!c.len)
+      c.tFirst = millis();
+    uint32_t at = c.replayPos;
+    backlog.peek(at, c.buff + c.len, len, sizeof(seq));
+    c.len += len;
+    if(crlf)
+      clientAppend(c, "\r\n", 2);
+    c.replayPos = pos;
+    c.replaySeq = seq+1;
+  }
+
+  if(c.replayPos == backlog.last()) {
+    if(c.replaySeq) {
+      sprintf(notice, "*** End of earlier output (message %u) ***", c.replaySeq-1);
+      clientWrite(c, notice, strlen(notice), true);
+    }
+    c.state = TermClient::ACTIVE;     // Done while locked so no live output is missed
+  }
+  clientFlush(c);
+  unlockReport();
+}
+
+void MkWifiDev::terminal_loop() {
+  // The terminals' buffers are written by any task logging, so they're only changed or sent with the lock held
+  lockReport();
+
+  // Check for terminals that have disconnected
+  for(int i=0; i<MKWIFIDEV_MAX_CLIENTS; i++) {
+    TermClient &c = terms[i];
+    if(c.state == TermClient::FREE || c.client.connected())
+      continue;
+
+    c.client.stop();
+    c.state = TermClient::FREE;
+    c.len = 0;
+    delete c.zip;
+    c.zip = nullptr;
+
+    if(i != ctrlClient) {
+      DBG_ALERT("Remote terminal %d disconnected", i+1);
+      continue;
+    }
+
+    // Pass control to another terminal if there is one
+    bCommandMode = false;
+    ctrlClient = -1;
+    for(int j=0; j<MKWIFIDEV_MAX_CLIENTS; j++)
+      if(terms[j].state == TermClient::ACTIVE) {
+        ctrlClient = j;
+        break;
+      }
+
+    if(ctrlClient < 0) {
+      DBG_ALERT("Remote terminal disconnected, resuming control by serial port");
+      termConnected = 0;
+      pCommand = pSerial;
+    } else {
+      DBG_ALERT("Remote terminal %d disconnected, control passed to terminal %d", i+1, ctrlClient+1);
+      pCommand = &terms[ctrlClient].client;
+    }
+  }
+
+  //check if there are any new clients
+  if (pserver && pserver->hasClient()){
+    #if defined(ESP32)
+      WiFiClient newClient = pserver->available();
+    #elif defined(ESP8266)
+      WiFiClient newClient = pserver->accept();
+    #endif
+
+    TermClient *c = nullptr;
+    for(auto &t : terms)
+      if(t.state == TermClient::FREE) {
+        c = &t;
+        break;
+      }
+
+    if(!c) {
+      DBG_ALERT("Rejected connection from %s, maximum of %d terminals already connected", 
+        newClient.remoteIP().toString().c_str(), MKWIFIDEV_MAX_CLIENTS);
+      newClient.stop();
+    } else {
+      DBG_ALERT("Client connected with IP: %s", newClient.remoteIP().toString().c_str());
+      c->client = newClient;
+      c->state = TermClient::WELCOME;
+      c->tConnect = millis();
+      c->len = 0;
+      c->dropped = c->droppedTotal = c->segments = c->bytesSent = 0;
+    }
+  }
+
+  for(int i=0; i<MKWIFIDEV_MAX_CLIENTS; i++) {
+    TermClient &c = terms[i];
+
+    if(c.state == TermClient::WELCOME) {
+      if((millis() - c.tConnect) > 100) {   // Wait a bit after connection to ensure message goes through
+        zipStart(c);
+        bool bControl = (ctrlClient < 0);
+        const char *welcome[] = { " +---------------------------------------------+",
+                                  " |     Connected to remote device via WiFi     |",
+                       bControl ? " |        Press Ctrl-A for Command Mode        |"
+                                : " |  View only - another terminal has control   |",
+                                  " +---------------------------------------------+" };
+        for(auto text : welcome)
+          clientWrite(c, text, strlen(text), true);
+        clientFlush(c);
+
+        if(bControl)
+          ctrlClient = i;     // Reserve control, it's taken once the backlog has been sent
+        c.replayPos = backlog.first();
+        c.replaySeq = 0;
+        c.state = TermClient::REPLAY;
+      }
+      continue;
+    }
+
+    if(c.state == TermClient::REPLAY) {
+      clientReplay(c);
+      if(c.state == TermClient::ACTIVE && i == ctrlClient) {
+        termConnected = 1;
+        pCommand = &c.client;
+        bCommandMode = false;
+      }
+#if MKWIFIDEV_CRASH_LOG
+      if(c.state == TermClient::ACTIVE && crashLog.prev && crashLog.shown) {
+        crashLogReplay(TERMINAL_OUTPUT, i);     // Only this terminal, the first to connect since the reset
+        free(crashLog.prev);
+        crashLog.prev = nullptr;
+      }
+#endif
+      continue;
+    }
+
+    if(c.state != TermClient::ACTIVE)
+      continue;
+
+    // Send any output that has waited long enough, and the rest of any compressed block
+    if((c.len && (millis() - c.tFirst) >= tcpFlushMs) || (c.zip && c.zip->sent < c.zip->len))
+      clientFlush(c);
+
+    // Only the terminal with control may send commands or input to the application
+    if(i != ctrlClient)
+      while(c.client.available())
+        c.client.read();
+  }
+  unlockReport();
+}
+
+void MkWifiDev::setTcpFlushDelay(uint16_t ms) {
+  tcpFlushMs = ms;
+}
+
+void MkWifiDev::getTcpStats(uint32_t &segments, uint32_t &bytes) {
+  segments = tcpSegments;
+  bytes = tcpBytes;
+}
+
+bool MkWifiDev::setSyslog(const char *host, uint16_t port, uint8_t facility) {
+  lockReport();
+  syslogFlush();
+  delete[] syslog.buff;
+  syslog.buff = nullptr;
+  syslog.resolved = false;
+  if(host && strlen(host) < sizeof(syslog.host)) {
+    strcpy(syslog.host, host);
+    syslog.port = port;
+    syslog.facility = facility;
+    syslog.resolved = syslog.ip.fromString(host);     // Names are looked up by loop() once connected
+    syslog.tResolve = millis();
+    syslog.buff = new char[MKWIFIDEV_UDP_BUFFER];
+  }
+  unlockReport();
+  return !host || syslog.buff;
+}
+
+void MkWifiDev::setSyslogFlushDelay(uint16_t ms) {
+  syslog.flushMs = ms;
+}
+
+void MkWifiDev::getSyslogStats(uint32_t &datagrams, uint32_t &sent, uint32_t &dropped) {
+  datagrams = syslog.datagrams;
+  sent = syslog.sent;
+  dropped = syslog.dropped;
+}
+
+void MkWifiDev::syslogWrite(const char *data, size_t len) {
+  syslogBegin();
+  syslogPart(data, len);
+  syslogEnd();
+}
+
+// Starts adding a message to the datagram being built. Messages are dropped (and counted) while not connected, so
+// logging never waits for the network
+void MkWifiDev::syslogBegin() {
+  syslog.msgStart = -1;
+  if(!syslog.buff)
+    return;
+  if(!wifiLink.isConnected() || !syslog.resolved) {
+    syslog.dropped++;
+    return;
+  }
+
+  if(syslog.len + 1 >= MKWIFIDEV_UDP_BUFFER)
+    syslogFlush();
+  if(syslog.len)
+    syslog.buff[syslog.len++] = '\n';    // One message per line
+  else
+    syslog.tFirst = millis();
+  syslog.msgStart = syslog.len;
+}
+
+// Adds part of the message. If the datagram fills, the messages before it are sent first. A message which doesn't
+// fit in a datagram on its own is cut short
+void MkWifiDev::syslogPart(const char *data, size_t len) {
+  if(syslog.msgStart < 0)
+    return;
+
+  if(syslog.len + len > MKWIFIDEV_UDP_BUFFER && syslog.msgStart > 0) {
+    uint16_t n = syslog.len - syslog.msgStart;
+    syslog.len = syslog.msgStart - 1;     // Without the separator
+    syslogFlush();
+    memmove(syslog.buff, syslog.buff + syslog.msgStart, n);
+    syslog.len = n;
+    syslog.msgStart = 0;
+    syslog.tFirst = millis();
+  }
+
+  len = min(len, (size_t)(MKWIFIDEV_UDP_BUFFER - syslog.len));
+  memcpy(syslog.buff + syslog.len, data, len);
+  syslog.len += len;
+}
+
+void MkWifiDev::syslogEnd() {
+  if(syslog.msgStart < 0)
+    return;
+
+  syslog.msgStart = -1;
+  syslog.pending++;
+  if(!syslog.flushMs)
+    syslogFlush();
+}
+
+void MkWifiDev::syslogFlush() {
+  if(!syslog.len)
+    return;
+
+  if(syslog.udp.beginPacket(syslog.ip, syslog.port) && 
+     syslog.udp.write((const uint8_t*)syslog.buff, syslog.len) == syslog.len && syslog.udp.endPacket()) {
+    syslog.datagrams++;
+    syslog.sent += syslog.pending;
+  } else
+    syslog.dropped += syslog.pending;   // eg no buffers available, don't wait for them
+
+  syslog.len = 0;
+  syslog.pending = 0;
+}
+
+// Looks up the syslog server's address & sends any output which has waited long enough
+void MkWifiDev::syslog_loop() {
+  if(!syslog.buff)
+    return;
+
+  if(!syslog.resolved && wifiLink.isConnected() && (millis() - syslog.tResolve) >= 10000) {
+    syslog.tResolve = millis();
+    IPAddress ip;
+    if(WiFi.hostByName(syslog.host, ip)) {
+      syslog.ip = ip;
+      syslog.resolved = true;
+    } else
+      reportText(nullptr, ERROR, "Syslog server '%s' not found, will retry", syslog.host);
+  }
+
+  lockReport();
+  if(syslog.len && (millis() - syslog.tFirst) >= syslog.flushMs)
+    syslogFlush();
+  unlockReport();
+}
+
+void MkWifiDev::showNetworkStats(char *line) {
+  printFullLine(line);
+  strcpy(line, " |  Network Statistics");
+  printWithEnd(line);
+  printFullLine(line);
+  uint32_t tnow = millis();
+  if(wifiLink.isConnected())
+    snprintf(line, TERMINAL_WIDTH-2, " |  WiFi: Connected, RSSI %d dBm, first connect took %.1f s", (int)WiFi.RSSI(), 
+      wifiLink.firstMs / 1000.0f);
+  else
+    snprintf(line, TERMINAL_WIDTH-2, " |  WiFi: %s for %u s, attempt %u, next in %u s", 
+      (wifiLink.getState() == MkWifiLink::RECONNECTING) ? "Reconnecting" : "Connecting", wifiLink.getDownFor(tnow)/1000, 
+      wifiLink.getAttempt(), (wifiLink.getRetryIn(tnow) + 999)/1000);
+  printWithEnd(line);
+  if(wifiLink.reconnects) {
+    sprintf(line, " |    %u reconnects (%u attempts)", wifiLink.reconnects, wifiLink.attempts);
+    printWithEnd(line);
+    uint32_t avgMs = wifiLink.totalMs / wifiLink.reconnects;
+    sprintf(line, " |    Last %u.%u s, average %u.%u s, max %u.%u s", wifiLink.lastMs / 1000, (wifiLink.lastMs / 100) % 10,
+      avgMs / 1000, (avgMs / 100) % 10, wifiLink.maxMs / 1000, (wifiLink.maxMs / 100) % 10);
+    printWithEnd(line);
+  }
+  sprintf(line, " |  Remote terminals: Sent %u bytes in %u TCP segments", tcpBytes, tcpSegments);
+  printWithEnd(line);
+  sprintf(line, " |    Average %u bytes per segment, flush delay %u ms", 
+    tcpSegments ? tcpBytes/tcpSegments : 0, tcpFlushMs);
+  printWithEnd(line);
+  if(zipIn) {
+    snprintf(line, TERMINAL_WIDTH-2, " |    Compressed %u bytes to %u (%.1f:1), %.1f us per KB", zipIn, zipOut,
+      (float)zipIn / zipOut, cyclesToMicros(zipCycles) * 1024 / zipIn);
+    printWithEnd(line);
+  }
+  if(syslog.buff) {
+    sprintf(line, " |  Syslog: %.50s:%u", syslog.host, syslog.port);
+    printWithEnd(line);
+    sprintf(line, " |    %u messages in %u datagrams, %u dropped", syslog.sent, syslog.datagrams, syslog.dropped);
+    printWithEnd(line);
+  }
+  if(backlog.isActive()) {
+    sprintf(line, " |  Backlog: %u of %u bytes used, %u messages logged", 
+      (unsigned)backlog.used(), (unsigned)backlog.capacity(), lineCount);
+    printWithEnd(line);
+  }
+  for(int i=0; i<MKWIFIDEV_MAX_CLIENTS; i++) {
+    TermClient &c = terms[i];
+    if(c.state != TermClient::ACTIVE)
+      continue;
+    snprintf(line, TERMINAL_WIDTH-2, " |  %d%c %-15s %u bytes%s, %u segments, %u dropped", i+1, 
+      (i == ctrlClient) ? '*' : ')', c.client.remoteIP().toString().c_str(), c.bytesSent, c.zip ? " (z)" : "", 
+      c.segments, c.droppedTotal);
+    printWithEnd(line);
+  }
+  printFullLine(line);
+}
+
+void MkWifiDev::begin(const char *ssid, const char *password, const char *mdns_name) {
+  bOtaBusy = false;
+  mdns_devname = mdns_name;
+
+  // The connection state is kept by wifiLink from these events, so loop() needn't check it. Reconnecting is left to
+  // connect_loop(), which backs off
+#ifdef ESP8266
+  wifiGotIp = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP &) { WifiDev.wifiLink.event(true); });
+  wifiLost = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected &) { WifiDev.wifiLink.event(false); });
+#else   // ie esp32
+  WiFi.onEvent([](arduino_event_id_t, arduino_event_info_t) { WifiDev.wifiLink.event(true); }, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent([](arduino_event_id_t, arduino_event_info_t) { WifiDev.wifiLink.event(false); }, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+#endif
+  WiFi.setAutoReconnect(false);
+  WiFi.hostname(mdns_name);       // Set the host name to the same as the mdns name
+  WiFi.begin(ssid, password);
+  wifiLink.begin(millis());
+}
+
+// Acts on the WiFi connection being made or lost & makes reconnect attempts. Only the check in isQuiet() is made
+// while the connection is up
+void MkWifiDev::connect_loop()
+{
+  if(wifiLink.isQuiet())
+    return;
+
+  uint32_t tnow = millis();
+  switch(wifiLink.poll(tnow)) {
+    case MkWifiLink::UP:
+      wifiUp();
+      break;
+
+    case MkWifiLink::DOWN:
+      DBG_ALERT("Lost WiFi connection. Attempting to reconnect..");
+      pserver->close();
+      startMetricsServer();   // Stops it until reconnected
+      break;
+
+    case MkWifiLink::RETRY:
+      if(WiFi.status() == WL_CONNECTED) {     // Missed the event, eg connected before begin()
+        wifiLink.event(true);
+        break;
+      }
+      DBG_INFO("Still attempting to connect to WiFi (attempt %u, next in %u s)...", wifiLink.getAttempt(), 
+        wifiLink.getRetryIn(tnow) / 1000);
+      WiFi.reconnect();
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Starts the remote terminal server (the same one each time) & reports the connection
+void MkWifiDev::wifiUp()
+{
+  if(!pserver) {
+#ifdef ESP8266
+    pserver = new WiFiServer(23);
+#else   // ie esp32
+    pserver = new WiFiServer;
+#endif
+  }
+#ifdef ESP8266
+  pserver->begin();
+#else
+  pserver->begin(23);
+#endif
+  pserver->setNoDelay(true);
+
+  if(wifiLink.reconnects) {
+    DBG_ALERT("WiFi reconnected after %u.%u s (%u attempts). Remote terminals may connect to %s port 23", 
+      wifiLink.lastMs / 1000, (wifiLink.lastMs / 100) % 10, wifiLink.getAttempt(), WiFi.localIP().toString().c_str());
+    startMetricsServer();
+    return;
+  }
+
+  DBG_ALERT("Wifi Ready! Use client (eg 'PuTTY') & connect to %s port 23", WiFi.localIP().toString().c_str());
+  startMetricsServer();
+
+  if(mdns_devname != NULL) {
+    DBG_ALERT("mDNS Enabled - Device may be reached using '%s.local'", mdns_devname);
+    ArduinoOTA.setHostname(mdns_devname);
+  }
+
+  DBG_ALERT("Press Ctrl-A to enter command mode.");
+  startOta();
+}
+
+void MkWifiDev::startOta()
+{
+  ArduinoOTA.onStart([]() {
+    WifiDev.flushLogs();
+    WifiDev.bOtaBusy = true;
+    String type;
+    if (ArduinoOTA.getCommand() == U_FLASH)
+      type = "sketch";
+    else // U_SPIFFS
+      type = "filesystem";
+
+    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+    DBG_ALERT("Started updating %s", type.c_str());
+  });
+
+  ArduinoOTA.onEnd([]() {
+    WifiDev.bOtaBusy = false;
+    DBG_ALERT("OTA update complete!");
+    DBG_ALERT("About to restart, please reconnect remote terminal");
+  });
+
+  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+    static uint8_t div = 0;
+    if(!((div++)&0x7))  // Reduce output to 1/8
+      DBG_DEBUG("Progress: %u%%\r", (progress / (total / 100)));
+  });
+
+  ArduinoOTA.onError([](ota_error_t error) {
+    WifiDev.bOtaBusy = false;
+    DBG_ALERT("Error[%u]: ", error);
+    if      (error == OTA_AUTH_ERROR)    DBG_ALERT("Auth Failed");
+    else if (error == OTA_BEGIN_ERROR)   DBG_ALERT("Begin Failed");
+    else if (error == OTA_CONNECT_ERROR) DBG_ALERT("Connect Failed");
+    else if (error == OTA_RECEIVE_ERROR) DBG_ALERT("Receive Failed");
+    else if (error == OTA_END_ERROR)     DBG_ALERT("End Failed");
+  });
+
+  ArduinoOTA.begin();
+}
+
+void MkWifiDev::configTime(long gmtOffset, int daylightOffset, const char * server) {
+  ::configTime(gmtOffset, daylightOffset, server);
+  tsCache.valid = false;    // Timezone may have changed
+  nNtpRetries = 3;
+}
+
+void MkWifiDev::getNtpTime() {
+  nNtpRetries = 3;
+}
+
+bool MkWifiDev::isOtaBusy() {
+  return bOtaBusy;
+}
+
+#endif
+
+void MkWifiDev::setSerial(Stream &serialPort) {
+  
+  if(pCommand == pSerial)   // Make sure command stream updated (if terminal not active)
+    pCommand = &serialPort;
+
+  pSerial = &serialPort;
+}
+
+int MkWifiDev::available() {
+  if(bCommandMode)
+    return 0;
+
+  int ret = pCommand->available();
+
+  return (ret && (peek() == 0x01)) ? 0 : ret;   // Hide Ctrl-A from being available to app (loop will handle it)
+}
+
+
+int MkWifiDev::read() {
+  if(bCommandMode)
+    return 0;
+
+  return pCommand->read();
+}
+
+void MkWifiDev::setDisplayModeFlags(uint8_t flags) {
+  dispMode |= flags;
+}
+
+void MkWifiDev::clearDisplayModeFlags(uint8_t flags) {
+  dispMode &= ~flags;
+}
+
+uint8_t MkWifiDev::toggleTypeEnableFlag(uint8_t flagIndex) {
+  return enableFlags ^= (1 << flagIndex);
+}
+
+bool MkWifiDev::IsMessageMuted(MessageType type) {
+  if(inInterrupt()) {     // Logging would block, so it's counted as a lost DBG_ISR_xxx message
+    isrRings[mkCoreId() % MKWIFIDEV_CORES].countDropped();
+    return true;
+  }
+  if(type < 16) {
+    if(bCommandMode)
+      return true;
+
+    if(!(enableFlags & (1 << type)))
+      return true;
+  }
+  return false;
+}
+
+// Checks the level set for the message's tag. Tag pointers are hashed into tagCache, so the names are
+// only compared the first time a pointer is seen
+bool MkWifiDev::IsTagMuted(const char *tag, MessageType type) {
+  if(!tag || type == NORMAL)
+    return false;
+
+  const int size = sizeof(tagCache)/sizeof(tagCache[0]);
+  uint32_t i = ((uintptr_t)tag * 2654435761u) >> 8;    // Fibonacci hash, ignoring low bits (aligned pointers)
+  for(int n=0; n<size; n++) {
+    auto &e = tagCache[(i+n) % size];
+    if(e.ptr == tag)
+      return (e.idx < nTags) && (type < tags[e.idx].level);
+
+    if(!e.ptr) {
+      int idx = findTag(tag, false);
+      if(idx < 0)
+        addSeenTag(tag);
+      e.ptr = tag;
+      e.idx = (idx < 0) ? 0xFF : idx;
+      return (idx >= 0) && (type < tags[idx].level);
+    }
+  }
+
+  // Cache is full (more tag pointers than expected), start again
+  memset(tagCache, 0, sizeof(tagCache));
+  return IsTagMuted(tag, type);
+}
+
+// Returns the index of the named tag in tags[], optionally adding it. Returns -1 if not found or the table is full
+int MkWifiDev::findTag(const char *name, bool add) {
+  for(int i=0; i<nTags; i++)
+    if(!strncmp(tags[i].name, name, sizeof(tags[i].name)-1))
+      return i;
+
+  if(!add || nTags >= MKWIFIDEV_MAX_TAGS)
+    return -1;
+
+  strncpy(tags[nTags].name, name, sizeof(tags[nTags].name)-1);
+  tags[nTags].name[sizeof(tags[nTags].name)-1] = '\0';
+  tags[nTags].level = 0;
+  removeSeenTag(name);
+  memset(tagCache, 0, sizeof(tagCache));    // Pointers to this name were cached as having no level
+  return nTags++;
+}
+
+// Remembers a tag without a level for Command Mode, dropping the oldest if the list is full
+void MkWifiDev::addSeenTag(const char *name) {
+  for(int i=0; i<nSeen; i++)
+    if(!strcmp(seenTags[i], name))
+      return;
+
+  if(nSeen >= MKWIFIDEV_MAX_TAGS) {
+    memmove(seenTags, seenTags+1, (nSeen-1) * sizeof(seenTags[0]));
+    nSeen--;
+  }
+  seenTags[nSeen++] = name;
+}
+
+void MkWifiDev::removeSeenTag(const char *name) {
+  for(int i=0; i<nSeen; i++)
+    if(!strncmp(seenTags[i], name, sizeof(tags[0].name)-1)) {
+      memmove(seenTags+i, seenTags+i+1, (nSeen-i-1) * sizeof(seenTags[0]));
+      nSeen--;
+      return;
+    }
+}
+
+bool MkWifiDev::setTagLevel(const char *tag, MessageType level) {
+  lockReport();
+  int idx = findTag(tag, true);
+  if(idx >= 0)
+    tags[idx].level = level;
+  unlockReport();
+  return idx >= 0;
+}
+
+MkWifiDev::MessageType MkWifiDev::getTagLevel(const char *tag) {
+  int idx = findTag(tag, false);
+  return (idx < 0) ? NORMAL : MessageType(tags[idx].level);
+}
+
+// The lock is recursive, so messages can be output while it's held (eg by Command Mode). Tasks logging at the same
+// time (possibly on different cores) wait for each other, so their lines aren't mixed
+#ifdef MKWIFIDEV_THREADS
+static std::recursive_mutex reportMutex;
+
+void MkWifiDev::lockReport() {
+  reportMutex.lock();
+}
+
+void MkWifiDev::unlockReport() {
+  reportMutex.unlock();
+}
+#else
+// Single threaded (eg ESP8266), only interrupt handlers could log at the same time & they use DBG_ISR_xxx
+void MkWifiDev::lockReport() {
+}
+
+void MkWifiDev::unlockReport() {
+}
+#endif
+
+void MKWIFIDEV_IRAM MkWifiDev::isrPush(const MkIsrRecord &rec) {
+  isrRings[mkCoreId() % MKWIFIDEV_CORES].push(rec);
+}
+
+// Outputs the DBG_ISR_xxx messages, oldest first from all cores. Each is timestamped when it was logged
+void MkWifiDev::drainIsrLogs() {
+  lockReport();
+  while(true) {
+    MkIsrRing *ring = nullptr;
+    const MkIsrRecord *oldest = nullptr;
+    for(auto &r : isrRings) {
+      const MkIsrRecord *rec = r.front();
+      if(rec && (!oldest || (int32_t)(rec->us - oldest->us) < 0)) {
+        ring = &r;
+        oldest = rec;
+      }
+    }
+    if(!oldest)
+      break;
+
+    MkIsrRecord rec = *oldest;
+    ring->pop();
+    msgAgeUs = micros() - rec.us;
+    Report(rec.tag, MessageType(rec.type), rec.format, rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+    msgAgeUs = 0;
+  }
+
+  uint32_t dropped = 0;
+  for(auto &r : isrRings)
+    dropped += r.takeDropped();
+  isrDropped += dropped;
+  if(dropped)
+    Report(nullptr, ALERT, "%u message(s) from interrupts dropped", dropped);
+  unlockReport();
+}
+
+// Gets the time a message was logged, which is now unless it's from DBG_ISR_xxx
+void MkWifiDev::messageTime(struct timeval &tv) {
+  gettimeofday(&tv, NULL);
+  if(msgAgeUs) {
+    int64_t us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - msgAgeUs;
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+  }
+}
+
+void MkWifiDev::setBinaryLogging(bool enable) {
+  bBinaryLog = enable;
+}
+
+void MkWifiDev::Report(const char* dbgTAGptr, MessageType type, const char *format,...) {
+  if(IsMessageMuted(type))
+    return;
+
+  lockReport();
+  if(IsTagMuted(dbgTAGptr, type)) {
+    unlockReport();
+    return;
+  }
+  va_list args;
+  va_start (args,format);
+  MkArgs list(args);
+  va_end (args);
+  if(!isRepeat(dbgTAGptr, type, format, list))   // Repeats are counted, not output
+    reportArgs(dbgTAGptr, type, format, list, bBinaryLog);
+  unlockReport();
+}
+
+void MkWifiDev::reportTyped(const char* dbgTAGptr, MessageType type, const char *format, const MkArg *args, int nArgs) {
+  if(IsMessageMuted(type))
+    return;
+
+  lockReport();
+  if(IsTagMuted(dbgTAGptr, type)) {
+    unlockReport();
+    return;
+  }
+  MkArgs list(args, nArgs);
+  if(!isRepeat(dbgTAGptr, type, format, list))
+    reportArgs(dbgTAGptr, type, format, list, bBinaryLog);
+  unlockReport();
+}
+
+// As reportText(), for use when already locked
+void MkWifiDev::reportLocked(const char* dbgTAGptr, MessageType type, const char *format,...) {
+  va_list args;
+  va_start (args,format);
+  vReport(dbgTAGptr, type, format, args);
+  va_end (args);
+}
+
+void MkWifiDev::setRepeatSuppression(uint16_t timeoutMs) {
+  lockReport();
+  reportRepeats();
+  repeats.timeoutMs = timeoutMs;
+  repeats.hash = 0;
+  unlockReport();
+}
+
+// Checks whether the message is the same as the last one, using a hash of the raw argument values so
+// repeats are never formatted. Must be called when locked
+bool MkWifiDev::isRepeat(const char* dbgTAGptr, MessageType type, const char *format, const MkArgs &args) {
+  if(!repeats.timeoutMs)
+    return false;
+
+  uint32_t hash = fnv1a(&format, sizeof(format));
+  hash = fnv1a(&dbgTAGptr, sizeof(dbgTAGptr), hash);
+  hash = fnv1a(&type, sizeof(type), hash);
+
+  MkArgs copy(args);
+  for(const char *p = format; (p = strchr(p, '%')); ) {   // Hash the argument values as they're taken
+    FormatSpec spec;
+    p++;
+    parseFormatSpec(p, spec);
+    if(!takeArg(spec, copy, [&](const void *data, int n, bool str) { hash = fnv1a(data, n + str, hash); return true; }))
+      break;
+  }
+
+  if(hash == repeats.hash) {
+    repeats.count++;
+    repeats.total++;
+    return true;
+  }
+
+  reportRepeats();
+  repeats.hash = hash;
+  repeats.tag = dbgTAGptr;
+  repeats.type = type;
+  repeats.tReport = millis();
+  return false;
+}
+
+// Reports the number of times the last message was repeated, if any. Must be called when locked
+void MkWifiDev::reportRepeats() {
+  repeats.tReport = millis();
+  if(!repeats.count)
+    return;
+
+  uint32_t n = repeats.count;
+  repeats.count = 0;
+  reportLocked(repeats.tag, MessageType(repeats.type), "Last message repeated %u time(s)", n);
+}
+
+// Token bucket allowing bursts of up to 'burst' messages, refilled at 'rate' per second. The number dropped
+// is reported when messages are allowed again
+bool MkWifiDev::RateLimit::allow(MessageType type, uint16_t rate, uint16_t burst) {
+  uint32_t now = millis();
+  uint32_t elapsed = now - tLast;
+  if(!tLast || elapsed > 60000) {
+    tokens = burst;
+    tLast = now;
+  } else {
+    uint32_t add = elapsed * rate / 1000;
+    if(add) {
+      tokens = min(tokens + add, (uint32_t)burst);
+      tLast = (tokens == burst) ? now : tLast + add * 1000 / rate;
+    }
+  }
+
+  if(!tokens) {
+    dropped++;
+    WifiDev.rateLimited++;
+    return false;
+  }
+  tokens--;
+
+  if(dropped) {
+    WifiDev.reportText(nullptr, type, "%u messages dropped by rate limit", dropped);
+    dropped = 0;
+  }
+  return true;
+}
+
+MkMetric &MkWifiDev::counter(const char *name, const char *help) {
+  return addMetric(name, help, MkMetric::COUNTER, nullptr, 0);
+}
+
+MkMetric &MkWifiDev::gauge(const char *name, const char *help) {
+  return addMetric(name, help, MkMetric::GAUGE, nullptr, 0);
+}
+
+MkMetric &MkWifiDev::histogram(const char *name, const float *bounds, uint8_t nBounds, const char *help) {
+  return addMetric(name, help, MkMetric::HISTOGRAM, bounds, nBounds);
+}
+
+// Metrics are only added, never removed, so they can be read without a lock once nMetrics includes them
+MkMetric &MkWifiDev::addMetric(const char *name, const char *help, MkMetric::Type type, const float *bounds, 
+                               uint8_t nBounds) {
+  static std::atomic<uint32_t> spareBucket;
+  static MkMetric noMetric;     // Returned when there's no room, updated but never served
+  noMetric.buckets = &spareBucket;
+
+  lockReport();
+  uint8_t n = nMetrics.load(std::memory_order_relaxed);
+  for(int i=0; i<n; i++) {
+    if(!strcmp(metrics[i].name, name)) {
+      unlockReport();
+      return metrics[i];
+    }
+  }
+
+  uint8_t nBuckets = (type == MkMetric::HISTOGRAM) ? nBounds + 1 : 0;
+  if(n == MKWIFIDEV_MAX_METRICS || nMetricBuckets + nBuckets > MKWIFIDEV_METRIC_BUCKETS) {
+    unlockReport();
+    Report(nullptr, ERROR, "No room to register metric '%s'", name);
+    return noMetric;
+  }
+
+  MkMetric &m = metrics[n];
+  m.name = name;
+  m.help = help;
+  m.type = type;
+  if(nBuckets) {
+    m.bounds = bounds;
+    m.nBounds = nBounds;
+    m.buckets = &metricBuckets[nMetricBuckets];
+    nMetricBuckets += nBuckets;
+  }
+  nMetrics.store(n + 1, std::memory_order_release);
+  unlockReport();
+  return m;
+}
+
+#ifndef LOCAL_SERIAL_ONLY
+
+// Collects a metrics response so it's sent in a few TCP segments rather than one per line
+class MetricsWriter {
+  public:
+    MetricsWriter(WiFiClient &client) : client(client) { }
+    ~MetricsWriter() { flush(); }
+
+    void add(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+      va_list args;
+      for(int tries=0; tries<2; tries++) {
+        va_start(args, format);
+        int n = vsnprintf(buff + len, sizeof(buff) - len, format, args);
+        va_end(args);
+        if(n < (int)(sizeof(buff) - len)) {
+          len += n;
+          return;
+        }
+        buff[len] = 0;    // Doesn't fit, send what's there and try again (anything still too long is cut short)
+        if(!len) {
+          len = sizeof(buff) - 1;
+          return;
+        }
+        flush();
+      }
+    }
+
+    void flush() {
+      if(len)
+        client.write((const uint8_t *)buff, len);
+      len = 0;
+    }
+
+  private:
+    WiFiClient &client;
+    char buff[512];
+    size_t len = 0;
+};
+
+static void writeBuiltin(MetricsWriter &w, const char *name, const char *type, const char *help, double value) {
+  w.add("# HELP mkwifidev_%s %s\n# TYPE mkwifidev_%s %s\nmkwifidev_%s %.10g\n", name, help, name, type, name, value);
+}
+
+void MkWifiDev::writeMetrics(WiFiClient &client) {
+  MetricsWriter w(client);
+  w.add("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+
+  uint8_t n = nMetrics.load(std::memory_order_acquire);
+  for(int i=0; i<n; i++) {
+    MkMetric &m = metrics[i];
+    if(m.help)
+      w.add("# HELP %s %s\n", m.name, m.help);
+    if(m.type == MkMetric::COUNTER) {
+      w.add("# TYPE %s counter\n%s %u\n", m.name, m.name, m.value.load(std::memory_order_relaxed));
+    } else if(m.type == MkMetric::GAUGE) {
+      w.add("# TYPE %s gauge\n%s %.7g\n", m.name, m.name, MkMetric::fromBits(m.value.load(std::memory_order_relaxed)));
+    } else {
+      // Buckets are cumulative, the count is the total of them all
+      w.add("# TYPE %s histogram\n", m.name);
+      uint32_t count = 0;
+      for(int b=0; b<=m.nBounds; b++) {
+        count += m.buckets[b].load(std::memory_order_relaxed);
+        if(b < m.nBounds)
+          w.add("%s_bucket{le=\"%.7g\"} %u\n", m.name, m.bounds[b], count);
+        else
+          w.add("%s_bucket{le=\"+Inf\"} %u\n", m.name, count);
+      }
+      w.add("%s_sum %.7g\n%s_count %u\n", m.name, MkMetric::fromBits(m.sum.load(std::memory_order_relaxed)), m.name, count);
+    }
+  }
+
+  writeBuiltin(w, "uptime_seconds", "gauge", "Time since the device started", millis() / 1000.0);
+  writeBuiltin(w, "heap_free_bytes", "gauge", "Free heap", ESP.getFreeHeap());
+#ifdef ESP32
+  writeBuiltin(w, "heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated", ESP.getMaxAllocHeap());
+  writeBuiltin(w, "heap_min_free_bytes", "gauge", "Lowest free heap since the device started", ESP.getMinFreeHeap());
+  if(ESP.getPsramSize())
+    writeBuiltin(w, "psram_free_bytes", "gauge", "Free PSRAM", ESP.getFreePsram());
+#else
+  writeBuiltin(w, "heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated", ESP.getMaxFreeBlockSize());
+#endif
+  writeBuiltin(w, "wifi_rssi_dbm", "gauge", "WiFi signal strength", WiFi.RSSI());
+  writeBuiltin(w, "wifi_reconnects_total", "counter", "WiFi reconnections after the connection was lost", wifiLink.reconnects);
+  writeBuiltin(w, "wifi_down_seconds_total", "counter", "Time spent reconnecting to WiFi", wifiLink.totalMs / 1000.0);
+
+  w.add("# HELP mkwifidev_log_dropped_total Log messages (or remote terminal lines) dropped\n"
+        "# TYPE mkwifidev_log_dropped_total counter\n");
+  w.add("mkwifidev_log_dropped_total{reason=\"queue\"} %u\n", queueDropped);
+  w.add("mkwifidev_log_dropped_total{reason=\"interrupt\"} %u\n", isrDropped);
+  w.add("mkwifidev_log_dropped_total{reason=\"rate_limit\"} %u\n", rateLimited);
+  w.add("mkwifidev_log_dropped_total{reason=\"terminal\"} %u\n", tcpDropped);
+  w.add("mkwifidev_log_dropped_total{reason=\"syslog\"} %u\n", syslog.dropped);
+
+  writeBuiltin(w, "loop_seconds_total", "counter", "Time spent in WifiDev.loop()", cyclesToMicros(loopStats.cycles) / 1e6);
+  writeBuiltin(w, "loop_calls_total", "counter", "Calls to WifiDev.loop()", loopStats.calls);
+  writeBuiltin(w, "loop_max_seconds", "gauge", "Longest WifiDev.loop() call since the last scrape", 
+    cyclesToMicros(loopStats.maxCycles) / 1e6);
+  loopStats.maxCycles = 0;
+}
+
+void MkWifiDev::setMetricsPort(uint16_t port) {
+  metricsHttp.port = port;
+  startMetricsServer();
+}
+
+// (Re)starts the metrics server once connected, if a port has been set
+void MkWifiDev::startMetricsServer() {
+  metricsHttp.client.stop();
+  if(metricsHttp.server) {
+    metricsHttp.server->close();
+    delete metricsHttp.server;
+    metricsHttp.server = nullptr;
+  }
+  if(!metricsHttp.port || !wifiLink.isConnected())
+    return;
+
+#ifdef ESP8266
+  metricsHttp.server = new WiFiServer(metricsHttp.port);
+  metricsHttp.server->begin();
+#else   // ie esp32
+  metricsHttp.server = new WiFiServer;
+  metricsHttp.server->begin(metricsHttp.port);
+#endif
+  Report(nullptr, INFO, "Metrics available at http://%s:%u/metrics", WiFi.localIP().toString().c_str(), metricsHttp.port);
+}
+
+// Answers one metrics request at a time. Only the request line is looked at, the response is sent as soon as it
+// has arrived and then the connection is closed
+void MkWifiDev::metrics_loop() {
+  if(!metricsHttp.server)
+    return;
+
+  WiFiClient &c = metricsHttp.client;
+  if(!c.connected()) {
+    if(!metricsHttp.server->hasClient())
+      return;
+#if defined(ESP32)
+    c = metricsHttp.server->available();
+#elif defined(ESP8266)
+    c = metricsHttp.server->accept();
+#endif
+    metricsHttp.tAccept = millis();
+    metricsHttp.len = 0;
+  }
+
+  while(c.available()) {
+    char ch = c.read();
+    if(ch != '\r' && ch != '\n') {
+      if(metricsHttp.len < sizeof(metricsHttp.request) - 1)
+        metricsHttp.request[metricsHttp.len++] = ch;
+      continue;
+    }
+
+    metricsHttp.request[metricsHttp.len] = 0;
+    const char *path = metricsHttp.request + 4;
+    if(!strncmp(metricsHttp.request, "GET ", 4) && !strncmp(path, "/metrics", 8) && strchr(" ?", path[8]))
+      writeMetrics(c);
+    else
+      c.print("HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found\n");
+    while(c.available())    // Closing with unread data would reset the connection
+      c.read();
+    c.stop();
+    return;
+  }
+
+  if(!c.connected() || (millis() - metricsHttp.tAccept) > 2000)
+    c.stop();
+}
+
+#endif
+
+#ifdef MKWIFIDEV_TIMERS
+
+uint32_t MkTimer::percentile(uint8_t pct) {
+  uint32_t target = ((uint64_t)count * pct + 99) / 100;
+  uint32_t total = 0;
+  for(int i=0; i<(int)(sizeof(buckets)/sizeof(buckets[0])); i++) {
+    total += buckets[i];
+    if(total >= target && total) {
+      if(i < 8)
+        return i;
+      int shift = i/4 - 1;      // Bucket covers (4 + i%4) << shift, for 1 << shift values
+      uint32_t v = ((4 + i%4) << shift) + (1 << shift)/2;
+      return constrain(v, minCycles, maxCycles);
+    }
+  }
+  return maxCycles;
+}
+
+void MkTimer::reset() {
+  count = 0;
+  minCycles = UINT32_MAX;
+  maxCycles = 0;
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void MkWifiDev::reportTimers(bool reset) {
+  for(MkTimer *t = MkTimer::first(); t; t = t->next) {
+    if(t->count)
+      reportText(nullptr, INFO, "Timer %s: count %u, min %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us", t->name, t->count, 
+        cyclesToMicros(t->minCycles), cyclesToMicros(t->percentile(50)), cyclesToMicros(t->percentile(99)), cyclesToMicros(t->maxCycles));
+    if(reset)
+      t->reset();
+  }
+}
+
+void MkWifiDev::showTimers(char *line) {
+  printFullLine(line);
+  strcpy(line, " |  Scope Timers (microseconds)     Count      Min      p50      p99      Max");
+  printWithEnd(line);
+  printFullLine(line);
+  for(MkTimer *t = MkTimer::first(); t; t = t->next) {
+    snprintf(line, TERMINAL_WIDTH-2, " |  %-24.24s %10u %8.1f %8.1f %8.1f %8.1f", t->name, t->count, 
+      t->count ? cyclesToMicros(t->minCycles) : 0, cyclesToMicros(t->percentile(50)), 
+      cyclesToMicros(t->percentile(99)), cyclesToMicros(t->maxCycles));
+    printWithEnd(line);
+  }
+  printFullLine(line);
+}
+
+#endif
+
+#ifdef MKWIFIDEV_PROFILE_LOOP
+
+const char *profileNames[] = { "loop()", "WiFi connect", "OTA", "Memory check", "Log output", "NTP", 
+                               "Terminals", "Metrics", "Syslog", "Command Mode", "Serial out", "TCP out", "File out",
+                               "UDP out" };
+
+uint32_t MkWifiDev::profileAdd(int item, uint32_t tStart) {
+  uint32_t tNow = mkCycleCount();
+  uint32_t t = tNow - tStart;
+  profile.total[item] += t;
+  profile.count[item]++;
+  if(t > profile.worst[item])
+    profile.worst[item] = t;
+  return tNow;
+}
+
+void MkWifiDev::resetLoopProfile() {
+  memset(profile.total, 0, sizeof(profile.total));
+  memset(profile.worst, 0, sizeof(profile.worst));
+  memset(profile.count, 0, sizeof(profile.count));
+  profile.tStart = millis();
+}
+
+void MkWifiDev::setLoopProfileReport(uint16_t seconds) {
+  profile.reportSecs = seconds;
+  resetLoopProfile();
+}
+
+// One line summary, eg "loop() 1210/s worst 850 us : WiFi connect 0.1% OTA 2.3% ..."
+void MkWifiDev::reportLoopProfile() {
+  char buff[EVENT_MSG_MAX_LEN];
+  float us = (millis() - profile.tStart) * 1000.0f;
+  int len = snprintf(buff, sizeof(buff), "loop() %u/s worst %.0f us :", (uint32_t)(profile.count[PROF_LOOP] * 1e6f / us), 
+    cyclesToMicros(profile.worst[PROF_LOOP]));
+  for(int i=PROF_WIFI; i<PROF_COUNT && len < (int)sizeof(buff); i++)
+    if(profile.count[i])
+      len += snprintf(buff+len, sizeof(buff)-len, " %s %.1f%%", profileNames[i], cyclesToMicros(profile.total[i]) * 100 / us);
+  reportText(nullptr, INFO, "%s", buff);
+}
+
+void MkWifiDev::showLoopProfile(char *line) {
+  float us = (millis() - profile.tStart) * 1000.0f;
+  printFullLine(line);
+  snprintf(line, TERMINAL_WIDTH-2, " |  loop() Profile: %u calls in %.1f s (%.0f per second)", 
+    profile.count[PROF_LOOP], us / 1e6f, profile.count[PROF_LOOP] * 1e6f / us);
+  printWithEnd(line);
+  printFullLine(line);
+  strcpy(line, " |  Part              Calls     Total ms   % Time   Avg us   Worst us");
+  printWithEnd(line);
+  for(int i=0; i<PROF_COUNT; i++) {
+    if(!profile.count[i])
+      continue;
+    float total = cyclesToMicros(profile.total[i]);
+    snprintf(line, TERMINAL_WIDTH-2, " |  %-14s %8u %12.1f %7.1f%% %8.1f %10.1f", profileNames[i], profile.count[i], 
+      total / 1000, total * 100 / us, total / profile.count[i], cyclesToMicros(profile.worst[i]));
+    printWithEnd(line);
+  }
+  printFullLine(line);
+}
+
+#endif
+
+void MkWifiDev::showSuppressionStats(char *line) {
+  printFullLine(line);
+  strcpy(line, " |  Message Suppression");
+  printWithEnd(line);
+  printFullLine(line);
+#ifdef MKWIFIDEV_RATE_LIMIT
+  sprintf(line, " |  Rate limit: %u per second per call site, bursts of %u", MKWIFIDEV_RATE_LIMIT, MKWIFIDEV_RATE_BURST);
+#else
+  strcpy(line, " |  Rate limit: Off (unless MKWIFIDEV_RATE_LIMIT set per file)");
+#endif
+  printWithEnd(line);
+  sprintf(line, " |    %u messages dropped", rateLimited);
+  printWithEnd(line);
+  if(repeats.timeoutMs)
+    sprintf(line, " |  Repeated messages: Reported every %u ms", repeats.timeoutMs);
+  else
+    strcpy(line, " |  Repeated messages: Off");
+  printWithEnd(line);
+  sprintf(line, " |    %u repeats suppressed", repeats.total);
+  printWithEnd(line);
+  printFullLine(line);
+}
+
+// Always outputs text, for internal messages where the format isn't a string literal
+void MkWifiDev::reportText(const char* dbgTAGptr, MessageType type, const char *format,...) {
+  if(IsMessageMuted(type))
+    return;
+
+  lockReport();
+  va_list args;
+  va_start (args,format);
+  vReport(dbgTAGptr, type, format, args);
+  va_end (args);
+  unlockReport();
+}
+
+// Record layout: mark, length of remainder, type, seconds (4), milliseconds (2), format address (4), 
+// tag address (4), then the raw arguments. Multi-byte values are little endian
+void MkWifiDev::reportBinary(const char* dbgTAGptr, MessageType type, const char *format, const MkArgs &args, uint8_t outputs) {
+  uint8_t rec[2+255];
+
+  struct timeval tv;
+  messageTime(tv);
+  uint32_t sec = tv.tv_sec;
+  uint16_t msec = tv.tv_usec/1000;
+  uint32_t fmtAddr = (uintptr_t)format;
+  uint32_t tagAddr = (uintptr_t)dbgTAGptr;
+
+  rec[0] = BINARY_RECORD_MARK;
+  rec[2] = type;
+  memcpy(rec+3, &sec, 4);
+  memcpy(rec+7, &msec, 2);
+  memcpy(rec+9, &fmtAddr, 4);
+  memcpy(rec+13, &tagAddr, 4);
+  int len = 17 + encodeArgs(rec+17, sizeof(rec)-17, format, args);
+  rec[1] = len-2;
+
+  emitRecord(rec, len, type, outputs);
+}
+
+// Writes the timestamp prefix for a message to buff and returns its length
+int MkWifiDev::formatTimestamp(char *buff, MessageType type) {
+  if(!(dispMode & SHOW_TIMESTAMPS) || (type == RAW_NO_TS))
+    return 0;
+
+  struct timeval tv;
+  messageTime(tv);
+
+  uint8_t mode = dispMode & (SHOW_DATE | SHOW_MILLISECONDS);
+  if(!tsCache.valid || (tsCache.sec != tv.tv_sec) || (tsCache.mode != mode)) {
+    // If time is not set (ie before ~2020), dont use timezone, show time since boot
+    bool clockSet = (tv.tv_sec > 50*365*24*3600);    
+    tm *t = clockSet ? localtime(&tv.tv_sec) : gmtime(&tv.tv_sec);
+    int len = strftime(tsCache.text, sizeof(tsCache.text), (mode & SHOW_DATE) ? "%Y/%m/%d %H:%M:%S" : "%H:%M:%S", t);
+
+    tsCache.msPos = len+1;
+    if(mode & SHOW_MILLISECONDS) {
+      strcpy(tsCache.text+len, ".000");
+      len += 4;
+    }
+    strcpy(tsCache.text+len, " : ");
+
+    tsCache.len = len+3;
+    tsCache.sec = tv.tv_sec;
+    tsCache.mode = mode;
+    tsCache.valid = true;
+  }
+
+  memcpy(buff, tsCache.text, tsCache.len);
+  if(mode & SHOW_MILLISECONDS) {
+    int ms = (tv.tv_usec/1000)%1000;
+    buff[tsCache.msPos]   = '0' + ms/100;
+    buff[tsCache.msPos+1] = '0' + (ms/10)%10;
+    buff[tsCache.msPos+2] = '0' + ms%10;
+  }
+  return tsCache.len;
+}
+
+// Number of characters needed for c in a JSON string
+static inline int jsonCharLen(uint8_t c) {
+  if(c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t')
+    return 2;
+  return (c < 0x20) ? 6 : 1;
+}
+
+// Escapes the len characters at s for a JSON string, in place. Any that don't fit in room are dropped (an escape
+// sequence is never split) and len is reduced to the number kept. Returns the escaped length
+static int jsonEscape(char *s, int &len, int room) {
+  int n = 0, outLen = 0;
+  while(n < len && outLen + jsonCharLen(s[n]) <= room)
+    outLen += jsonCharLen(s[n++]);
+  len = n;
+
+  char *w = s + outLen;
+  while(n--) {      // Work backwards, so each character is read before it can be overwritten
+    uint8_t c = s[n];
+    int cl = jsonCharLen(c);
+    w -= cl;
+    if(cl == 1)
+      *w = c;
+    else if(cl == 2) {
+      w[0] = '\\';
+      w[1] = (c == '\n') ? 'n' : (c == '\r') ? 'r' : (c == '\t') ? 't' : c;
+    } else {
+      memcpy(w, "\\u00", 4);
+      w[4] = hexDigits[c >> 4];
+      w[5] = hexDigits[c & 0xF];
+    }
+  }
+  return outLen;
+}
+
+// Builds a message in a fixed buffer without allocating. Anything which doesn't fit is dropped & 'full' is set.
+// A streaming writer instead passes the buffer to emitPart() whenever it fills, so the message can be any length
+struct MkWifiDev::LineWriter {
+  char *p, *end;
+  bool full = false;
+  char *start;            // Start of the buffer if streaming, otherwise null
+
+  LineWriter(char *buff, char *end, bool stream = false) : p(buff), end(end), start(stream ? buff : nullptr) {}
+
+  // Sends the contents to the outputs. A final newline is held back (unless last is set) as it's removed if it
+  // ends the message
+  void flush(bool last = false) {
+    bool nl = !last && p > start && p[-1] == '\n';
+    if(p - nl > start)
+      WifiDev.emitPart(start, p - nl - start);
+    p = start;
+    if(nl)
+      *p++ = '\n';
+  }
+
+  // Returns room for n characters, flushing a streaming writer if needed
+  int room(int n = 1) {
+    if(start && end - p < n)
+      flush();
+    return end - p;
+  }
+
+  void add(char c) {
+    if(room())
+      *p++ = c;
+    else
+      full = true;
+  }
+
+  void add(const char *s, size_t len) {
+    while(len) {
+      size_t n = min(len, (size_t)room(len));
+      if(!n) {
+        full = true;
+        return;
+      }
+      memcpy(p, s, n);
+      p += n;
+      s += n;
+      len -= n;
+    }
+  }
+
+  void add(const char *s) { add(s, strlen(s)); }
+
+  void addUint(uint64_t v) {
+    char digits[20];
+    int n = 0;
+    uint32_t v32;
+    while(v > UINT32_MAX) {     // Avoid 64 bit division for most values
+      digits[n++] = '0' + v % 10;
+      v /= 10;
+    }
+    for(v32 = v; v32 >= 10; v32 /= 10)
+      digits[n++] = '0' + v32 % 10;
+    digits[n++] = '0' + v32;
+    while(n)
+      add(digits[--n]);
+  }
+
+  void addInt(int64_t v) {
+    if(v < 0) {
+      add('-');
+      addUint(0 - (uint64_t)v);
+    } else
+      addUint(v);
+  }
+
+  // Adds the contents of a JSON string (without quotes), escaping as needed
+  void addEscaped(const char *s, size_t len) {
+    while(len) {
+      int r = room(6);      // Longest escape sequence
+      int n = min(len, (size_t)r);
+      memcpy(p, s, n);
+      p += jsonEscape(p, n, r);
+      s += n;
+      len -= n;
+      if(!start || !n)
+        break;
+    }
+    if(len)
+      full = true;
+  }
+
+  void addPadding(int n) {
+    while(n-- > 0)
+      add(' ');
+  }
+
+  // Formats like vsnprintf, without limiting the length if streaming. Text, strings, common integer & %f conversions
+  // are copied or converted straight into the buffer, anything else is formatted by vsnprintf() (limited to the buffer size)
+  void addFormat(const char *format, MkArgs &args) {
+    while(*format) {
+      const char *pct = strchr(format, '%');
+      if(!pct) {
+        add(format);
+        return;
+      }
+      add(format, pct - format);
+
+      FormatSpec spec;
+      format = pct+1;
+      parseFormatSpec(format, spec);
+      bool left = strchr(spec.flags, '-');
+
+      switch(spec.conv) {
+        case 0:
+          add(pct);   // Invalid, output the rest as it is
+          return;
+
+        case '%':
+          add('%');
+          continue;
+
+        case 'n':
+          args.getPtr();
+          continue;
+
+        case 's':
+        case 'c':
+          if(spec.length)
+            break;    // Wide characters
+          {
+            int width = (spec.width == -2) ? args.getInt() : spec.width;
+            int precision = (spec.precision == -2) ? args.getInt() : spec.precision;
+            if(width < 0 && spec.width == -2) {
+              left = true;
+              width = -width;
+            }
+
+            char c;
+            const char *str = &c;
+            size_t len = 1;
+            if(spec.conv == 'c')
+              c = args.getInt();
+            else {
+              str = args.getStr();
+              if(!str)
+                str = "(null)";
+              len = (precision >= 0) ? strnlen(str, precision) : strlen(str);
+            }
+
+            if(!left)
+              addPadding(width - (int)len);
+            add(str, len);
+            if(left)
+              addPadding(width - (int)len);
+          }
+          continue;
+
+        case 'd': case 'i': case 'u': case 'x': case 'X':
+          if(spec.precision != -1 || spec.width == -2 || strspn(spec.flags, "-0") != strlen(spec.flags) ||
+             (spec.length && spec.length != 'l' && spec.length != 'q'))
+            break;    // Less common options are left to vsnprintf()
+          {
+            uint64_t v;
+            bool neg = false;
+            if(spec.conv == 'd' || spec.conv == 'i') {
+              int64_t i = args.getSigned(spec.length);
+              neg = (i < 0);
+              v = neg ? 0 - (uint64_t)i : i;
+            } else
+              v = args.getUnsigned(spec.length);
+
+            char digits[24];
+            int n = 0;
+            if(spec.conv == 'x' || spec.conv == 'X') {
+              const char *hex = (spec.conv == 'x') ? "0123456789abcdef" : hexDigits;
+              do {
+                digits[n++] = hex[v & 0xF];
+                v >>= 4;
+              } while(v);
+            } else {
+              while(v > UINT32_MAX) {     // Avoid 64 bit division for most values
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+              }
+              uint32_t v32 = v;
+              do {
+                digits[n++] = '0' + v32 % 10;
+                v32 /= 10;
+              } while(v32);
+            }
+
+            int pad = spec.width - n - neg;
+            if(!left && strchr(spec.flags, '0')) {
+              if(neg)
+                add('-');
+              while(pad-- > 0)
+                add('0');
+            } else {
+              if(!left)
+                addPadding(pad);
+              if(neg)
+                add('-');
+            }
+            while(n)
+              add(digits[--n]);
+            if(left)
+              addPadding(pad);
+          }
+          continue;
+
+        case 'f': case 'F':
+          if(spec.precision > 9 || spec.width == -2 || spec.precision == -2 || strspn(spec.flags, "-0") != strlen(spec.flags))
+            break;
+          {
+            MkArgs peek(args);
+            double d = peek.getDouble(spec.length);
+            if(!addFixed(d, spec.width, (spec.precision < 0) ? 6 : spec.precision, left, strchr(spec.flags, '0')))
+              break;    // Too large, inf or nan
+            args.getDouble(spec.length);
+          }
+          continue;
+      }
+
+      // Format this conversion on its own, then take its arguments
+      char fmt[24];
+      int fmtLen = format - pct;
+      if(fmtLen >= (int)sizeof(fmt)) {
+        add(pct);
+        return;
+      }
+      memcpy(fmt, pct, fmtLen);
+      fmt[fmtLen] = '\0';
+
+      int r = room(32);
+      int n = MkArgs(args).format(p, r+1, fmt, spec);     // The buffer always has room for the terminator after end
+      if(n > r && start && p - start > 1) {     // Longer than expected, try again with the whole buffer
+        flush();
+        r = room();
+        n = MkArgs(args).format(p, r+1, fmt, spec);
+      }
+      if(n > r)
+        full = true;
+      p += constrain(n, 0, r);
+      takeArg(spec, args, [](const void *, int, bool) { return true; });
+    }
+  }
+
+  // Adds d in %f format with 0 to 9 decimal places, from integers rather than by vsnprintf(). The last digit is
+  // rounded as printf() does, from the exact value of d.
+  // Returns false (having added nothing) if d is too large for this, or not finite
+  bool addFixed(double d, int width, int precision, bool left, bool zero) {
+    static const uint32_t scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+    if(!(fabs(d) < 1e18))
+      return false;
+
+    bool neg = signbit(d);
+    double a = fabs(d);
+    uint64_t whole = (uint64_t)a;
+    double f = (a - whole) * scale[precision];
+    uint64_t frac = (uint64_t)f;
+    double rest = f - frac;
+    if(rest == 0.5) {     // Maybe only after rounding f, which fma() gives the error of. Exact halves go to even
+      double error = fma(a - whole, scale[precision], -f);
+      if(error > 0 || (error == 0 && ((precision ? frac : whole) & 1)))
+        frac++;
+    } else if(rest > 0.5)
+      frac++;
+    if(frac >= scale[precision]) {
+      frac -= scale[precision];
+      whole++;
+    }
+
+    char digits[32];
+    int n = 0;
+    for(int i=0; i<precision; i++, frac /= 10)
+      digits[n++] = '0' + frac % 10;
+    if(precision)
+      digits[n++] = '.';
+    while(whole > UINT32_MAX) {     // Avoid 64 bit division for most values
+      digits[n++] = '0' + whole % 10;
+      whole /= 10;
+    }
+    uint32_t w32 = whole;
+    do {
+      digits[n++] = '0' + w32 % 10;
+      w32 /= 10;
+    } while(w32);
+
+    int pad = width - n - neg;
+    if(!left && zero) {
+      if(neg)
+        add('-');
+      while(pad-- > 0)
+        add('0');
+    } else {
+      if(!left)
+        addPadding(pad);
+      if(neg)
+        add('-');
+    }
+    while(n)
+      add(digits[--n]);
+    if(left)
+      addPadding(pad);
+    return true;
+  }
+
+  // Adds up to maxLen printable characters (others replaced by '_'), or '-' if s is empty, for a syslog header field
+  void addToken(const char *s, int maxLen) {
+    if(!s || !*s)
+      add('-');
+    for(; s && *s && maxLen; s++, maxLen--)
+      add((*s > ' ' && *s < 0x7F && *s != '=' && *s != ']' && *s != '"') ? *s : '_');
+  }
+
+  void addString(const char *s) {
+    add('"');
+    addEscaped(s, strlen(s));
+    add('"');
+  }
+
+  // Adds a field value as JSON or as text (where strings are only quoted if they contain spaces etc, as in logfmt)
+  void addValue(const MkField &f, bool json) {
+    char tmp[24];
+    switch(f.kind) {
+      case MkField::INT  : addInt(f.i); break;
+      case MkField::UINT : addUint(f.u); break;
+      case MkField::BOOL : add(f.b ? "true" : "false"); break;
+      case MkField::FLOAT :
+      case MkField::DOUBLE :
+        if(isnan(f.d) || isinf(f.d))
+          add(json ? "null" : isnan(f.d) ? "nan" : (f.d < 0) ? "-inf" : "inf");
+        else {
+          snprintf(tmp, sizeof(tmp), "%.*g", (f.kind == MkField::FLOAT) ? 7 : 15, f.d);
+          add(tmp);
+        }
+        break;
+      case MkField::STR :
+        if(!f.s)
+          add(json ? "null" : "(null)");
+        else if(json || !*f.s || strpbrk(f.s, " =\"\\\r\n\t"))
+          addString(f.s);
+        else
+          add(f.s);
+        break;
+    }
+  }
+};
+
+// Adds the colour, timestamp, tag & message type that start a text message
+void MkWifiDev::addPrefix(LineWriter &w, const char* dbgTAGptr, MessageType type) {
+  if((dispMode & SHOW_COLOUR) && (type != RAW_NO_TS)) {  // Use color from table unless override flag is set
+    if(type & OVERRIDE) {
+      char code[8];
+      w.add(code, sprintf(code, "\033[%dm", type & 0x7F));
+    } else
+      w.add(colorCodes[type & 7], 5);
+  }
+
+  w.room(sizeof(tsCache.text));
+  w.p += formatTimestamp(w.p, type);
+
+  if(dbgTAGptr) {
+    w.add(dbgTAGptr);
+    w.add(" : ");
+  }
+
+  // Add textual representation of message type
+  if((dispMode & SHOW_TYPE) && !(type & OVERRIDE) && (type < RAW_NO_TS))
+    w.add(typeFlags[type]);
+}
+
+// Finishes a text message being written by a streaming writer, which was started by emitBegin()
+void MkWifiDev::endTextLine(LineWriter &w, MessageType type) {
+  // Remove trailing newline if present
+  if(w.p > w.start && w.p[-1] == '\n')
+    w.p--;
+
+  if((dispMode & SHOW_COLOUR) && (type != RAW_NO_TS))
+    w.add(COLOR_RESET);
+  w.flush(true);
+  emitEnd();
+}
+
+// Returns the outputs which currently need messages, so they aren't formatted in a way no output is using
+uint8_t MkWifiDev::activeOutputs() {
+#ifndef LOCAL_SERIAL_ONLY
+  if(!jsonOutputs && !syslog.buff)
+    return CONSOLE_OUTPUTS;     // Text only, no need to check
+#else
+  if(!jsonOutputs)
+    return CONSOLE_OUTPUTS;
+#endif
+
+  uint8_t outputs = SERIAL_OUTPUT;
+  if(logFile.stream)
+    outputs |= FILE_OUTPUT;
+#ifndef LOCAL_SERIAL_ONLY
+  if(ctrlClient >= 0 || backlog.isActive())
+    outputs |= TERMINAL_OUTPUT;
+  if(syslog.buff)
+    outputs |= SYSLOG_OUTPUT;
+#endif
+  return outputs;
+}
+
+// Sends the message as JSON to the outputs selected by setJsonLines(), in syslog format to the syslog server and as
+// text (or a binary record) to the others
+void MkWifiDev::vReport(const char* dbgTAGptr, MessageType type, const char *format, va_list args, bool binary) {
+  reportArgs(dbgTAGptr, type, format, MkArgs(args), binary);
+}
+
+void MkWifiDev::reportArgs(const char* dbgTAGptr, MessageType type, const char *format, const MkArgs &args, bool binary) {
+  uint8_t active = activeOutputs();
+  uint8_t json = active & jsonOutputs, text = active & ~jsonOutputs & CONSOLE_OUTPUTS;
+  if(json)
+    reportJson(dbgTAGptr, type, nullptr, 0, format, &args, nullptr, 0, json);
+#ifndef LOCAL_SERIAL_ONLY
+  if(active & SYSLOG_OUTPUT)
+    reportSyslog(dbgTAGptr, type, nullptr, 0, format, &args, nullptr, 0);
+#endif
+  if(!text)
+    return;
+
+  if(binary)
+    reportBinary(dbgTAGptr, type, format, args, text);
+  else
+    reportFormatted(dbgTAGptr, type, format, args, text);
+}
+
+// Formats the message in pieces, which are written straight to the outputs (or queue) so there's no limit on its length
+void MkWifiDev::reportFormatted(const char* dbgTAGptr, MessageType type, const char *format, const MkArgs &args, uint8_t outputs) {
+  char buff[MKWIFIDEV_FORMAT_CHUNK];
+  LineWriter w(buff, buff + sizeof(buff) - 1, true);    // Room for vsnprintf()'s terminator
+
+  emitBegin(type, outputs, true);
+  addPrefix(w, dbgTAGptr, type);
+  MkArgs copy(args);
+  w.addFormat(format, copy);
+  endTextLine(w, type);
+}
+
+// Writes the message as one line of JSON: {"ts":<seconds>.<ms>,"level":"info","tag":..,"src":"file:line","msg":..,fields}.
+// The message is formatted from format & args, or taken from format as it is if args is null. Fields which don't fit
+// are left out & "truncated":true added, so the line is always valid JSON
+void MkWifiDev::reportJson(const char* dbgTAGptr, MessageType type, const char *file, int line, const char *format,
+                           const MkArgs *args, const MkField *fields, int nFields, uint8_t outputs) {
+  static const char truncated[] = ",\"truncated\":true}";
+  char buff[EVENT_MSG_MAX_LEN];
+  LineWriter w(buff, buff + sizeof(buff) - sizeof(truncated));
+
+  struct timeval tv;
+  messageTime(tv);
+  int ms = (tv.tv_usec/1000)%1000;
+  w.add("{\"ts\":");
+  w.addUint(tv.tv_sec);
+  w.add('.');
+  w.add('0' + ms/100);
+  w.add('0' + (ms/10)%10);
+  w.add('0' + ms%10);
+
+  w.add(",\"level\":\"");
+  w.add(((type & OVERRIDE) || type >= RAW_NO_TS) ? jsonLevels[0] : jsonLevels[type]);
+  w.add('"');
+
+  if(dbgTAGptr) {
+    w.add(",\"tag\":");
+    w.addString(dbgTAGptr);
+  }
+
+  if(file) {
+    const char *name = max(strrchr(file, '/'), strrchr(file, '\\'));
+    w.add(",\"src\":");
+    w.add('"');
+    w.addEscaped(name ? name+1 : file, strlen(name ? name+1 : file));
+    w.add(':');
+    w.addUint(line);
+    w.add('"');
+  }
+
+  w.add(",\"msg\":\"");
+  w.end--;      // Keep room for the closing quote
+  if(args && w.p < w.end) {
+    char *msg = w.p;
+    int room = w.end - msg;
+    MkArgs copy(*args);
+    w.addFormat(format, copy);      // Then escaped in place
+    int len = w.p - msg;
+    if(len && msg[len-1] == '\n')
+      len--;
+    int kept = len;
+    w.p = msg + jsonEscape(msg, kept, room);
+    if(kept < len)
+      w.full = true;
+  } else if(!args)
+    w.addEscaped(format, strlen(format));
+  w.end++;
+  w.add('"');
+
+  bool bTruncated = w.full;
+  for(int i=0; i<nFields && !bTruncated; i++) {
+    char *start = w.p;
+    w.add(',');
+    w.addString(fields[i].key);
+    w.add(':');
+    w.addValue(fields[i], true);
+    if(w.full) {
+      w.p = start;      // Leave out the partial field
+      bTruncated = true;
+    }
   }
-  return false;
+
+  strcpy(w.p, bTruncated ? truncated : "}");
+  emitLine(buff, type, outputs);
 }
 
-void MkWifiDev::Report(const char* dbgTAGptr, MessageType type, const char *format,...) {
-  if(IsMessageMuted(type))
-    return;
+#ifndef LOCAL_SERIAL_ONLY
+// Syslog severity for each message type. DBG_ALERT is used for notable events rather than emergencies, so it's a notice
+static const uint8_t syslogSeverity[] = { 6, 7, 7, 6, 4, 5, 3, 2 };
 
- // Simple lockout implementation
-  static bool bReportBusy = false;
-  while(bReportBusy)
-    delay(10);
-  bReportBusy = 1;
+// Writes the message in RFC 5424 format: <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG. The tag is
+// the MSGID and any fields are structured data, ie [mk@32473 key="value" ...]. The time is left out (-) until it's set
+void MkWifiDev::reportSyslog(const char* dbgTAGptr, MessageType type, const char *file, int line, const char *format,
+                             const MkArgs *args, const MkField *fields, int nFields) {
+  (void)file;     // The source location isn't part of a syslog message
+  (void)line;
+  char buff[EVENT_MSG_MAX_LEN];
+  char tmp[40];
+  LineWriter w(buff, buff + sizeof(buff) - 1);
 
-  char timestamp[40];
+  uint8_t severity = ((type & OVERRIDE) || type >= RAW_NO_TS) ? 6 : syslogSeverity[type];
+  w.add(tmp, sprintf(tmp, "<%u>1 ", syslog.facility*8 + severity));
 
-  if((dispMode & SHOW_TIMESTAMPS) && (type != RAW_NO_TS)) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    
-    // If time is not set (ie before ~2020), dont use timezone, show time since boot
-    bool clockSet = (tv.tv_sec > 50*365*24*3600);    
-    tm *t = clockSet ? localtime(&tv.tv_sec) : gmtime(&tv.tv_sec);
-    strftime(timestamp, sizeof(timestamp), (dispMode & SHOW_DATE) ? "%Y/%m/%d %H:%M:%S" : "%H:%M:%S", t);
+  struct timeval tv;
+  messageTime(tv);
+  if(tv.tv_sec > 50*365*24*3600) {
+    int len = strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%S", gmtime(&tv.tv_sec));
+    w.add(tmp, len + sprintf(tmp+len, ".%03uZ ", (unsigned)(tv.tv_usec/1000)));
+  } else
+    w.add("- ");
 
-    if(dispMode & SHOW_MILLISECONDS)
-      sprintf(timestamp+strlen(timestamp), ".%03d", int(tv.tv_usec/1000)%1000);
-    
-    strcat(timestamp, " : ");
-  }
-  
-  char buff[EVENT_MSG_MAX_LEN] = "";
+  w.addToken(mdns_devname, 255);
+#ifdef _APPNAME_
+  w.add(' ');
+  w.addToken(TOSTRING(_APPNAME_), 48);
+  w.add(" - ");
+#else
+  w.add(" MkWifiDev - ");
+#endif
+  w.addToken(dbgTAGptr, 32);
+  w.add(' ');
 
-  bool bColor = ((dispMode & SHOW_COLOUR) && (type != RAW_NO_TS));
-  if(bColor)  // Use color from table unless override flag is set
-    sprintf(buff, "\033[%dm", (type & OVERRIDE) ? (type & 0x7F) : colors[type & 7]);
+  if(nFields) {
+    w.add("[mk@32473");
+    w.end--;      // Keep room for the closing bracket
+    for(int i=0; i<nFields; i++) {
+      char *start = w.p;
+      w.add(' ');
+      w.addToken(fields[i].key, 32);
+      w.add("=\"");
+      if(fields[i].kind == MkField::STR) {
+        for(const char *c = fields[i].s ? fields[i].s : "(null)"; *c; c++) {
+          if(*c == '"' || *c == '\\' || *c == ']')
+            w.add('\\');
+          w.add(*c);
+        }
+      } else
+        w.addValue(fields[i], false);
+      w.add('"');
+      if(w.full) {
+        w.p = start;    // Leave out the partial field
+        break;
+      }
+    }
+    w.end++;
+    w.add(']');
+  } else
+    w.add('-');
+  w.add(' ');
 
-  if(dispMode & SHOW_TIMESTAMPS) 
-    strcat(buff, timestamp);
+  if(args) {
+    MkArgs copy(*args);
+    w.addFormat(format, copy);
+  } else
+    w.add(format);
+  if(w.p[-1] == '\n')
+    w.p--;
+  *w.p = '\0';
 
-  if(dbgTAGptr) {
-    strcat(buff, dbgTAGptr);
-    strcat(buff, " : ");
+  emitLine(buff, type, SYSLOG_OUTPUT);
+}
+#endif
+
+// Outputs a DBG_xxx_KV message. Fields can't be held in a binary record, so text outputs always get text
+void MkWifiDev::reportFields(const char* dbgTAGptr, MessageType type, const char *file, int line, const char *msg,
+                             const MkField *fields, int nFields) {
+  if(IsMessageMuted(type))
+    return;
+
+  lockReport();
+  if(IsTagMuted(dbgTAGptr, type)) {
+    unlockReport();
+    return;
   }
 
-  // Add textual representation of message type
-  if(dispMode & SHOW_TYPE) 
-    if(!(type & OVERRIDE) && type) {
-      //NORMAL, VERBOSE, DEBUG, INFO, WARNING, ALERT, ERROR, CRITICAL 
-      const char msg_types[] = " VDIWAEC";
-      sprintf(timestamp, "[%c]", msg_types[type & 7]);
-      strcat(buff, timestamp);
-    }
+  if(repeats.timeoutMs) {   // Not compared for repeats, but report those of the previous message first
+    reportRepeats();
+    repeats.hash = 0;
+  }
+
+  uint8_t active = activeOutputs();
+  uint8_t json = active & jsonOutputs, text = active & ~jsonOutputs & CONSOLE_OUTPUTS;
+  if(json)
+    reportJson(dbgTAGptr, type, file, line, msg, nullptr, fields, nFields, json);
+#ifndef LOCAL_SERIAL_ONLY
+  if(active & SYSLOG_OUTPUT)
+    reportSyslog(dbgTAGptr, type, file, line, msg, nullptr, fields, nFields);
+#endif
 
-  int len = strlen(buff);
+  if(text) {
+    char buff[MKWIFIDEV_FORMAT_CHUNK];
+    LineWriter w(buff, buff + sizeof(buff) - 1, true);
+    emitBegin(type, text, true);
+    addPrefix(w, dbgTAGptr, type);
+    w.add(msg);
+    for(int i=0; i<nFields; i++) {
+      w.add(' ');
+      w.add(fields[i].key);
+      w.add('=');
+      w.addValue(fields[i], false);
+    }
+    endTextLine(w, type);
+  }
+  unlockReport();
+}
 
-  va_list args;
-  va_start (args,format);
-  vsnprintf(buff+len,sizeof(buff)-len,format,args);
-  va_end (args);
+void MkWifiDev::setJsonLines(uint8_t outputs) {
+  lockReport();
+  jsonOutputs = outputs & CONSOLE_OUTPUTS;
+  unlockReport();
+}
 
-  // Remove trailing newline if present
-  len = strlen(buff);
-  if(buff[len-1] == '\n')
-    buff[len-1] = '\0';
+// Writes one line of a hex dump to p: the address, n bytes in groups of 8, then (if ascii is set) the printable
+// characters, padded so the ASCII column lines up for a short line of bwidth bytes. Returns the end of the text
+static char *formatHexLine(char *p, const uint8_t *ptr, int n, int bwidth, bool ascii) {
+  uint32_t addr = (uintptr_t)ptr;
+  *p++ = ' ';
+  for(int shift=28; shift>=0; shift-=4)
+    *p++ = hexDigits[(addr >> shift) & 0xF];
+  *p++ = ' ';
+  *p++ = ':';
 
-  if(bColor)
-    strcat(buff, "\033[0m");
+  for(int i=0; i<bwidth; i++) {
+    if(i >= n && !ascii)
+      break;
+    if(!(i&7))  // Group into blocks of 8 bytes
+      *p++ = ' ';
+    if(i < n) {
+      *p++ = hexDigits[ptr[i] >> 4];
+      *p++ = hexDigits[ptr[i] & 0xF];
+    } else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+  }
 
-  buff[sizeof(buff)/sizeof(buff[0])-1]='\0';    // Just to be safe, set last pos in buffer to null
+  if(ascii) {
+    *p++ = ' ';
+    *p++ = '|';
+    for(int i=0; i<n; i++)
+      *p++ = (ptr[i] >= 0x20 && ptr[i] < 0x7F) ? ptr[i] : '.';
+    *p++ = '|';
+  }
+  *p = '\0';
+  return p;
+}
 
-  // Flush the serial port before sending the next message to prevent overflow of the transmit buffer if
-  // there is a burst of messages (although this will slow down the program creating the output!)
-  pSerial->flush();
+void MkWifiDev::HexDump(const char* dbgTAG, const char *message, void* addr, int len, MessageType type) {
+  lockedHexDump(dbgTAG, nullptr, message, addr, len, type, INT_MAX);
+}
 
-  println(buff);
+void MkWifiDev::HexDumpChunked(const char* dbgTAG, const char *message, void* addr, int len, MessageType type) {
+  lockedHexDump(dbgTAG, nullptr, message, addr, len, type, MKWIFIDEV_HEXDUMP_CHUNK);
+}
 
-  bReportBusy = 0;
+void MkWifiDev::HexDump(const char* dbgTAG, const MkCallSite &site, const char *message, void* addr, int len, 
+    MessageType type) {
+  lockedHexDump(dbgTAG, &site, message, addr, len, type, INT_MAX);
+}
 
+void MkWifiDev::HexDumpChunked(const char* dbgTAG, const MkCallSite &site, const char *message, void* addr, int len,
+    MessageType type) {
+  lockedHexDump(dbgTAG, &site, message, addr, len, type, MKWIFIDEV_HEXDUMP_CHUNK);
 }
 
-void MkWifiDev::HexDump(const char* dbgTAG, const char *message, void* addr, int len, MessageType type)
-{
+// Outputs the message & the first maxLines lines of the dump (loop() outputs the rest). The dump in progress & the
+// outputs are shared with other tasks, so the lock is held throughout
+void MkWifiDev::lockedHexDump(const char* dbgTAG, const MkCallSite *site, const char *message, void* addr, int len,
+    MessageType type, int maxLines) {
   if(IsMessageMuted(type))
     return;
 
-  char buff[160] = "";
+  lockReport();
+  if(beginHexDump(dbgTAG, site, message, addr, len, type))
+    hexDumpLines(maxLines);
+  unlockReport();
+}
+
+// Outputs the message (and a short dump). Returns true if there are lines to follow, which hexDumpLines() outputs.
+// Called with the lock held
+bool MkWifiDev::beginHexDump(const char* dbgTAG, const MkCallSite *site, const char *message, void* addr, int len,
+    MessageType type) {
+  if(IsTagMuted(dbgTAG, type))
+    return false;
+
+  if(hexDump.ptr)       // Finish any chunked dump still in progress
+    hexDumpLines(INT_MAX);
+
+  char where[40] = "";
+  if(site && site->file)
+    snprintf(where, sizeof(where), "%s:%u ", site->file, site->line);
+  else if(site)
+    snprintf(where, sizeof(where), "@%04x:%u ", site->fileId, site->line);
 
   if(addr == nullptr) {
-    sprintf(buff, "%s [Null ptr]", message);
-    Report(dbgTAG, type, buff);
-    return;
+    reportText(dbgTAG, type, "%s%s [Null ptr]", where, message);
+    return false;
   }
 
   uint8_t bwidth = (dispMode & WIDE_HEXDUMP) ? 32 : 16;  // Bytes per line to display
-  bool ShortDump = (len <= bwidth/2);
+  if(len <= bwidth/2) {  // For less than 16 bytes, append data to message line
+    char buff[80];
+    formatHexLine(buff, (const uint8_t*)addr, max(len, 0), max(len, 0), dispMode & HEXDUMP_ASCII);
+    reportText(nullptr, type, "%s%s%s", where, message, buff);
+    return false;
+  }
 
-  if(ShortDump)  // For less than 16 bytes, append data to message line
-    strcpy(buff, message);
-  else
-    Report(nullptr, type, message);
-  
-  bool bColor = ((dispMode & SHOW_COLOUR) && (type != RAW_NO_TS) && !ShortDump);
-  if(bColor)
-    sprintf(buff, "\033[%dm", colors[type & 7]);
-
-
-  uint8_t *ptr = (uint8_t*)addr;
-  while(len > 0) {
-    char tmp[16];
-    sprintf(tmp, " %08X :", (uint32_t)ptr);
-      strcat(buff, tmp);
-    for(int i=0; i<bwidth && len; i++, len--) {
-      if(!(i&7))  // Group into blocks of 8 bytes
-        strcat(buff, " ");
-      sprintf(tmp, "%02X ", *ptr++);
-      strcat(buff, tmp);
-    }
-    if(bColor && !len)
-      strcat(buff, "\033[0m");
-
-    if(ShortDump)
-        Report(nullptr, type, buff);
-    else
-      println(buff);
+  reportText(nullptr, type, "%s%s", where, message);
+
+  hexDump.start = hexDump.ptr = (const uint8_t*)addr;
+  hexDump.end = hexDump.start + len;
+  hexDump.type = type;
+  hexDump.starred = false;
+  return true;
+}
+
+// Outputs up to maxLines lines of the dump in progress. Returns true once it is complete. Called with the lock held
+bool MkWifiDev::hexDumpLines(int maxLines) {
+  char buff[200];
+  uint8_t bwidth = (dispMode & WIDE_HEXDUMP) ? 32 : 16;
+  MessageType type = MessageType(hexDump.type);
+  bool bColor = ((dispMode & SHOW_COLOUR) && (type != RAW_NO_TS));
+  uint8_t active = activeOutputs();
+  uint8_t json = active & jsonOutputs, text = active & ~jsonOutputs & CONSOLE_OUTPUTS;
+
+  while(hexDump.ptr && maxLines > 0) {
+    const uint8_t *ptr = hexDump.ptr;
+    int n = min((int)(hexDump.end - ptr), (int)bwidth);
+    hexDump.ptr = (ptr + n < hexDump.end) ? ptr + n : nullptr;
+
+    // Show a run of identical lines as a single '*' (but always show the last line, so the end is clear)
+    if(ptr != hexDump.start && hexDump.ptr && !memcmp(ptr, ptr - bwidth, bwidth)) {
+      if(!hexDump.starred) {
+        if(json)
+          reportJson(nullptr, type, nullptr, 0, "*", nullptr, nullptr, 0, json);
+#ifndef LOCAL_SERIAL_ONLY
+        if(active & SYSLOG_OUTPUT)
+          reportSyslog(nullptr, type, nullptr, 0, "*", nullptr, nullptr, 0);
+#endif
+        if(text)
+          emitLine("*", type, text);
+      }
+      hexDump.starred = true;
+      continue;
+    }
+    hexDump.starred = false;
+
+    char *line = buff + 5;    // Room for the colour
+    char *p = formatHexLine(line, ptr, n, bwidth, dispMode & HEXDUMP_ASCII);
+    if(json)
+      reportJson(nullptr, type, nullptr, 0, line, nullptr, nullptr, 0, json);
+#ifndef LOCAL_SERIAL_ONLY
+    if(active & SYSLOG_OUTPUT)
+      reportSyslog(nullptr, type, nullptr, 0, line, nullptr, nullptr, 0);
+#endif
 
-    buff[0] = '\0';
+    if(text) {
+      if(bColor) {  // Each line is coloured separately, as other messages may be output in between
+        line = buff;
+        memcpy(line, colorCodes[type & 7], 5);
+        strcpy(p, COLOR_RESET);
+      }
+      emitLine(line, type, text);
+    }
+    maxLines--;
   }
+  return !hexDump.ptr;
 }
 
 void MkWifiDev::printFullLine(char *line) {
@@ -357,6 +3522,108 @@ void MkWifiDev::printWithEnd(char *line) {
   println(line);
 }
 
+#if MKWIFIDEV_CRASH_LOG
+static_assert(MKWIFIDEV_CRASH_LOG % 4 == 0, "MKWIFIDEV_CRASH_LOG must be a multiple of 4");
+
+#if defined(ESP32)
+static RTC_NOINIT_ATTR uint32_t crashMem[MKWIFIDEV_CRASH_LOG/4];    // Not cleared by a reset
+
+void MkWifiDev::saveCrashLog() {
+}
+#elif defined(ESP8266)
+// RTC user memory can only be read & written as a whole, so the lines are kept in RAM and copied to it when there's a
+// crash. The first 128 bytes of it are left for the OTA update command
+static const uint32_t CRASH_RTC_BLOCK = 32;
+static_assert(MKWIFIDEV_CRASH_LOG <= 512 - CRASH_RTC_BLOCK*4, "MKWIFIDEV_CRASH_LOG must be 384 or less on the ESP8266");
+static uint32_t crashMem[MKWIFIDEV_CRASH_LOG/4];
+
+void MkWifiDev::saveCrashLog() {
+  if(crashRing.isActive())
+    ESP.rtcUserMemoryWrite(CRASH_RTC_BLOCK, crashMem, sizeof(crashMem));
+}
+
+#ifndef MKWIFIDEV_OWN_CRASH_CALLBACK
+// Called by the core after an exception or software watchdog reset (but not the hardware watchdog)
+extern "C" void custom_crash_callback(struct rst_info*, uint32_t, uint32_t) {
+  WifiDev.saveCrashLog();
+}
+#endif
+#else
+#error "MKWIFIDEV_CRASH_LOG is only supported on the ESP32 & ESP8266"
+#endif
+
+// Attaches the ring on the first message or loop(), keeping a copy of the lines from before the reset for loop() to
+// show, then clears it for this boot's lines
+void MkWifiDev::crashLogStart() {
+  crashLog.started = true;
+#ifdef ESP8266
+  ESP.rtcUserMemoryRead(CRASH_RTC_BLOCK, crashMem, sizeof(crashMem));
+#endif
+  int lines = crashRing.attach(crashMem, sizeof(crashMem));
+  if(lines > 0)
+    crashLog.prev = (char*)malloc(sizeof(crashMem));    // Each line is a 2 byte length & its text, so it fits
+  if(crashLog.prev) {
+    char *p = crashLog.prev;
+    uint32_t pos = crashRing.first();
+    int len;
+    while((len = crashRing.read(pos, p + sizeof(uint16_t), crashRing.maxLine())) >= 0) {
+      uint16_t n = len;
+      memcpy(p, &n, sizeof(n));
+      p += sizeof(n) + n;
+    }
+    crashLog.prevLen = p - crashLog.prev;
+    crashLog.prevLines = lines;
+  }
+
+  crashRing.clear();
+#ifdef ESP8266
+  saveCrashLog();     // So a reset that isn't a crash doesn't show the same lines again
+#endif
+}
+
+// Sends the lines from before the reset to the outputs, between notices so they aren't mistaken for this boot's
+void MkWifiDev::crashLogReplay(uint8_t outputs, int8_t client) {
+  char notice[80];
+  lockReport();
+  crashLog.replaying = true;
+
+  // The lines go to the outputs, or just to the given remote terminal
+  auto replayLine = [&](const char *text, size_t len) {
+#ifndef LOCAL_SERIAL_ONLY
+    if(client >= 0) {
+      clientWrite(terms[client], text, len, true);
+      return;
+    }
+#endif
+    emitBegin(NORMAL, outputs, true);
+    emitPart(text, len);
+    emitEnd();
+  };
+
+#if defined(ESP32)
+  snprintf(notice, sizeof(notice), "*** Last %u lines before the restart (%s) ***", 
+    crashLog.prevLines, resetReasonName(esp_reset_reason()));
+#else
+  snprintf(notice, sizeof(notice), "*** Last %u lines before the restart (%s) ***", 
+    crashLog.prevLines, ESP.getResetReason().c_str());
+#endif
+  replayLine(notice, strlen(notice));
+
+  for(const char *p = crashLog.prev; p < crashLog.prev + crashLog.prevLen; ) {
+    uint16_t len;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    replayLine(p, len);
+    p += len;
+  }
+  const char *end = "*** End of lines from before the restart ***";
+  replayLine(end, strlen(end));
+
+  crashLog.replaying = false;
+  unlockReport();
+}
+#endif
+
 void MkWifiDev::checkMemUsage() {
 #ifdef ESP32
   uint32_t tnow = millis();
@@ -371,256 +3638,485 @@ void MkWifiDev::checkMemUsage() {
     tprev = tnow;
   }
 #endif
+#ifdef MKWIFIDEV_HEAP_MONITOR
+  if(heapMon.intervalMs && (millis() - heapMon.tLast) >= heapMon.intervalMs)
+    sampleHeap();
+#endif
 }
 
-bool MkWifiDev::loop() {
+#ifdef MKWIFIDEV_HEAP_MONITOR
+void MkWifiDev::setHeapMonitor(uint16_t intervalMs) {
+  heapMon.intervalMs = intervalMs;
+  heapMon.count = 0;
+  heapMon.next = 0;
+}
 
-#ifndef LOCAL_SERIAL_ONLY
-  connect_loop();
+void MkWifiDev::setHeapAlerts(uint32_t minFree, uint32_t minBlock, uint8_t maxFragPct) {
+  heapMon.minFree = minFree;
+  heapMon.minBlock = minBlock;
+  heapMon.maxFrag = maxFragPct;
+  heapMon.alerted = 0;
+}
 
-  ArduinoOTA.handle();
+// Percentage of the free heap that isn't in the largest free block, ie can't be allocated in one piece
+static uint8_t heapFragmentation(uint32_t free, uint32_t largest) {
+  return (largest < free) ? 100 - (uint64_t)largest * 100 / free : 0;
+}
+
+// Adds a sample to heapMon & checks the alert thresholds. Nothing is allocated, but finding the largest free block
+// means walking the heap's list of blocks (the time taken is shown by 'h' in Command Mode)
+void MkWifiDev::sampleHeap() {
+  uint32_t tStart = mkCycleCount();
+  HeapSample &s = heapMon.samples[heapMon.next];
+#ifdef ESP32
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  s.free = info.total_free_bytes;
+  s.largest = info.largest_free_block;
+  s.blocks = min(info.allocated_blocks, (size_t)UINT16_MAX);
+  s.psram = ESP.getPsramSize() ? heap_caps_get_free_size(MALLOC_CAP_SPIRAM) : 0;
+#else
+  s.free = ESP.getFreeHeap();
+  s.largest = ESP.getMaxFreeBlockSize();
+  s.blocks = 0;
+  s.psram = 0;
 #endif
-  
-  checkMemUsage();
+  uint32_t tnow = millis();
+  s.dtMs = heapMon.count ? min(tnow - heapMon.tLast, (uint32_t)UINT16_MAX) : 0;
+  heapMon.tLast = tnow;
+  heapMon.next = (heapMon.next + 1) % MKWIFIDEV_HEAP_SAMPLES;
+  if(heapMon.count < MKWIFIDEV_HEAP_SAMPLES)
+    heapMon.count++;
+  heapMon.sampleCycles = mkCycleCount() - tStart;
 
-#ifndef LOCAL_SERIAL_ONLY
+  uint8_t frag = heapFragmentation(s.free, s.largest);
+  checkHeapAlert(1, s.free < heapMon.minFree, "free heap", s.free, heapMon.minFree);
+  checkHeapAlert(2, s.largest < heapMon.minBlock, "largest free block", s.largest, heapMon.minBlock);
+  checkHeapAlert(4, heapMon.maxFrag && frag > heapMon.maxFrag, "fragmentation", frag, heapMon.maxFrag);
+}
 
-  if(nNtpRetries && WiFi.status() == WL_CONNECTED) {
-    uint32_t tnow = millis();
-    static uint32_t timeForNextAttempt = 0;
+// Reports a threshold being crossed, then nothing more until the value has recovered
+void MkWifiDev::checkHeapAlert(uint8_t bit, bool low, const char *what, uint32_t value, uint32_t limit) {
+  if(low == ((heapMon.alerted & bit) != 0))
+    return;
 
-    if(tnow > timeForNextAttempt) {
-      struct tm timeinfo;
-      if(getLocalTime(&timeinfo), 1500) {  // 1.5 second timeout
-        DBG_ALERT("Received NTP Time: %s", asctime(&timeinfo));   
-        nNtpRetries = 0;
-      } else {
-        DBG_ERROR("Failed to obtain NTP time. Will retry %d more times", --nNtpRetries);      
-        timeForNextAttempt = tnow + 10000;     // 10 seconds between retries
-      }
-    }
-  }
+  heapMon.alerted ^= bit;
+  const char *unit = (bit == 4) ? "%" : " bytes";
+  if(low)
+    Report(nullptr, WARNING, "Heap alert: %s %u%s, %s %u%s", what, value, unit, (bit == 4) ? "above" : "below", limit, unit);
+  else
+    Report(nullptr, INFO, "Heap recovered: %s %u%s", what, value, unit);
+}
 
-  static bool bSendWelcome = false;
-  static uint32_t tconnect;
+void MkWifiDev::showHeapMonitor(char *line) {
+  static const char levels[] = "_.:-=+*#%@";
+  int n = min((int)heapMon.count, TERMINAL_WIDTH - 14);     // Number of the latest samples shown
+  auto sample = [&](int i) -> HeapSample & {                // i=0 is the oldest shown
+    return heapMon.samples[(heapMon.next + MKWIFIDEV_HEAP_SAMPLES - n + i) % MKWIFIDEV_HEAP_SAMPLES];
+  };
 
-  //check if there are any new clients
-  if (pserver && pserver->hasClient()){
-      bool bAccepted = false;
-      if (!serverClient || !serverClient.connected()){
-        if(serverClient) serverClient.stop();
-        #if defined(ESP32)
-          serverClient = pserver->available();
-        #elif defined(ESP8266)
-          serverClient = pserver->accept();
-        #endif
-        if (!serverClient) DBG_ALERT("available broken");
-        DBG_ALERT("Client connected with IP: %s", serverClient.remoteIP().toString().c_str());
-        bAccepted = true;
-        bSendWelcome = true;
-        tconnect = millis();
-        bCommandMode = false;
-      }
-    if (!bAccepted) {
-      #if defined(ESP32)
-        pserver->available().stop();
-      #elif defined(ESP8266)
-        pserver->accept().stop();
-      #endif
-    }
+  printFullLine(line);
+  if(heapMon.intervalMs)
+    snprintf(line, TERMINAL_WIDTH-2, " |  Heap Monitor: %u samples every %u ms (sampling takes %.0f us)",
+      heapMon.count, heapMon.intervalMs, cyclesToMicros(heapMon.sampleCycles));
+  else
+    strcpy(line, " |  Heap Monitor: Off");
+  printWithEnd(line);
+  printFullLine(line);
+  if(!n) {
+    strcpy(line, " |  No samples yet");
+    printWithEnd(line);
+    printFullLine(line);
+    return;
   }
 
-  if(bSendWelcome && serverClient.connected()) {
-    if((millis() - tconnect) > 100) {   // Wait a bit after connection to ensure message goes through
-      serverClient.println(" +---------------------------------------------+");
-      serverClient.println(" |     Connected to remote device via WiFi     |");
-      serverClient.println(" |        Press Ctrl-A for Command Mode        |");
-      serverClient.println(" +---------------------------------------------+");
-      bSendWelcome = false;
-      termConnected = 1;
-      pCommand = &serverClient;
+  // Latest, lowest & highest value shown, then a sparkline of the samples scaled between the lowest & highest
+  auto series = [&](const char *name, uint32_t (*value)(const HeapSample &)) {
+    uint32_t lo = UINT32_MAX, hi = 0;
+    for(int i=0; i<n; i++) {
+      lo = min(lo, value(sample(i)));
+      hi = max(hi, value(sample(i)));
     }
-  }
+    snprintf(line, TERMINAL_WIDTH-2, " |  %-20s %10u %10u %10u", name, value(sample(n-1)), lo, hi);
+    printWithEnd(line);
+    char *p = line + sprintf(line, " |    ");
+    for(int i=0; i<n; i++)
+      *p++ = levels[(hi > lo) ? (uint64_t)(value(sample(i)) - lo) * (sizeof(levels)-2) / (hi - lo) : 4];
+    *p = '\0';
+    printWithEnd(line);
+  };
 
-  if(termConnected && !serverClient.connected()) {
-    DBG_ALERT("Remote terminal disconnected, resuming control by serial port");
-    termConnected = 0;
-    pCommand = pSerial;
+  sprintf(line, " |  %-20s %10s %10s %10s", "Oldest to latest", "Latest", "Lowest", "Highest");
+  printWithEnd(line);
+  series("Free heap", [](const HeapSample &s) { return s.free; });
+  series("Largest free block", [](const HeapSample &s) { return s.largest; });
+  series("Fragmentation %", [](const HeapSample &s) { return (uint32_t)heapFragmentation(s.free, s.largest); });
+  if(sample(n-1).psram)
+    series("Free PSRAM", [](const HeapSample &s) { return s.psram; });
+
+  // Net allocation rate, from the change in free heap (& allocated blocks) between samples
+  if(n > 1) {
+    auto rate = [&](int i, int32_t v) { return sample(i).dtMs ? (int32_t)((int64_t)v * 1000 / sample(i).dtMs) : 0; };
+    int32_t peak = INT32_MIN;
+    for(int i=1; i<n; i++)
+      peak = max(peak, rate(i, sample(i-1).free - sample(i).free));
+    char *p = line + sprintf(line, " |  Allocated: %+d bytes/s", rate(n-1, sample(n-2).free - sample(n-1).free));
+#ifdef ESP32
+    p += sprintf(p, ", %+d blocks/s", rate(n-1, sample(n-1).blocks - sample(n-2).blocks));
+#endif
+    sprintf(p, ", peak %+d bytes/s", peak);
+    printWithEnd(line);
   }
+
+  char *p = line + sprintf(line, " |  Alerts:");
+  if(heapMon.minFree)
+    p += sprintf(p, "  free < %u", heapMon.minFree);
+  if(heapMon.minBlock)
+    p += sprintf(p, "  block < %u", heapMon.minBlock);
+  if(heapMon.maxFrag)
+    p += sprintf(p, "  fragmentation > %u%%", heapMon.maxFrag);
+  if(!heapMon.minFree && !heapMon.minBlock && !heapMon.maxFrag)
+    strcpy(p, "  None (see setHeapAlerts())");
+  printWithEnd(line);
+  printFullLine(line);
+}
 #endif
 
+// Handles Ctrl-A & the Command Mode keys
+void MkWifiDev::command_loop() {
+  if(!pCommand->available())
+    return;
+
   char line[TERMINAL_WIDTH+1];
 
-  if(pCommand->available()) {
-    if(peek() == 0x01) {  // Check for Ctrl-a
-      bCommandMode = !bCommandMode;
-      if(!bCommandMode) {
-        pCommand->read();   // remove Ctrl-a from buffer
-        DBG_ALERT("Returning to normal mode");
-      }
-    }  
-    if(bCommandMode) {
-      static uint8_t waitForConfirm = 0;
-      char c = tolower(pCommand->read());
-
-      if(waitForConfirm && (c == 'y')) {
-        DBG_ALERT("About to restart, please reconnect if using remote terminal");
-        delay(200);
-        #if defined(ESP32)
-          esp_restart();
-        #elif defined (ESP8266)
-          ESP.restart();
-        #endif
-      }
-      waitForConfirm = 0;
-
-      switch(c) {
-        case 'v' : toggleTypeEnableFlag(VERBOSE); break;   
-        case 'd' : toggleTypeEnableFlag(DEBUG);   break;   
-        case 'i' : toggleTypeEnableFlag(INFO);    break;   
-        case 'w' : toggleTypeEnableFlag(WARNING); break;   
-        case 't' : dispMode ^= SHOW_TIMESTAMPS; break;
-        case 'y' : dispMode ^= SHOW_DATE; break;
-        case 'm' : dispMode ^= SHOW_MILLISECONDS;   break;
-        case 'c' : dispMode ^= SHOW_COLOUR; break; 
-        case 'f' : dispMode ^= SHOW_TYPE; break; 
-        case 'r' : println("Are you sure want to restart?");
-                   println("  Press 'y' to confirm, any other key to cancel:");
-                   waitForConfirm = 1; 
-                   return bOtaBusy;  
-        default : c = 0x01; break;  // Show full menu if none of the above
-      }
+  if(peek() == 0x01) {  // Check for Ctrl-a
+    if(!bCommandMode)
+      flushLogs();      // Write out anything queued before showing the menu
+    bCommandMode = !bCommandMode;
+    if(!bCommandMode) {
+      pCommand->read();   // remove Ctrl-a from buffer
+      DBG_ALERT("Returning to normal mode");
+    }
+  }  
+  if(bCommandMode) {
+    static uint8_t waitForConfirm = 0;
+    char c = tolower(pCommand->read());
+
+    if(waitForConfirm && (c == 'y')) {
+      DBG_ALERT("About to restart, please reconnect if using remote terminal");
+      flushLogs();
+      delay(200);
+      #if defined(ESP32)
+        esp_restart();
+      #elif defined (ESP8266)
+        ESP.restart();
+      #endif
+    }
+    waitForConfirm = 0;
+
+    switch(c) {
+      case 'v' : toggleTypeEnableFlag(VERBOSE); break;   
+      case 'd' : toggleTypeEnableFlag(DEBUG);   break;   
+      case 'i' : toggleTypeEnableFlag(INFO);    break;   
+      case 'w' : toggleTypeEnableFlag(WARNING); break;   
+      case 't' : dispMode ^= SHOW_TIMESTAMPS; break;
+      case 'y' : dispMode ^= SHOW_DATE; break;
+      case 'm' : dispMode ^= SHOW_MILLISECONDS;   break;
+      case 'c' : dispMode ^= SHOW_COLOUR; break; 
+      case 'f' : dispMode ^= SHOW_TYPE; break; 
+      case 'g' : if(nTags + nSeen) tagSel = (tagSel+1) % (nTags + nSeen); break;
+      case 'l' : if(tagSel >= nTags && tagSel < nTags + nSeen) {    // Seen tags are given a level when first changed
+                   int idx = findTag(seenTags[tagSel-nTags], true);
+                   if(idx >= 0)
+                     tagSel = idx;
+                 }
+                 if(tagSel < nTags)
+                   tags[tagSel].level = (tags[tagSel].level+1) % (CRITICAL+1);
+                 break;
+#ifndef LOCAL_SERIAL_ONLY
+      case 'n' : showNetworkStats(line); return;
+#endif
+      case 's' : showSuppressionStats(line); return;
+#ifdef MKWIFIDEV_TIMERS
+      case 'p' : showTimers(line); return;
+#endif
+#ifdef MKWIFIDEV_PROFILE_LOOP
+      case 'o' : showLoopProfile(line); return;
+#endif
+#ifdef MKWIFIDEV_HEAP_MONITOR
+      case 'h' : showHeapMonitor(line); return;
+#endif
+      case 'r' : println("Are you sure want to restart?");
+                 println("  Press 'y' to confirm, any other key to cancel:");
+                 waitForConfirm = 1; 
+                 return;  
+      default : c = 0x01; break;  // Show full menu if none of the above
+    }
 
-      printFullLine(line);
+    printFullLine(line);
 
 // Only show this portion of output on initial Ctrl-A, or unasigned control character received
 if(c==0x01) {
 #ifdef _APPNAME_
-      strcpy(line, " |  " TOSTRING(_APPNAME_) " : Built " __DATE__ " " __TIME__);
+    strcpy(line, " |  " TOSTRING(_APPNAME_) " : Built " __DATE__ " " __TIME__);
 #else
-      strcpy(line, " |  MkWifiDev - Build Timestamp " __DATE__ " " __TIME__);
+    strcpy(line, " |  MkWifiDev - Build Timestamp " __DATE__ " " __TIME__);
 #endif
-      printWithEnd(line);
-      printFullLine(line);
+    printWithEnd(line);
+    printFullLine(line);
 #if defined(ESP32)
-      sprintf(line, " |  %s Rev%d,  %d core(s)    ChipID: %llX",
-        ESP.getChipModel(), ESP.getChipRevision(), ESP.getChipCores(), ESP.getEfuseMac());
-      printWithEnd(line);
+    sprintf(line, " |  %s Rev%d,  %d core(s)    ChipID: %llX",
+      ESP.getChipModel(), ESP.getChipRevision(), ESP.getChipCores(), ESP.getEfuseMac());
+    printWithEnd(line);
  
-      sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash  %d KB RAM  %d KB PSRAM",
-        getCpuFrequencyMhz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)), int(ESP.getHeapSize() / 1024.0), 
-        int(ESP.getPsramSize() / 1024.0));
-      printWithEnd(line);
+    sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash  %d KB RAM  %d KB PSRAM",
+      getCpuFrequencyMhz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)), int(ESP.getHeapSize() / 1024.0), 
+      int(ESP.getPsramSize() / 1024.0));
+    printWithEnd(line);
 
 #ifndef LOCAL_SERIAL_ONLY
-      char lan[32];
-      if (WiFi.status() == WL_CONNECTED)
-        sprintf(lan, "Connected   IP %s", WiFi.localIP().toString().c_str());
-      else
-        strcpy(lan,"Not Connected");
-      sprintf(line, " |  Wifi %s    Debug Control: %s",
-        lan, termConnected ? "Network" : "Serial");
-      printWithEnd(line);
+    char lan[32];
+    if (WiFi.status() == WL_CONNECTED)
+      sprintf(lan, "Connected   IP %s", WiFi.localIP().toString().c_str());
+    else
+      strcpy(lan,"Not Connected");
+    sprintf(line, " |  Wifi %s    Debug Control: %s",
+      lan, termConnected ? "Network" : "Serial");
+    printWithEnd(line);
 
-      //This seems to be really slow, so leave out for now
-      //sprintf(line, " |  Sketch Size: %d,   Free Space: %d", ESP.getSketchSize(), ESP.getFreeSketchSpace());
-      //printWithEnd(line);
+    //This seems to be really slow, so leave out for now
+    //sprintf(line, " |  Sketch Size: %d,   Free Space: %d", ESP.getSketchSize(), ESP.getFreeSketchSpace());
+    //printWithEnd(line);
 
-      sprintf(line, " |  Free Main RAM: %d, Free Heap: Low: %d, Current: %d", 
-        esp_get_free_heap_size()-ESP.getFreePsram(), esp_get_minimum_free_heap_size(), esp_get_free_heap_size() );
-      printWithEnd(line);
+    sprintf(line, " |  Free Main RAM: %d, Free Heap: Low: %d, Current: %d", 
+      esp_get_free_heap_size()-ESP.getFreePsram(), esp_get_minimum_free_heap_size(), esp_get_free_heap_size() );
+    printWithEnd(line);
 
-      time_t uptime = esp_timer_get_time()/1000000;
-      struct tm *tm_up = gmtime(&uptime);
-      sprintf(line, " |  System Uptime: %d days %dh %d m %ds     WiFi RSSI: %d", int(uptime/(24*3600)), 
-        tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec, WiFi.RSSI()); 
-      printWithEnd(line);
+    time_t uptime = esp_timer_get_time()/1000000;
+    struct tm *tm_up = gmtime(&uptime);
+    sprintf(line, " |  System Uptime: %d days %dh %d m %ds     WiFi RSSI: %d", int(uptime/(24*3600)), 
+      tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec, WiFi.RSSI()); 
+    printWithEnd(line);
 #else
-      //This seems to be really slow, so leave out for now
-      //sprintf(line, " |  Sketch Size: %d,   Free Space: %d", ESP.getSketchSize(), ESP.getFreeSketchSpace());
-      //printWithEnd(line);
+    //This seems to be really slow, so leave out for now
+    //sprintf(line, " |  Sketch Size: %d,   Free Space: %d", ESP.getSketchSize(), ESP.getFreeSketchSpace());
+    //printWithEnd(line);
 
-      sprintf(line, " |  Free Main RAM: %d, Free Heap: Low: %d, Current: %d", 
-        esp_get_free_heap_size()-ESP.getFreePsram(), esp_get_minimum_free_heap_size(), esp_get_free_heap_size() );
-      printWithEnd(line);
+    sprintf(line, " |  Free Main RAM: %d, Free Heap: Low: %d, Current: %d", 
+      esp_get_free_heap_size()-ESP.getFreePsram(), esp_get_minimum_free_heap_size(), esp_get_free_heap_size() );
+    printWithEnd(line);
 
-      time_t uptime = esp_timer_get_time()/1000000;
-      struct tm *tm_up = gmtime(&uptime);
-      sprintf(line, " |  System Uptime: %d days %dh %d m %ds", int(uptime/(24*3600)), 
-        tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec); 
-      printWithEnd(line);
+    time_t uptime = esp_timer_get_time()/1000000;
+    struct tm *tm_up = gmtime(&uptime);
+    sprintf(line, " |  System Uptime: %d days %dh %d m %ds", int(uptime/(24*3600)), 
+      tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec); 
+    printWithEnd(line);
 #endif
 
-      const char* esp_reset_strings[] = { "Unknonw", "Power On", "Ext Pin", "Software Reset", "Exception/Panic", 
-        "Internal Watchdog", "Task Watchdog", "Other Watchdog", "Deep Sleep", "Brown Out", "Reset over SDIO" };
-
-      esp_reset_reason_t r = esp_reset_reason();
-      sprintf(line, " |  ESP Restart Reason: %d (%s)", r, esp_reset_strings[r]); 
-      printWithEnd(line);
+    esp_reset_reason_t r = esp_reset_reason();
+    sprintf(line, " |  ESP Restart Reason: %d (%s)", r, resetReasonName(r)); 
+    printWithEnd(line);
+#if MKWIFIDEV_CRASH_LOG
+    sprintf(line, " |  Crash Log: %u lines from before the restart, %u bytes kept", 
+      crashLog.prevLines, MKWIFIDEV_CRASH_LOG);
+    printWithEnd(line);
+#endif
 
-      printFullLine(line);
+    printFullLine(line);
 #elif defined(ESP8266)
-      sprintf(line, " |  %s   Version %s   ChipID: %08X",
-        "ESP8266", ESP.getCoreVersion().c_str(), ESP.getChipId());
-      printWithEnd(line);
+    sprintf(line, " |  %s   Version %s   ChipID: %08X",
+      "ESP8266", ESP.getCoreVersion().c_str(), ESP.getChipId());
+    printWithEnd(line);
 
 #ifndef LOCAL_SERIAL_ONLY
-      sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash     MAC Addr: %s",
-        ESP.getCpuFreqMHz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)), WiFi.macAddress().c_str() );
-      printWithEnd(line);
+    sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash     MAC Addr: %s",
+      ESP.getCpuFreqMHz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)), WiFi.macAddress().c_str() );
+    printWithEnd(line);
 
-      char lan[32];
-      if (WiFi.status() == WL_CONNECTED)
-        sprintf(lan, "Connected  IP: %s", WiFi.localIP().toString().c_str());
-      else
-        strcpy(lan,"Not Connected");
-      sprintf(line, " |  Wifi %s    DeviceName: %s",
-        lan, mdns_devname);
-      printWithEnd(line);
+    char lan[32];
+    if (WiFi.status() == WL_CONNECTED)
+      sprintf(lan, "Connected  IP: %s", WiFi.localIP().toString().c_str());
+    else
+      strcpy(lan,"Not Connected");
+    sprintf(line, " |  Wifi %s    DeviceName: %s",
+      lan, mdns_devname);
+    printWithEnd(line);
 
-      sprintf(line, " |  Free Heap: %d       Debug Control: %s", system_get_free_heap_size(), 
-          termConnected ? "Network" : "Serial");
-      printWithEnd(line);
+    sprintf(line, " |  Free Heap: %d       Debug Control: %s", system_get_free_heap_size(), 
+        termConnected ? "Network" : "Serial");
+    printWithEnd(line);
 
-      time_t uptime = millis()/1000;
-      struct tm *tm_up = gmtime(&uptime);
-      sprintf(line, " |  System Uptime: %d days %dh %d m %ds      WiFi RSSI: %d", int(uptime/(24*3600)), 
-        tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec, WiFi.RSSI()); 
-      printWithEnd(line);
+    time_t uptime = millis()/1000;
+    struct tm *tm_up = gmtime(&uptime);
+    sprintf(line, " |  System Uptime: %d days %dh %d m %ds      WiFi RSSI: %d", int(uptime/(24*3600)), 
+      tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec, WiFi.RSSI()); 
+    printWithEnd(line);
 #else      
-      sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash",
-        ESP.getCpuFreqMHz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)));
-      printWithEnd(line);
+    sprintf(line, " |  CPU Frequency: %d MHz  %d MB Flash",
+      ESP.getCpuFreqMHz(), int(ESP.getFlashChipSize() / (1024.0 * 1024)));
+    printWithEnd(line);
 
-      time_t uptime = millis()/1000;
-      struct tm *tm_up = gmtime(&uptime);
-      sprintf(line, " |  System Uptime: %d days %dh %d m %ds", int(uptime/(24*3600)), 
-        tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec); 
-      printWithEnd(line);
+    time_t uptime = millis()/1000;
+    struct tm *tm_up = gmtime(&uptime);
+    sprintf(line, " |  System Uptime: %d days %dh %d m %ds", int(uptime/(24*3600)), 
+      tm_up->tm_hour, tm_up->tm_min, tm_up->tm_sec); 
+    printWithEnd(line);
 #endif
 
-      sprintf(line, " |  ESP Restart Reason: %s", ESP.getResetReason().c_str()); 
-      printWithEnd(line);
+    sprintf(line, " |  ESP Restart Reason: %s", ESP.getResetReason().c_str()); 
+    printWithEnd(line);
+#if MKWIFIDEV_CRASH_LOG
+    sprintf(line, " |  Crash Log: %u lines from before the restart, %u bytes kept", 
+      crashLog.prevLines, MKWIFIDEV_CRASH_LOG);
+    printWithEnd(line);
+#endif
 
-      printFullLine(line);
+    printFullLine(line);
 
 #endif
 }
-      strcpy(line, " |  In Command Mode (Debug Paused) - Press Ctrl-A again to exit");
-      printWithEnd(line);
-      sprintf(line, " |    v)erbose [%c]      d)ebug [%c]     i)nfo [%c]     w)arning [%c]", 
-        enableFlags&2?'#':' ', enableFlags&4?'#':' ', enableFlags&8?'#':' ', enableFlags&16?'#':' ');
-      printWithEnd(line);
-      strcpy(line, " |  t)imestamps   m)illiseconds   y)y/mm/dd   f)lags   c)olor   r)eset");
+    strcpy(line, " |  In Command Mode (Debug Paused) - Press Ctrl-A again to exit");
+    printWithEnd(line);
+    sprintf(line, " |    v)erbose [%c]      d)ebug [%c]     i)nfo [%c]     w)arning [%c]", 
+      enableFlags&2?'#':' ', enableFlags&4?'#':' ', enableFlags&8?'#':' ', enableFlags&16?'#':' ');
+    printWithEnd(line);
+    strcpy(line, " |  t)imestamps   m)illiseconds   y)y/mm/dd   f)lags   c)olor   r)eset");
+    printWithEnd(line);
+    strcpy(line, " |  Stats: s)uppression");
+#ifdef MKWIFIDEV_HEAP_MONITOR
+    strcat(line, "   h)eap");
+#endif
+#ifndef LOCAL_SERIAL_ONLY
+    strcat(line, "   n)etwork");
+#endif
+#ifdef MKWIFIDEV_TIMERS
+    strcat(line, "   p)rofile timers");
+#endif
+#ifdef MKWIFIDEV_PROFILE_LOOP
+    strcat(line, "   o)verhead");
+#endif
+    printWithEnd(line);
+    if(tagSel >= nTags + nSeen)
+      tagSel = 0;
+    if(nTags + nSeen) {
+      bool hasLevel = tagSel < nTags;
+      snprintf(line, TERMINAL_WIDTH-2, " |  g)tag: %s (%d of %d)   l)evel: %s", 
+        hasLevel ? tags[tagSel].name : seenTags[tagSel-nTags], tagSel+1, nTags + nSeen,
+        levelNames[hasLevel ? tags[tagSel].level : 0]);
       printWithEnd(line);
-      printFullLine(line);
-      print(" | ");    // Output before example message
-      Report(nullptr, MessageType(OVERRIDE | Cyan),"%sExample message with current settings", dispMode & SHOW_TYPE ? "[V]" : "");
-      printFullLine(line);
     }
+    printFullLine(line);
+    print(" | ");    // Output before example message
+    reportText(nullptr, MessageType(OVERRIDE | Cyan),"%sExample message with current settings", dispMode & SHOW_TYPE ? "[V]" : "");
+    printFullLine(line);
+  }
+}
+
+bool MkWifiDev::loop() {
+#ifndef LOCAL_SERIAL_ONLY
+  uint32_t tLoopStart = mkCycleCount();
+#endif
+  PROFILE_START();
+#ifdef MKWIFIDEV_PROFILE_LOOP
+  uint32_t tLoop = tProfile;
+#endif
+
+#ifndef LOCAL_SERIAL_ONLY
+  connect_loop();
+  PROFILE_ADD(PROF_WIFI);
+
+  ArduinoOTA.handle();
+  PROFILE_ADD(PROF_OTA);
+#endif
+  
+  checkMemUsage();
+  PROFILE_ADD(PROF_MEMORY);
+
+  lockReport();
+  if(repeats.count && (millis() - repeats.tReport) >= repeats.timeoutMs)
+    reportRepeats();
+  unlockReport();
+
+  if(!bCommandMode) {   // Queued messages & hex dumps are held while in Command Mode
+    drainIsrLogs();
+    drainLogs(DRAIN_BUDGET_MS);
+    lockReport();
+    if(hexDump.ptr)
+      hexDumpLines(MKWIFIDEV_HEXDUMP_CHUNK);
+    unlockReport();
+
+#if MKWIFIDEV_CRASH_LOG
+    if(!crashLog.started)
+      crashLogStart();
+    if(crashLog.prev && !crashLog.shown) {
+      crashLogReplay(activeOutputs() & ~jsonOutputs & CONSOLE_OUTPUTS);    // Includes the backlog for terminals
+      crashLog.shown = true;
+      bool forTerminal = false;   // Without a backlog, they're sent to the first remote terminal to connect
+#ifndef LOCAL_SERIAL_ONLY
+      forTerminal = !backlog.isActive() && !(jsonOutputs & TERMINAL_OUTPUT);
+#endif
+      if(!forTerminal) {
+        free(crashLog.prev);
+        crashLog.prev = nullptr;
+      }
+    }
+#endif
+  }
+
+  lockReport();
+  if(logFile.len && (millis() - logFile.tFirst) >= logFile.flushMs)
+    fileFlush();
+  unlockReport();
+  PROFILE_ADD(PROF_LOGS);
+
+#ifndef LOCAL_SERIAL_ONLY
+
+  if(nNtpRetries && wifiLink.isConnected()) {
+    uint32_t tnow = millis();
+    static uint32_t timeForNextAttempt = 0;
+
+    if(tnow > timeForNextAttempt) {
+      struct tm timeinfo;
+      if(getLocalTime(&timeinfo), 1500) {  // 1.5 second timeout
+        DBG_ALERT("Received NTP Time: %s", asctime(&timeinfo));   
+        nNtpRetries = 0;
+      } else {
+        DBG_ERROR("Failed to obtain NTP time. Will retry %d more times", --nNtpRetries);      
+        timeForNextAttempt = tnow + 10000;     // 10 seconds between retries
+      }
+    }
+  }
+
+  PROFILE_ADD(PROF_NTP);
+
+  terminal_loop();
+  PROFILE_ADD(PROF_TERMINALS);
+
+  metrics_loop();
+  PROFILE_ADD(PROF_METRICS);
+
+  syslog_loop();
+  PROFILE_ADD(PROF_SYSLOG);
+#endif
+
+  command_loop();
+  PROFILE_ADD(PROF_COMMAND);
+
+#ifdef MKWIFIDEV_PROFILE_LOOP
+  profileAdd(PROF_LOOP, tLoop);
+  if(profile.reportSecs && (millis() - profile.tStart) >= profile.reportSecs*1000UL) {
+    reportLoopProfile();
+    resetLoopProfile();
   }
+#endif
 
 #ifndef LOCAL_SERIAL_ONLY
+  uint32_t loopCycles = mkCycleCount() - tLoopStart;
+  loopStats.cycles += loopCycles;
+  loopStats.calls++;
+  if(loopCycles > loopStats.maxCycles)
+    loopStats.maxCycles = loopCycles;
+
   // If a TCP debug session is active, respond to any activity on local serial port
   if(termConnected) {
     if(pSerial->available()) {
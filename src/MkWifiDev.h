@@ -13,43 +13,218 @@
 // Define these as desired (or set them using compiler build flags, eg in platformio.ini)
 //#define _APPNAME_  "MyCoolApp" // App name shown in the Command Mode terminal display
 //#define DEBUG_SHOW_FILE        // Shows the calling filename & line number in output
+//#define DEBUG_SHOW_FILE_ID     // Shows a short ID for the file instead (expanded by tools/mkdecode.py --src)
 //#define DEBUG_SHOW_FUNCTION    // Shows the calling function name in output
 //#define LOCAL_SERIAL_ONLY      // No wifi or OTA support will be included
+//#define MKWIFIDEV_MIN_LEVEL MkWifiDev::INFO   // Removes lower level messages (eg verbose/debug) from the build
+//#define MKWIFIDEV_RATE_LIMIT  10      // Limits each DBG_xxx call site to this many messages per second
+//#define MKWIFIDEV_TIMERS              // Enables DBG_SCOPE_TIMER profiling (must be set for all files, eg as a build flag)
+//#define MKWIFIDEV_PROFILE_LOOP        // Times each loop() phase & output (must be set for all files, eg as a build flag)
 
 #include <Arduino.h>
+#include <atomic>
+#include <type_traits>
+#if !defined(MKWIFIDEV_HAS_FS) && (defined(ESP32) || defined(ESP8266))
+  #define MKWIFIDEV_HAS_FS        // Log files can be opened & rotated by the library (otherwise only streams are supported)
+#endif
+#ifdef MKWIFIDEV_HAS_FS
+  #include <FS.h>
+#endif
 #if defined(LOCAL_SERIAL_ONLY)
     #warning "Building MkWifiDev without WiFi support - Remote debugging and OTA updates disabled"
     #include "sys/time.h"
 #else
     #include <ArduinoOTA.h> 
+    #include <WiFiUdp.h>
+#endif
+
+#ifndef MKWIFIDEV_TCP_BUFFER      // Remote terminal output is collected & sent in blocks of up to this size
+  #ifdef ESP8266
+    #define MKWIFIDEV_TCP_BUFFER  (536)     // ie one TCP segment (lwIP default MSS)
+  #else
+    #define MKWIFIDEV_TCP_BUFFER  (1436)
+  #endif
+#endif
+
+#ifndef MKWIFIDEV_ZIP_WINDOW      // Earlier output used to compress remote terminal output (see tools/mkzcat.py), up to 2048
+  #ifdef ESP8266
+    #define MKWIFIDEV_ZIP_WINDOW  (1024)
+  #else
+    #define MKWIFIDEV_ZIP_WINDOW  (2048)
+  #endif
+#endif
+
+#ifndef MKWIFIDEV_ZIP_CHAIN       // Earlier matches tried for each byte when compressing, more compress better but slower.
+  #ifdef ESP8266                  // 1 needs half the memory
+    #define MKWIFIDEV_ZIP_CHAIN   (1)
+  #else
+    #define MKWIFIDEV_ZIP_CHAIN   (4)
+  #endif
+#endif
+
+#ifndef MKWIFIDEV_UDP_BUFFER      // Syslog messages are combined into datagrams of up to this size
+  #ifdef ESP8266
+    #define MKWIFIDEV_UDP_BUFFER  (512)
+  #else
+    #define MKWIFIDEV_UDP_BUFFER  (1400)    // Fits in one Ethernet frame with room for the IP & UDP headers
+  #endif
+#endif
+
+#ifndef MKWIFIDEV_FILE_BUFFER     // Log file output is collected & written in blocks of this size (a multiple of the
+  #define MKWIFIDEV_FILE_BUFFER  (512)   // 512 byte sector size, so SD cards aren't rewriting sectors for every line)
+#endif
+
+#ifndef MKWIFIDEV_FORMAT_CHUNK    // Text messages are formatted in pieces of this size & written straight to the outputs, so
+  #define MKWIFIDEV_FORMAT_CHUNK  (128)  // their length isn't limited. This much stack is used (one number can't be longer)
+#endif
+
+#ifndef MKWIFIDEV_ISR_SLOTS       // Number of DBG_ISR_xxx messages each core can hold until loop() outputs them (a power of 2)
+  #define MKWIFIDEV_ISR_SLOTS  (16)
+#endif
+
+#ifdef ESP32
+  #define MKWIFIDEV_CORES  (portNUM_PROCESSORS)
+#else
+  #define MKWIFIDEV_CORES  (1)
+#endif
+#if defined(ESP32) || defined(ESP8266)
+  #define MKWIFIDEV_IRAM  IRAM_ATTR       // Code which may be run by interrupt handlers
+#else
+  #define MKWIFIDEV_IRAM
+#endif
+
+#if defined(ESP32) || defined(ESP8266)
+  #define MKWIFIDEV_HEAP_MONITOR  // Heap usage & fragmentation are sampled by loop()
+#endif
+#ifndef MKWIFIDEV_HEAP_SAMPLES    // Number of heap monitor samples kept (shown by 'h' in Command Mode)
+  #ifdef ESP8266
+    #define MKWIFIDEV_HEAP_SAMPLES  (30)
+  #else
+    #define MKWIFIDEV_HEAP_SAMPLES  (60)
+  #endif
+#endif
+
+#ifndef MKWIFIDEV_CRASH_LOG       // Bytes of memory which survives a reset used to keep the last messages for the next boot
+  #define MKWIFIDEV_CRASH_LOG  (0)  // (0 disables it). eg 4096 on the ESP32 (RTC memory), up to 384 on the ESP8266
+#endif
+
+#ifndef MKWIFIDEV_RECONNECT_MIN_MS  // After the WiFi connection is lost, reconnect attempts are made straight away, then
+  #define MKWIFIDEV_RECONNECT_MIN_MS  (4000)   // this long after, doubling each time up to MKWIFIDEV_RECONNECT_MAX_MS
+#endif
+#ifndef MKWIFIDEV_RECONNECT_MAX_MS
+  #define MKWIFIDEV_RECONNECT_MAX_MS  (60000)
+#endif
+
+#ifndef MKWIFIDEV_MAX_METRICS     // Number of metrics that can be registered (see counter(), gauge() & histogram())
+  #define MKWIFIDEV_MAX_METRICS  (16)
+#endif
+
+#ifndef MKWIFIDEV_METRIC_BUCKETS  // Number of histogram buckets, shared by all histograms (each needs one more than its bounds)
+  #define MKWIFIDEV_METRIC_BUCKETS  (32)
+#endif
+
+#ifndef MKWIFIDEV_HEXDUMP_CHUNK   // Number of lines output per loop() call by DBG_HEXDUMP_CHUNKED
+  #define MKWIFIDEV_HEXDUMP_CHUNK  (16)
+#endif
+
+#ifndef MKWIFIDEV_MAX_TAGS        // Number of dbgTAG values which can have their own level (see setTagLevel())
+  #define MKWIFIDEV_MAX_TAGS  (16)
+#endif
+
+#ifndef MKWIFIDEV_MAX_CLIENTS     // Number of remote terminals that may be connected at once
+  #ifdef ESP8266
+    #define MKWIFIDEV_MAX_CLIENTS  (2)
+  #else
+    #define MKWIFIDEV_MAX_CLIENTS  (4)
+  #endif
 #endif
 
 // TOSTRING/STRINGIFY Macros from http://www.decompile.com/cpp/faq/file_and_line_error_string.htm
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
-#ifdef DEBUG_SHOW_FILE
-    #define _PRT_A1_       __FILE__ ":" TOSTRING(__LINE__) " "
+// The file name without its path, found at compile time. Its 16 bit ID (FNV-1a hash of the name, folded) is shown instead
+// with DEBUG_SHOW_FILE_ID, which tools/mkdecode.py --src turns back into the name. Either is passed as an argument rather
+// than pasted into each message, so every message in a file shares one copy of the name
+constexpr size_t mkFileNameOfs(const char *path, size_t i = 0, size_t ofs = 0) {
+  return path[i] ? mkFileNameOfs(path, i+1, (path[i] == '/' || path[i] == '\\') ? i+1 : ofs) : ofs;
+}
+constexpr uint32_t mkFnv1a(const char *s, uint32_t h = 2166136261u) {
+  return *s ? mkFnv1a(s+1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+constexpr uint16_t mkFileId(const char *name) {
+  return (mkFnv1a(name) >> 16) ^ (mkFnv1a(name) & 0xFFFF);
+}
+
+#ifdef __FILE_NAME__
+    #define _DBG_FILE      __FILE_NAME__
+#else
+    #define _DBG_FILE      (__FILE__ + std::integral_constant<size_t, mkFileNameOfs(__FILE__)>::value)
+#endif
+#define _DBG_FILE_ID       (std::integral_constant<uint16_t, mkFileId(_DBG_FILE)>::value)
+
+#if defined(DEBUG_SHOW_FILE_ID)
+    #define _PRT_A1_       "@%04x:" TOSTRING(__LINE__) " "
+    #define _PRT_A1_ARG_   , _DBG_FILE_ID
+    #define _PRT_SITE_     MkCallSite{ nullptr, _DBG_FILE_ID, __LINE__ },
+#elif defined(DEBUG_SHOW_FILE)
+    #define _PRT_A1_       "%s:" TOSTRING(__LINE__) " "
+    #define _PRT_A1_ARG_   , _DBG_FILE
+    #define _PRT_SITE_     MkCallSite{ _DBG_FILE, 0, __LINE__ },
 #else
     #define _PRT_A1_
+    #define _PRT_A1_ARG_
+    #define _PRT_SITE_
 #endif
 
 #ifdef DEBUG_SHOW_FUNCTION
     #define _PRT_B1_     "%s() : "
-#elif defined(DEBUG_SHOW_FILE)
+#elif defined(DEBUG_SHOW_FILE) || defined(DEBUG_SHOW_FILE_ID)
     #define _PRT_B1_     ": "
 #else
     #define _PRT_B1_
 #endif
 
-#define DBG_REPORT(type, msg, ...)	 WifiDev.Report(dbgTAG, type, msg, ##__VA_ARGS__)       // Never shows file/function info
+// Fails to compile if the conversions in a literal format don't match its arguments, eg "%d" given a float or uint64_t.
+// args is the parenthesised list (MkNoArg(), ...). Only string literals are checked, as a named array (eg
+// static const char fmt[]) isn't a constant expression. Defining MKWIFIDEV_NO_FORMAT_CHECK turns the check off
+#ifdef MKWIFIDEV_NO_FORMAT_CHECK
+    #define _DBG_CHECK(fmt, args)   ((void)0)
+#else
+    #define _DBG_CHECK(fmt, args)   ((void)sizeof(MkFormatCheck<(!mkIsConstFormat<decltype(fmt)>() || \
+                                      mkFormatOk(fmt, decltype(mkArgKinds args)::value))>))
+#endif
+
+#define DBG_REPORT(type, msg, ...)	 (_DBG_CHECK(msg, (MkNoArg(), ##__VA_ARGS__)), WifiDev.Report(dbgTAG, type, msg, ##__VA_ARGS__))       // Never shows file/function info
+
+// Messages below MKWIFIDEV_MIN_LEVEL are compiled out (arguments are still checked). May be changed per file by
+// redefining it before any log messages. DBG_PRINT & DBG_CPRINT messages are always kept
+#ifndef MKWIFIDEV_MIN_LEVEL
+    #define MKWIFIDEV_MIN_LEVEL  0
+#endif
+#define _DBG_LEVEL_ON(type)   ((type) == MkWifiDev::NORMAL || (type) >= (MKWIFIDEV_MIN_LEVEL))
+
+// If MKWIFIDEV_RATE_LIMIT is defined, each message call site gets a token bucket allowing bursts of up to
+// MKWIFIDEV_RATE_BURST messages, refilled at MKWIFIDEV_RATE_LIMIT per second (uses 12 bytes of RAM per call site)
+#ifdef MKWIFIDEV_RATE_LIMIT
+    #ifndef MKWIFIDEV_RATE_BURST
+        #define MKWIFIDEV_RATE_BURST  (2*MKWIFIDEV_RATE_LIMIT)
+    #endif
+    #define _DBG_RATE_STATE         static MkWifiDev::RateLimit _dbgRate;
+    #define _DBG_RATE_OK(type)      && _dbgRate.allow(type, MKWIFIDEV_RATE_LIMIT, MKWIFIDEV_RATE_BURST)
+#else
+    #define _DBG_RATE_STATE
+    #define _DBG_RATE_OK(type)
+#endif
 
 #ifdef DEBUG_SHOW_FUNCTION
-    #define DBG_MKPRINT(type, msg, ...)	     WifiDev.Report(dbgTAG, type,   _PRT_A1_ _PRT_B1_ msg, __func__, ##__VA_ARGS__)
-    #define DBG_CPRINT(color, msg, ...)	     WifiDev.Report(dbgTAG, MkWifiDev::MessageType(MkWifiDev::OVERRIDE | color),   _PRT_A1_ _PRT_B1_ msg, __func__, ##__VA_ARGS__)
+    #define _DBG_CHECK_MSG(msg, ...)         _DBG_CHECK(_PRT_A1_ _PRT_B1_ msg, (MkNoArg() _PRT_A1_ARG_, __func__, ##__VA_ARGS__))
+    #define DBG_MKPRINT(type, msg, ...)	     do { _DBG_CHECK_MSG(msg, ##__VA_ARGS__); _DBG_RATE_STATE if(_DBG_LEVEL_ON(type) _DBG_RATE_OK(type)) WifiDev.Report(dbgTAG, type,   _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, __func__, ##__VA_ARGS__); } while(0)
+    #define DBG_CPRINT(color, msg, ...)	     (_DBG_CHECK_MSG(msg, ##__VA_ARGS__), WifiDev.Report(dbgTAG, MkWifiDev::MessageType(MkWifiDev::OVERRIDE | color),   _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, __func__, ##__VA_ARGS__))
 #else
-    #define DBG_MKPRINT(type, msg, ...)	     WifiDev.Report(dbgTAG, type,   _PRT_A1_ _PRT_B1_ msg, ##__VA_ARGS__)
-    #define DBG_CPRINT(color, msg, ...)	     WifiDev.Report(dbgTAG, MkWifiDev::MessageType(MkWifiDev::OVERRIDE | color),   _PRT_A1_ _PRT_B1_ msg, ##__VA_ARGS__)
+    #define _DBG_CHECK_MSG(msg, ...)         _DBG_CHECK(_PRT_A1_ _PRT_B1_ msg, (MkNoArg() _PRT_A1_ARG_, ##__VA_ARGS__))
+    #define DBG_MKPRINT(type, msg, ...)	     do { _DBG_CHECK_MSG(msg, ##__VA_ARGS__); _DBG_RATE_STATE if(_DBG_LEVEL_ON(type) _DBG_RATE_OK(type)) WifiDev.Report(dbgTAG, type,   _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, ##__VA_ARGS__); } while(0)
+    #define DBG_CPRINT(color, msg, ...)	     (_DBG_CHECK_MSG(msg, ##__VA_ARGS__), WifiDev.Report(dbgTAG, MkWifiDev::MessageType(MkWifiDev::OVERRIDE | color),   _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, ##__VA_ARGS__))
 #endif
 
 #define DBG_PRINT(msg, ...)	     DBG_MKPRINT(MkWifiDev::NORMAL,   msg, ##__VA_ARGS__)
@@ -61,10 +236,567 @@
 #define DBG_ERROR(msg, ...)	     DBG_MKPRINT(MkWifiDev::ERROR,    msg, ##__VA_ARGS__)
 #define DBG_CRITICAL(msg, ...)   DBG_MKPRINT(MkWifiDev::CRITICAL, msg, ##__VA_ARGS__)
 
-#define DBG_HEXDUMP(msg, addr, len, ...)  WifiDev.HexDump(dbgTAG, _PRT_A1_ msg, (void*)addr, len, ##__VA_ARGS__)
+// Structured messages, a fixed message followed by key, value pairs, eg DBG_INFO_KV("sensor read", "temp", t, "rssi", rssi).
+// Text outputs show "sensor read temp=21.5 rssi=-60", JSON Lines outputs (see setJsonLines()) get each pair as a field
+#define DBG_MKPRINT_KV(type, msg, ...)  do { _DBG_RATE_STATE if(_DBG_LEVEL_ON(type) _DBG_RATE_OK(type)) \
+                                          WifiDev.ReportKV(dbgTAG, type, _DBG_FILE, __LINE__, msg, ##__VA_ARGS__); } while(0)
+
+#define DBG_PRINT_KV(msg, ...)      DBG_MKPRINT_KV(MkWifiDev::NORMAL,   msg, ##__VA_ARGS__)
+#define DBG_VERBOSE_KV(msg, ...)    DBG_MKPRINT_KV(MkWifiDev::VERBOSE,  msg, ##__VA_ARGS__)
+#define DBG_DEBUG_KV(msg, ...)      DBG_MKPRINT_KV(MkWifiDev::DEBUG,    msg, ##__VA_ARGS__)
+#define DBG_INFO_KV(msg, ...)       DBG_MKPRINT_KV(MkWifiDev::INFO,     msg, ##__VA_ARGS__)
+#define DBG_WARNING_KV(msg, ...)    DBG_MKPRINT_KV(MkWifiDev::WARNING,  msg, ##__VA_ARGS__)
+#define DBG_ALERT_KV(msg, ...)      DBG_MKPRINT_KV(MkWifiDev::ALERT,    msg, ##__VA_ARGS__)
+#define DBG_ERROR_KV(msg, ...)      DBG_MKPRINT_KV(MkWifiDev::ERROR,    msg, ##__VA_ARGS__)
+#define DBG_CRITICAL_KV(msg, ...)   DBG_MKPRINT_KV(MkWifiDev::CRITICAL, msg, ##__VA_ARGS__)
+
+// Messages from interrupt handlers (or any task), eg DBG_ISR_INFO("GPIO %d changed to %d", pin, level). Only the pointers
+// & argument values are stored, without blocking or formatting, and loop() outputs the message later. There may be up
+// to 4 arguments, which must be integers (up to 32 bits), characters or pointers, and strings must be constant
+#ifdef DEBUG_SHOW_FUNCTION
+    #define DBG_ISR_MKPRINT(type, msg, ...)  do { _DBG_CHECK_MSG(msg, ##__VA_ARGS__); if(_DBG_LEVEL_ON(type)) WifiDev.ReportIsr(dbgTAG, type, _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, __func__, ##__VA_ARGS__); } while(0)
+#else
+    #define DBG_ISR_MKPRINT(type, msg, ...)  do { _DBG_CHECK_MSG(msg, ##__VA_ARGS__); if(_DBG_LEVEL_ON(type)) WifiDev.ReportIsr(dbgTAG, type, _PRT_A1_ _PRT_B1_ msg _PRT_A1_ARG_, ##__VA_ARGS__); } while(0)
+#endif
+
+#define DBG_ISR_PRINT(msg, ...)      DBG_ISR_MKPRINT(MkWifiDev::NORMAL,   msg, ##__VA_ARGS__)
+#define DBG_ISR_VERBOSE(msg, ...)    DBG_ISR_MKPRINT(MkWifiDev::VERBOSE,  msg, ##__VA_ARGS__)
+#define DBG_ISR_DEBUG(msg, ...)      DBG_ISR_MKPRINT(MkWifiDev::DEBUG,    msg, ##__VA_ARGS__)
+#define DBG_ISR_INFO(msg, ...)       DBG_ISR_MKPRINT(MkWifiDev::INFO,     msg, ##__VA_ARGS__)
+#define DBG_ISR_WARNING(msg, ...)    DBG_ISR_MKPRINT(MkWifiDev::WARNING,  msg, ##__VA_ARGS__)
+#define DBG_ISR_ALERT(msg, ...)      DBG_ISR_MKPRINT(MkWifiDev::ALERT,    msg, ##__VA_ARGS__)
+#define DBG_ISR_ERROR(msg, ...)      DBG_ISR_MKPRINT(MkWifiDev::ERROR,    msg, ##__VA_ARGS__)
+#define DBG_ISR_CRITICAL(msg, ...)   DBG_ISR_MKPRINT(MkWifiDev::CRITICAL, msg, ##__VA_ARGS__)
+
+#define _DBG_ARG2(a, b, ...)  b
+#define DBG_HEXDUMP(msg, addr, len, ...)  do { if(_DBG_LEVEL_ON(_DBG_ARG2(0, ##__VA_ARGS__, MkWifiDev::VERBOSE))) \
+                                            WifiDev.HexDump(dbgTAG, _PRT_SITE_ msg, (void*)addr, len, ##__VA_ARGS__); } while(0)
+#define DBG_HEXDUMP_CHUNKED(msg, addr, len, ...)  do { if(_DBG_LEVEL_ON(_DBG_ARG2(0, ##__VA_ARGS__, MkWifiDev::VERBOSE))) \
+                                            WifiDev.HexDumpChunked(dbgTAG, _PRT_SITE_ msg, (void*)addr, len, ##__VA_ARGS__); } while(0)
+
+// DBG_SCOPE_TIMER("name") measures the time until the end of the enclosing scope, adding it to a histogram for that
+// call site. DBG_TIMER_REPORT() outputs a summary of all timers. Both compile to nothing unless MKWIFIDEV_TIMERS is defined
+#ifdef MKWIFIDEV_TIMERS
+    #define _DBG_CAT2(a, b)     a##b
+    #define _DBG_CAT(a, b)      _DBG_CAT2(a, b)
+    #define DBG_SCOPE_TIMER(name)   static MkTimer _DBG_CAT(_dbgTimer, __LINE__)(name); \
+                                    MkScopeTimer _DBG_CAT(_dbgScope, __LINE__)(_DBG_CAT(_dbgTimer, __LINE__))
+    #define DBG_TIMER_REPORT()      WifiDev.reportTimers()
+#else
+    #define DBG_SCOPE_TIMER(name)
+    #define DBG_TIMER_REPORT()      do { } while(0)
+#endif
 
 // Default global null debug label. Individual modules may local specify a label if desired
-static const char* dbgTAG = nullptr;
+static const char* dbgTAG __attribute__((unused)) = nullptr;
+
+// Where a DBG_HEXDUMP came from, with DEBUG_SHOW_FILE (file is set) or DEBUG_SHOW_FILE_ID
+struct MkCallSite
+{
+  const char *file;
+  uint16_t fileId;
+  uint16_t line;
+};
+
+// One key, value pair of a DBG_xxx_KV message. The value is stored with its type, so it can be written as text or JSON
+// without a format string. Strings are referenced, not copied
+struct MkField
+{
+  enum Kind : uint8_t { INT, UINT, FLOAT, DOUBLE, BOOL, STR };
+
+  const char *key;
+  Kind kind;
+  union { int64_t i; uint64_t u; double d; bool b; const char *s; };
+
+  void set(signed char v)        { kind = INT; i = v; }
+  void set(short v)              { kind = INT; i = v; }
+  void set(int v)                { kind = INT; i = v; }
+  void set(long v)               { kind = INT; i = v; }
+  void set(long long v)          { kind = INT; i = v; }
+  void set(char v)               { kind = INT; i = v; }
+  void set(unsigned char v)      { kind = UINT; u = v; }
+  void set(unsigned short v)     { kind = UINT; u = v; }
+  void set(unsigned int v)       { kind = UINT; u = v; }
+  void set(unsigned long v)      { kind = UINT; u = v; }
+  void set(unsigned long long v) { kind = UINT; u = v; }
+  void set(float v)              { kind = FLOAT; d = v; }
+  void set(double v)             { kind = DOUBLE; d = v; }
+  void set(bool v)               { kind = BOOL; b = v; }
+  void set(const char *v)        { kind = STR; s = v; }
+  void set(const String &v)      { kind = STR; s = v.c_str(); }
+};
+
+// An argument of a DBG_xxx message, captured with its type by the template Report() so the message is formatted
+// without a va_list. Strings are referenced, not copied
+struct MkArg
+{
+  enum Kind : uint8_t { INT, UINT, DOUBLE, STR, PTR };
+
+  Kind kind;
+  union { int64_t i; uint64_t u; double d; const char *s; const void *p; };
+
+  void set(const char *v)        { kind = STR; s = v; }
+  void set(char *v)              { kind = STR; s = v; }
+  void set(const String &v)      { kind = STR; s = v.c_str(); }
+  void set(std::nullptr_t)       { kind = PTR; p = nullptr; }
+  template<typename T>
+  void set(T *v)                 { kind = PTR; p = (const void*)v; }
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type set(T v)  { kind = INT; i = v; }
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type set(T v) { kind = UINT; u = v; }
+  template<typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type set(T v) { kind = DOUBLE; d = v; }
+  template<typename T>
+  typename std::enable_if<std::is_enum<T>::value>::type set(T v) { kind = INT; i = (int64_t)v; }
+};
+
+// Kind of argument a format conversion takes: 'i' int or smaller, 'q' 64 bit integer, 'f' floating point, 's' string,
+// 'p' other pointer, 'n' nullptr, '?' anything else (which only the varargs Report() takes)
+template<typename T>
+constexpr char mkArgKind() {
+  return std::is_floating_point<T>::value ? 'f'
+       : (std::is_integral<T>::value || std::is_enum<T>::value) ? ((sizeof(T) > sizeof(int)) ? 'q' : 'i')
+       : (std::is_same<T, char*>::value || std::is_same<T, const char*>::value || std::is_base_of<String, T>::value) ? 's'
+       : std::is_same<T, std::nullptr_t>::value ? 'n'
+       : std::is_pointer<T>::value ? 'p'
+       : '?';
+}
+
+template<typename... T>
+struct MkArgKinds {
+  static constexpr char value[] = { mkArgKind<typename std::decay<T>::type>()..., '\0' };
+};
+template<typename... T>
+constexpr char MkArgKinds<T...>::value[];
+
+struct MkNoArg { };
+template<typename... T>
+MkArgKinds<T...> mkArgKinds(MkNoArg, const T&...);    // Only used in decltype(), to get the kinds of the arguments
+
+constexpr bool mkArgsTyped(const char *kinds) {
+  return !*kinds || (*kinds != '?' && mkArgsTyped(kinds+1));
+}
+
+// Checks at compile time that the conversions in a format match the kinds of the arguments, for the DBG_xxx macros.
+// Written as C++11 constexpr functions, which can only recurse, so plain text is skipped 4 characters at a time
+constexpr bool mkFormatOk(const char *f, const char *k);
+
+constexpr bool mkIn(char c, const char *set) {
+  return *set && (c == *set || mkIn(c, set+1));
+}
+
+constexpr const char *mkSkip(const char *f, const char *set) {
+  return (*f && mkIn(*f, set)) ? mkSkip(f+1, set) : f;
+}
+
+constexpr char mkIntKind(size_t size) {
+  return (size > sizeof(int)) ? 'q' : 'i';
+}
+
+// f is the conversion character, intKind the kind of integer its length modifier gives
+constexpr bool mkFmtConv(const char *f, const char *k, char intKind) {
+  return mkIn(*f, "diouxXc")  ? (*k == intKind && mkFormatOk(f+1, k+1))
+       : mkIn(*f, "fFeEgGaA") ? (*k == 'f' && mkFormatOk(f+1, k+1))
+       : (*f == 's')          ? ((*k == 's' || *k == 'n') && mkFormatOk(f+1, k+1))
+       : mkIn(*f, "pn")       ? ((*k == 'p' || *k == 's' || *k == 'n') && mkFormatOk(f+1, k+1))
+       : false;
+}
+
+constexpr bool mkFmtLength(const char *f, const char *k) {
+  return (f[0] == 'h' && f[1] == 'h') ? mkFmtConv(f+2, k, 'i')
+       : (f[0] == 'l' && f[1] == 'l') ? mkFmtConv(f+2, k, 'q')
+       : mkIn(f[0], "hL")             ? mkFmtConv(f+1, k, 'i')
+       : (f[0] == 'l')                ? mkFmtConv(f+1, k, mkIntKind(sizeof(long)))
+       : (f[0] == 'j')                ? mkFmtConv(f+1, k, mkIntKind(sizeof(intmax_t)))
+       : (f[0] == 'z')                ? mkFmtConv(f+1, k, mkIntKind(sizeof(size_t)))
+       : (f[0] == 't')                ? mkFmtConv(f+1, k, mkIntKind(sizeof(ptrdiff_t)))
+       : mkFmtConv(f, k, 'i');
+}
+
+constexpr bool mkFmtPrecision(const char *f, const char *k) {
+  return (*f != '.')   ? mkFmtLength(f, k)
+       : (f[1] == '*') ? (*k == 'i' && mkFmtLength(f+2, k+1))
+       : mkFmtLength(mkSkip(f+1, "0123456789"), k);
+}
+
+constexpr bool mkFmtWidth(const char *f, const char *k) {
+  return (*f == '*') ? (*k == 'i' && mkFmtPrecision(f+1, k+1)) : mkFmtPrecision(mkSkip(f, "0123456789"), k);
+}
+
+constexpr bool mkFormatOk(const char *f, const char *k) {
+  return !f[0]                     ? !*k
+       : (f[0] == '%')             ? ((f[1] == '%') ? mkFormatOk(f+2, k) : mkFmtWidth(mkSkip(f+1, "-+ #0"), k))
+       : (!f[1] || f[1] == '%')    ? mkFormatOk(f+1, k)
+       : (!f[2] || f[2] == '%')    ? mkFormatOk(f+2, k)
+       : (!f[3] || f[3] == '%')    ? mkFormatOk(f+3, k)
+       : mkFormatOk(f+4, k);
+}
+
+// Only a string literal format can be checked. decltype() gives a literal as a reference to a const array, but a named
+// array as the array type itself, & its contents may not be usable in a constant expression
+template<typename F>
+constexpr bool mkIsConstFormat() {
+  return std::is_lvalue_reference<F>::value && std::is_array<typename std::remove_reference<F>::type>::value &&
+         std::is_const<typename std::remove_extent<typename std::remove_reference<F>::type>::type>::value;
+}
+
+class MkArgs;     // A message's arguments, either a va_list or MkArg values
+
+template<bool ok>
+struct MkFormatCheck {
+  static_assert(ok, "DBG_xxx format doesn't match the types of its arguments");
+};
+
+// Byte ring holding variable length records (used for the asynchronous log queue). Safe for one
+// producer and one consumer running concurrently (eg Report() on one core and loop() on the other)
+class MkLogRing
+{
+  public:
+    // Allocates the buffer (capacity is rounded down to a power of 2, and is at least 256 bytes), in PSRAM if
+    // requested and available. Returns false if allocation failed
+    bool begin(size_t capacity, bool usePsram = false);
+    void end();
+    bool isActive() { return buf != nullptr; }
+    bool isEmpty() { return tail.load() == head.load(); }
+
+    // Adds a record made from a header and data. If there is no room either the oldest records
+    // are discarded or the new record is dropped. Returns false if the new record was dropped
+    bool push(const void *hdr, uint16_t hdrLen, const void *data, uint16_t len, bool dropOldest);
+
+    // As push(), for a record added in parts so it needn't be built in a buffer first. The record is only seen by
+    // the consumer once commit() is called. If it won't fit the rest is ignored & commit() returns false
+    void startRecord(const void *hdr, uint16_t hdrLen, bool dropOldest);
+    void append(const void *data, size_t len);
+    bool commit();
+
+    // Removes the oldest record, returning its length or -1 if empty. Its contents are copied out by popRead() and
+    // can't be overwritten until popEnd() is called
+    int popStart();
+    void popRead(uint16_t ofs, void *out, uint16_t len);
+    void popEnd() { holding = false; }
+
+    // Returns the number of records dropped since the last call
+    uint32_t takeDropped() { return dropped.exchange(0); }
+
+    // Reading without removing records, for a ring used as a history. The caller must prevent records being
+    // added at the same time. Positions before first() have been overwritten
+    uint32_t first() { return tail.load(); }
+    uint32_t last() { return head.load(); }
+    size_t capacity() { return buf ? mask+1 : 0; }
+    size_t used() { return head.load() - tail.load(); }
+
+    // Copies up to maxLen bytes of the record at pos, starting ofs bytes in, and advances pos to the next one. Returns
+    // the record length, or -1 at the end
+    int peek(uint32_t &pos, void *out, uint16_t maxLen, uint16_t ofs = 0);
+
+  private:
+    uint8_t *buf = nullptr;
+    uint32_t mask = 0;
+    std::atomic<uint32_t> head{0};          // Free running byte positions, only producer moves head
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> holdPos{0};       // Record being read by the consumer (producer must not overwrite)
+    std::atomic<bool> holding{false};
+    std::atomic<uint32_t> dropped{0};
+    uint32_t wrPos = 0;                     // Record being added by startRecord() etc
+    uint16_t wrLen = 0;
+    bool wrOk = false;
+    bool wrDropOldest = false;
+    uint32_t rdPos = 0;                     // Data of the record being read by popRead()
+
+    bool makeRoom(uint32_t need);
+    void put(uint32_t pos, const void *src, size_t len);
+    void get(uint32_t pos, void *dst, size_t len);
+};
+
+// Streaming LZ77 compressor, used for remote terminals that ask for compressed output. Each block is compressed using
+// up to MKWIFIDEV_ZIP_WINDOW bytes of the earlier ones as a dictionary, and ends on a whole token so the receiver can
+// decode it at once. The format is byte aligned (see tools/mkzcat.py):
+//   0x00-0x7F          Literal run, the next n+1 bytes are copied
+//   1LLLLDDD DDDDDDDD  Copy L+3 bytes from D+1 bytes back. L=15 is followed by a byte giving the length-18
+class MkLzStream
+{
+  public:
+    static constexpr size_t BLOCK = MKWIFIDEV_TCP_BUFFER;      // Largest block compress() takes
+    static constexpr size_t maxOut(size_t len) { return len + (len + 127) / 128; }
+
+    // Compresses len bytes (up to BLOCK) to out, which must have room for maxOut(len). Returns the compressed length
+    size_t compress(const uint8_t *in, size_t len, uint8_t *out);
+
+  private:
+    static constexpr int HASH_BITS = 10;
+    static constexpr size_t MIN_MATCH = 3;
+    static constexpr size_t MAX_MATCH = 18 + 255;
+
+    uint8_t win[MKWIFIDEV_ZIP_WINDOW + BLOCK];      // Earlier output followed by the block being compressed
+    uint16_t head[1 << HASH_BITS];                  // Latest position (+1, 0 if none) starting with each hash
+#if MKWIFIDEV_ZIP_CHAIN > 1
+    uint16_t prev[MKWIFIDEV_ZIP_WINDOW + BLOCK];    // Previous position with the same hash as each one
+#endif
+    uint16_t pos = 0;                               // End of the data in win
+
+    static uint32_t hash(const uint8_t *p) { return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS); }
+    void insert(uint16_t at);
+    void slide();
+
+    static_assert(MKWIFIDEV_ZIP_WINDOW <= 2048, "MKWIFIDEV_ZIP_WINDOW must be 2048 or less");
+};
+
+// Ring of text lines in memory which isn't cleared by a reset, so the lines leading up to a crash can be shown after it.
+// Each line is a record with a header holding its length & a check value of the length & text. The positions are kept
+// in two copies, written alternately with a sequence number & checksum, so a reset while one is being written leaves
+// the other valid
+class MkCrashRing
+{
+  public:
+    // Uses size bytes at mem (4 byte aligned), which may hold a ring from before a reset. Returns the number of lines
+    // in it, or -1 if it isn't a valid ring & has been cleared
+    int attach(void *mem, size_t size);
+    void clear();
+
+    // Adds a line in parts. Any more than maxLine() bytes are left out. The line is only kept once commit() is called
+    void begin();
+    void append(const char *text, size_t len);
+    void commit();
+
+    // Reads the lines from oldest to newest. Copies up to maxLen bytes of the line at pos & advances pos to the next
+    // one. Returns the line length, or -1 at the end
+    uint32_t first() { return 0; }
+    int read(uint32_t &pos, char *out, size_t maxLen);
+
+    bool isActive() { return data != nullptr; }
+    size_t maxLine() { return cap / 4; }
+
+  private:
+    struct Ctrl { uint32_t magic, seq, tail, used, check; };
+    static const uint32_t MAGIC = 0x4D4B4352;       // "MKCR"
+    static const size_t HDR = 4;                    // Line length & check
+
+    Ctrl *ctrl = nullptr;       // Two copies
+    uint8_t *data = nullptr;
+    uint32_t cap = 0;
+    uint32_t seq = 0;           // Of the current copy
+    uint32_t tail = 0;          // Offset of the oldest line
+    uint32_t used = 0;          // Bytes of complete lines
+    uint32_t lineLen = 0;       // Line being added, after the complete ones
+    uint16_t lineSum = 0;       // Its text's checksum so far
+    bool adding = false;
+
+    static uint32_t checkOf(const Ctrl &c) { return ~(c.magic + c.seq * 31 + c.tail * 131 + c.used * 1031); }
+    static uint16_t lineCheck(uint16_t len, uint16_t sum) { return len ^ sum ^ 0xC3A5; }
+    static uint16_t sumOf(uint16_t sum, const uint8_t *p, size_t len);
+    uint16_t sumAt(uint32_t ofs, size_t len);
+    void publish();
+    int validate(const Ctrl &c);
+    void makeRoom(uint32_t need);
+    void put(uint32_t ofs, const void *src, size_t len);
+    void get(uint32_t ofs, void *dst, size_t len);
+};
+
+// A counter, gauge or histogram, as returned by MkWifiDev::counter() etc and served to Prometheus (see setMetricsPort()).
+// Updates are lock-free atomic operations, so they can be made from any task
+class MkMetric
+{
+  public:
+    enum Type : uint8_t { COUNTER, GAUGE, HISTOGRAM };
+
+    // Counters only go up
+    void inc(uint32_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+
+    // Gauges can be set to any value, or changed by an amount
+    void set(float v) { value.store(toBits(v), std::memory_order_relaxed); }
+    void add(float v) { addFloat(value, v); }
+
+    // Histograms count each value in the first bucket with an upper bound >= the value (or the +Inf bucket), and
+    // keep the sum of the values
+    void observe(float v) {
+      int i = 0;
+      while(i < nBounds && v > bounds[i])
+        i++;
+      buckets[i].fetch_add(1, std::memory_order_relaxed);
+      addFloat(sum, v);
+    }
+
+    const char *name = nullptr;
+    const char *help = nullptr;
+    Type type = COUNTER;
+    uint8_t nBounds = 0;
+    const float *bounds = nullptr;            // Upper bounds of the histogram buckets, ascending
+    std::atomic<uint32_t> *buckets = nullptr; // nBounds+1 counts (the last is +Inf)
+    std::atomic<uint32_t> value{0};           // Counter value or gauge (float bits)
+    std::atomic<uint32_t> sum{0};             // Histogram sum (float bits)
+
+    static uint32_t toBits(float v) { uint32_t b; memcpy(&b, &v, sizeof(b)); return b; }
+    static float fromBits(uint32_t b) { float v; memcpy(&v, &b, sizeof(v)); return v; }
+
+  private:
+    static void addFloat(std::atomic<uint32_t> &a, float v) {
+      uint32_t old = a.load(std::memory_order_relaxed);
+      while(!a.compare_exchange_weak(old, toBits(fromBits(old) + v), std::memory_order_relaxed)) { }
+    }
+};
+
+// One DBG_ISR_xxx message, formatted later by loop()
+struct MkIsrRecord
+{
+  enum { MAX_ARGS = 4 };
+
+  const char *format;
+  const char *tag;
+  uint32_t us;                  // micros() when it was logged
+  uint8_t type;
+  uintptr_t args[MAX_ARGS];
+};
+
+// Fixed number of MkIsrRecord slots which may be filled concurrently without locking (eg by an interrupt handler
+// and a higher priority one interrupting it) and emptied by one consumer. Each slot has a sequence number showing
+// whether it's free or holds a record, so a producer never waits for another
+class MkIsrRing
+{
+  public:
+    MkIsrRing();
+
+    // Adds a copy of rec. Returns false if all the slots are in use, counting it as dropped
+    bool push(const MkIsrRecord &rec);
+
+    // Returns the oldest record, or null if there are none. It stays valid until pop() is called
+    const MkIsrRecord *front();
+    void pop();
+
+    // Returns the number of records dropped since the last call
+    uint32_t takeDropped() { return dropped.exchange(0); }
+    void countDropped() { dropped++; }
+
+  private:
+    struct {
+      std::atomic<uint32_t> seq;    // Position it can be filled at, or that position + 1 once filled
+      MkIsrRecord rec;
+    } slots[MKWIFIDEV_ISR_SLOTS];
+    std::atomic<uint32_t> head{0};  // Free running positions, producers claim slots by moving head
+    uint32_t tail = 0;
+    std::atomic<uint32_t> dropped{0};
+};
+
+// Core the caller is running on
+inline uint32_t mkCoreId() {
+#ifdef ESP32
+  return xPortGetCoreID();
+#else
+  return 0;
+#endif
+}
+
+// CPU cycle counter (or microseconds if there isn't one), used for profiling
+inline uint32_t mkCycleCount() {
+#if defined(ESP32) || defined(ESP8266)
+  return ESP.getCycleCount();
+#else
+  return micros();
+#endif
+}
+
+#ifdef MKWIFIDEV_TIMERS
+// Histogram of durations in CPU cycles, for DBG_SCOPE_TIMER. Buckets are log-linear (exact below 8, then 4 per power
+// of 2) so percentiles are within 12.5%, with no allocation. Each timer adds itself to a list when first used
+class MkTimer
+{
+  public:
+    MkTimer(const char *name) : name(name), next(first()) { first() = this; }
+
+    void record(uint32_t cycles) {
+      count++;
+      if(cycles < minCycles) minCycles = cycles;
+      if(cycles > maxCycles) maxCycles = cycles;
+      buckets[bucketIndex(cycles)]++;
+    }
+
+    // Returns an estimate of the given percentile (in cycles)
+    uint32_t percentile(uint8_t pct);
+    void reset();
+
+    static uint8_t bucketIndex(uint32_t v) {
+      if(v < 8)
+        return v;
+      int m = 31 - __builtin_clz(v);      // Position of the top bit
+      return (m-1)*4 + ((v >> (m-2)) & 3);
+    }
+
+    static MkTimer *&first() { static MkTimer *head = nullptr; return head; }
+
+    const char *name;
+    MkTimer *next;
+    uint32_t count = 0;
+    uint32_t minCycles = UINT32_MAX;
+    uint32_t maxCycles = 0;
+    uint32_t buckets[124] = {};
+};
+
+class MkScopeTimer
+{
+  public:
+    MkScopeTimer(MkTimer &t) : timer(t), start(mkCycleCount()) {}
+    ~MkScopeTimer() { timer.record(mkCycleCount() - start); }
+
+  private:
+    MkTimer &timer;
+    uint32_t start;
+};
+#endif
+
+// WiFi connection state, changed by the WiFi library's got IP & disconnected events, with reconnect attempts spaced
+// out by exponential backoff. It doesn't use the WiFi library itself (loop() does what poll() returns), so it can be
+// tested with a simulated WiFi stack. event() may be called from any task, the rest only from loop()
+class MkWifiLink
+{
+  public:
+    enum State : uint8_t { IDLE, CONNECTING, CONNECTED, RECONNECTING };
+    enum Action : uint8_t { NONE, UP, DOWN, RETRY };
+
+    MkWifiLink(uint32_t minWait = MKWIFIDEV_RECONNECT_MIN_MS, uint32_t maxWait = MKWIFIDEV_RECONNECT_MAX_MS)
+      : minWait(minWait), maxWait(maxWait) {}
+
+    void begin(uint32_t now);       // WiFi.begin() has been called, which is the first attempt
+    void event(bool up) {
+      linkUp.store(up, std::memory_order_relaxed);
+      events.fetch_or(up ? GOT_IP : LOST, std::memory_order_release);
+    }
+
+    // True if poll() has nothing to do, ie connected (or not started) with no new event. The only check made by
+    // loop() while the connection is up
+    bool isQuiet() const {
+      return (state == CONNECTED || state == IDLE) && !events.load(std::memory_order_relaxed);
+    }
+
+    // Returns UP when connected, DOWN when the connection is lost or RETRY when a reconnect attempt should be made
+    Action poll(uint32_t now);
+
+    State getState() const { return state; }
+    bool isConnected() const { return state == CONNECTED; }
+    uint32_t getAttempt() const { return attempt; }           // Attempts since the connection was lost
+    uint32_t getRetryIn(uint32_t now) const { return ((int32_t)(tNext - now) > 0) ? tNext - now : 0; }
+    uint32_t getDownFor(uint32_t now) const { return now - tDown; }
+
+    // Statistics
+    uint32_t connects = 0;          // Times connected, including the first
+    uint32_t reconnects = 0;
+    uint32_t attempts = 0;          // Reconnect attempts made by poll()
+    uint32_t firstMs = 0;           // Time taken to connect after begin()
+    uint32_t lastMs = 0;            // Time taken by the last reconnect (from losing the connection)
+    uint32_t maxMs = 0;
+    uint32_t totalMs = 0;           // Of all reconnects, for the average
+
+  private:
+    enum { GOT_IP = 1, LOST = 2 };
+
+    std::atomic<uint8_t> events{0}; // Events since the last poll()
+    std::atomic<bool> linkUp{false}; // State given by the latest event
+    State state = IDLE;
+    uint32_t minWait, maxWait;
+    uint32_t backoff = 0;           // Wait before the attempt after the next
+    uint32_t tNext = 0;             // Time of the next attempt
+    uint32_t tDown = 0;             // Time the connection was lost (or begin() called)
+    uint32_t attempt = 0;
+};
 
 // Singleton class implementation based on posting at
 //   https://forum.arduino.cc/t/how-to-write-an-arduino-library-with-a-singleton-object/666625/2   
@@ -78,18 +810,221 @@ class MkWifiDev : public Stream
     bool bCommandMode = false;
     uint8_t nNtpRetries = 0;
     uint8_t enableFlags = 0xFF;
-    Stream *logFile = nullptr;
     Stream *pSerial = &Serial;
     Stream *pCommand = &Serial;
     uint8_t termConnected = 0;
+    MkLogRing logQueue;
+    bool bDropOldest = false;
+    bool bQueueing = false;     // The message being emitted is going to logQueue
+    bool bBinaryLog = false;
+    uint8_t jsonOutputs = 0;    // Outputs which are sent JSON Lines instead of text
+    MkLogRing backlog;          // Recent output, sent to remote terminals when they connect
+    MkIsrRing isrRings[MKWIFIDEV_CORES];    // DBG_ISR_xxx messages from each core
+    uint32_t msgAgeUs = 0;      // Set while outputting a DBG_ISR_xxx message, which is timestamped when it was logged
+    uint32_t lineCount = 0;     // Sequence number of the last message added to the backlog
+
+    struct {                    // Message being written to the outputs in parts (see outputBegin())
+      uint8_t type;
+      uint8_t outputs;
+      bool text;                // Lines are ended with CR LF, binary records aren't
+    } outMsg;
+
+    // Log file output. It is collected in buff and written in whole blocks aligned with the file's sectors, rather
+    // than flushing every line (which forces a read-modify-write of the sector each time)
+    struct {
+      Stream *stream = nullptr;
+#ifdef MKWIFIDEV_HAS_FS
+      fs::FS *fs = nullptr;     // Set if the library opened the file, which allows it to be rotated
+      File file;
+      char path[32];
+      uint32_t maxSize = 0;     // Rotate when the file reaches this size (0 for never)
+      uint8_t maxFiles = 0;     // Number of old files kept (path.0 is the newest)
+#endif
+      uint32_t size = 0;        // Bytes written to the file, used to keep writes aligned
+      char *buff = nullptr;
+      uint16_t len = 0;
+      uint32_t tFirst = 0;      // Time the oldest unwritten byte was added
+      uint16_t flushMs = 1000;
+    } logFile;
+
+    // Tags given a level (by setTagLevel() or in Command Mode). Messages are looked up by tag pointer in tagCache (an
+    // open addressed hash table), so the names only need comparing the first time each pointer is seen
+    struct {
+      char name[24];
+      uint8_t level;            // Messages below this type are muted (0 shows all)
+    } tags[MKWIFIDEV_MAX_TAGS];
+    uint8_t nTags = 0;
+    struct {
+      const char *ptr;
+      uint8_t idx;              // Index in tags[], or 0xFF if the tag has no level
+    } tagCache[2*MKWIFIDEV_MAX_TAGS] = {};
+
+    // Other tags seen in messages, so they can be selected in Command Mode. The oldest is dropped when it's full
+    const char *seenTags[MKWIFIDEV_MAX_TAGS] = {};
+    uint8_t nSeen = 0;
+    uint8_t tagSel = 0;         // Tag selected in Command Mode (tags[] followed by seenTags[])
+
+    struct {                    // Consecutive duplicate messages are counted instead of being output
+      uint16_t timeoutMs = 0;   // 0 if disabled
+      uint32_t hash = 0;        // Identifies the last message (format, tag, type & argument values)
+      const char *tag;
+      uint8_t type;
+      uint32_t count = 0;       // Repeats not yet reported
+      uint32_t tReport;         // Time of the last message or report of repeats
+      uint32_t total = 0;
+    } repeats;
+    uint32_t rateLimited = 0;   // Messages dropped by call site rate limits
+    uint32_t queueDropped = 0;  // Totals of messages dropped when the log queue or DBG_ISR_xxx buffers were full
+    uint32_t isrDropped = 0;
 
+    MkMetric metrics[MKWIFIDEV_MAX_METRICS];  // Registered metrics, the first nMetrics are in use
+    std::atomic<uint8_t> nMetrics{0};
+    std::atomic<uint32_t> metricBuckets[MKWIFIDEV_METRIC_BUCKETS];   // Histogram bucket counts
+    uint8_t nMetricBuckets = 0;
+
+#ifdef MKWIFIDEV_PROFILE_LOOP
+    // Time spent in each part of loop() (PROF_LOOP is the whole call) & writing to each output, in CPU cycles
+    enum { PROF_LOOP, PROF_WIFI, PROF_OTA, PROF_MEMORY, PROF_LOGS, PROF_NTP, PROF_TERMINALS, PROF_METRICS, PROF_SYSLOG,
+           PROF_COMMAND, PROF_SERIAL, PROF_TCP, PROF_FILE, PROF_UDP, PROF_COUNT };
+    struct {
+      uint64_t total[PROF_COUNT];
+      uint32_t worst[PROF_COUNT];
+      uint32_t count[PROF_COUNT];
+      uint32_t tStart = 0;      // millis() when the totals were reset
+      uint16_t reportSecs = 0;  // Interval for the summary message, 0 for none
+    } profile;
+#endif
+
+#ifdef MKWIFIDEV_HEAP_MONITOR
+    struct HeapSample {
+      uint32_t free;            // Free internal heap
+      uint32_t largest;         // Largest free block
+      uint32_t psram;           // Free PSRAM, 0 if there's none
+      uint16_t blocks;          // Allocated blocks (ESP32 only)
+      uint16_t dtMs;            // Time since the previous sample
+    };
+    struct {                    // Recent samples of the heap, in a ring
+      HeapSample samples[MKWIFIDEV_HEAP_SAMPLES];
+      uint16_t count = 0;       // Samples held
+      uint16_t next = 0;        // Where the next sample goes
+      uint16_t intervalMs = 1000;   // 0 if sampling is off
+      uint32_t tLast = 0;
+      uint32_t sampleCycles = 0;    // Time taken by the last sample
+      uint32_t minFree = 0;     // Alert thresholds, 0 if not set
+      uint32_t minBlock = 0;
+      uint8_t maxFrag = 0;
+      uint8_t alerted = 0;      // Thresholds crossed (a bit each), so each alert is made once until it recovers
+    } heapMon;
+#endif
+
+#if MKWIFIDEV_CRASH_LOG
+    MkCrashRing crashRing;
+    struct {
+      bool started = false;     // crashRing has been attached
+      bool recording = false;   // Message being written is added to crashRing
+      bool replaying = false;
+      bool shown = false;       // prev has been sent to the local outputs
+      char *prev = nullptr;     // Lines from before the reset (each a 2 byte length & the text), replayed by loop()
+      uint16_t prevLen = 0;
+      uint16_t prevLines = 0;
+    } crashLog;
+#endif
+
+    struct {                    // Hex dump in progress
+      const uint8_t *start;
+      const uint8_t *ptr = nullptr;   // Next line to output, null if none in progress
+      const uint8_t *end;
+      uint8_t type;
+      bool starred;             // Repeated lines are being skipped
+    } hexDump;
+
+    struct {                    // Timestamp text is only rebuilt when the second or display mode changes
+      bool valid = false;
+      time_t sec;
+      uint8_t mode;
+      uint8_t len;
+      uint8_t msPos;            // Position of the millisecond digits, which are patched for each message
+      char text[32];            // eg "2023/03/02 14:04:30.123 : "
+    } tsCache;
 
 #ifndef LOCAL_SERIAL_ONLY
     WiFiServer *pserver = NULL;
-    WiFiClient serverClient;
+
+    // Remote terminal which asked for compressed output. Its output is compressed from buff into out once the previous
+    // block has been sent, so buff fills up (& lines are dropped) if the connection can't keep up, as for others
+    struct TermZip {
+      MkLzStream lz;
+      uint8_t out[MkLzStream::maxOut(MKWIFIDEV_TCP_BUFFER)];
+      uint16_t len = 0;
+      uint16_t sent = 0;
+    };
+
+    // Remote terminal connection. Output is collected in buff so it can be sent in as few TCP segments as possible.
+    // It is sent without blocking, so a client that can't keep up has lines dropped instead of delaying everyone
+    struct TermClient {
+      WiFiClient client;
+      enum { FREE, WELCOME, REPLAY, ACTIVE } state = FREE;
+      char buff[MKWIFIDEV_TCP_BUFFER];
+      uint16_t len = 0;
+      uint32_t tFirst = 0;        // Time the oldest unsent byte was added
+      uint32_t tConnect = 0;
+      uint32_t replayPos = 0;     // Backlog position & sequence number of the next message to replay
+      uint32_t replaySeq = 0;
+      uint32_t dropped = 0;       // Lines dropped since the client was last notified
+      enum { NO_LINE, ADDING, DROPPED, CUT } line = NO_LINE;    // State of the line being added in parts
+      int32_t lineStart = -1;     // Position of that line in buff, -1 once some of it has been sent
+      uint32_t droppedTotal = 0;  // Statistics for this connection
+      uint32_t segments = 0;
+      uint32_t bytesSent = 0;
+      TermZip *zip = nullptr;     // Set if the terminal asked for compressed output
+    } terms[MKWIFIDEV_MAX_CLIENTS];
+    int8_t ctrlClient = -1;       // Client with control (input & Command Mode), or -1 if the serial port has it
+    uint32_t tcpSegments = 0;     // Totals for all clients
+    uint32_t tcpBytes = 0;
+    uint32_t tcpDropped = 0;
+    uint32_t zipIn = 0;           // Totals for compressed terminals, before & after compression
+    uint32_t zipOut = 0;
+    uint64_t zipCycles = 0;       // Time spent compressing
+    uint16_t tcpFlushMs = 5;
+
+    // Syslog output. Messages are collected in buff & sent as a datagram when it fills or flushMs after the first
+    struct {
+      WiFiUDP udp;
+      char host[64];
+      IPAddress ip;
+      bool resolved = false;    // Set once host has been looked up
+      uint32_t tResolve = 0;
+      uint16_t port = 514;
+      uint8_t facility = 16;
+      uint16_t flushMs = 100;
+      char *buff = nullptr;
+      uint16_t len = 0;
+      uint16_t pending = 0;     // Messages in buff
+      int16_t msgStart = -1;    // Position of the message being added in parts, -1 if none
+      uint32_t tFirst = 0;
+      uint32_t datagrams = 0;   // Statistics
+      uint32_t sent = 0;
+      uint32_t dropped = 0;
+    } syslog;
+    struct {                    // Prometheus metrics endpoint, handling one request at a time
+      WiFiServer *server = nullptr;
+      uint16_t port = 0;
+      WiFiClient client;        // Connection whose request is being read
+      uint32_t tAccept = 0;
+      char request[24];         // Start of the request line, eg "GET /metrics HTTP/1.1"
+      uint8_t len = 0;
+    } metricsHttp;
+    struct {                    // Time spent in loop(), for the metrics
+      uint64_t cycles = 0;
+      uint32_t calls = 0;
+      uint32_t maxCycles = 0;   // Longest call since the last scrape
+    } loopStats;
     const char* mdns_devname = NULL;
-    enum t_conn_state { idle, connecting, connected };
-    t_conn_state conn_state;
+    MkWifiLink wifiLink;
+#ifdef ESP8266
+    WiFiEventHandler wifiGotIp;     // Event handlers are only kept while these are
+    WiFiEventHandler wifiLost;
+#endif
 #endif
 
   public:
@@ -104,7 +1039,20 @@ class MkWifiDev : public Stream
 
     enum MessageType { NORMAL, VERBOSE, DEBUG, INFO, WARNING, ALERT, ERROR, CRITICAL, RAW_NO_TS, OVERRIDE = 128 }; 
 
-    enum DisplayFlags { SHOW_TIMESTAMPS = 1, SHOW_MILLISECONDS = 2, SHOW_DATE = 4, SHOW_COLOUR = 8, SHOW_TYPE = 16, WIDE_HEXDUMP = 0x80 };
+    enum QueuePolicy { DROP_NEWEST, DROP_OLDEST };
+
+    // Per call site rate limit state (see MKWIFIDEV_RATE_LIMIT)
+    struct RateLimit {
+      uint16_t tokens = 0;
+      uint32_t tLast = 0;       // Time tokens were last added
+      uint32_t dropped = 0;     // Messages dropped since the last one allowed
+      bool allow(MessageType type, uint16_t rate, uint16_t burst);
+    };
+
+    // Message outputs. Any of the console outputs (which also show Command Mode) may be set to JSON Lines
+    enum Outputs { SERIAL_OUTPUT = 1, TERMINAL_OUTPUT = 2, FILE_OUTPUT = 4, CONSOLE_OUTPUTS = 7, SYSLOG_OUTPUT = 8, ALL_OUTPUTS = 15 };
+
+    enum DisplayFlags { SHOW_TIMESTAMPS = 1, SHOW_MILLISECONDS = 2, SHOW_DATE = 4, SHOW_COLOUR = 8, SHOW_TYPE = 16, HEXDUMP_ASCII = 0x40, WIDE_HEXDUMP = 0x80 };
     
     // Must be called to enable Command Mode, OTA updates and memory usage monitoring. Returns true if OTA update in progress
     bool loop();    
@@ -115,12 +1063,85 @@ class MkWifiDev : public Stream
     // If a file (or other stream) is specified, all serial/terminal output will copied there as well
     void setLogFile(Stream &f);
 
-    // Outputs a message as used by the DBG_xxx macros. dbgTAG is ignored if null, type specifies the level (warning/debug etc)
+#ifdef MKWIFIDEV_HAS_FS
+    // Opens (appends to) a log file. When it reaches maxSize bytes it is renamed to path.0 (path.0 to path.1 etc)
+    // and a new file started, keeping up to maxFiles old files. Returns false if the file could not be opened
+    bool setLogFile(fs::FS &fs, const char *path, uint32_t maxSize = 0, uint8_t maxFiles = 3);
+#endif
+
+    // Writes out any buffered output and stops logging to file (closing it if opened by setLogFile() above)
+    void closeLogFile();
+
+    // Buffered file output is written at least this often. ERROR & CRITICAL messages are always written immediately
+    void setLogFileFlushDelay(uint16_t ms);
+
+    // Only show messages from the given dbgTAG of this type or higher (NORMAL shows all). DBG_PRINT & DBG_CPRINT messages are
+    // always shown. Levels may also be changed in Command Mode. Returns false if MKWIFIDEV_MAX_TAGS tags are already in use
+    bool setTagLevel(const char *tag, MessageType level);
+    MessageType getTagLevel(const char *tag);
+
+    // Collapse consecutive identical messages into a "Last message repeated N times" report, made when a different
+    // message is logged or every timeoutMs while they continue. 0 disables this (the default)
+    void setRepeatSuppression(uint16_t timeoutMs);
+
+#ifdef MKWIFIDEV_TIMERS
+    // Outputs the count, minimum, median, 99th percentile & maximum time for each DBG_SCOPE_TIMER, optionally resetting them
+    void reportTimers(bool reset = false);
+#endif
+
+#ifdef MKWIFIDEV_PROFILE_LOOP
+    // Outputs a summary of the time taken by loop() & the outputs every 'seconds' (0 to stop), then resets the totals
+    void setLoopProfileReport(uint16_t seconds);
+
+    void resetLoopProfile();
+#endif
+
+    // Outputs a message as used by the DBG_xxx macros. dbgTAG is ignored if null, type specifies the level (warning/debug etc).
+    // May be called from any task, but not from interrupt handlers (see ReportIsr())
     void Report(const char* dbgTAG, MessageType type, const char *format,...);
 
+    // As above, for arguments of types MkArg can hold (ie most calls). Each is captured with its type rather than as
+    // varargs, so the message is formatted without a va_list & without vsnprintf() for the usual conversions
+    template<typename... Args>
+    typename std::enable_if<(sizeof...(Args) > 0) && mkArgsTyped(MkArgKinds<Args...>::value)>::type
+    Report(const char* dbgTAG, MessageType type, const char *format, const Args&... args) {
+      MkArg typed[sizeof...(args)];
+      setArgs(typed, args...);
+      reportTyped(dbgTAG, type, format, typed, sizeof...(args));
+    }
+
+    // Stores a message for loop() to output, as used by the DBG_ISR_xxx macros. It's safe in interrupt handlers as it
+    // doesn't block or format anything, only copying the pointers & argument values to a buffer for this core
+    template<typename... Args>
+    inline __attribute__((always_inline)) void ReportIsr(const char* dbgTAG, MessageType type, const char *format, Args... args) {
+      static_assert(sizeof...(args) <= MkIsrRecord::MAX_ARGS, "DBG_ISR_xxx messages can have up to 4 arguments");
+      if(type < 16 && !(enableFlags & (1 << type)))
+        return;
+      MkIsrRecord rec = { format, dbgTAG, (uint32_t)micros(), (uint8_t)type, { isrArg(args)... } };
+      isrPush(rec);
+    }
+
+    // Outputs a message made from msg and key, value pairs as used by the DBG_xxx_KV macros. The source file & line
+    // are included in JSON Lines output. Nothing is allocated
+    template<typename... Args>
+    void ReportKV(const char* dbgTAG, MessageType type, const char *file, int line, const char *msg, const Args&... args) {
+      static_assert(sizeof...(args) % 2 == 0, "DBG_xxx_KV fields must be given as key, value pairs");
+      MkField fields[sizeof...(args)/2 + 1];
+      setFields(fields, args...);
+      reportFields(dbgTAG, type, file, line, msg, fields, sizeof...(args)/2);
+    }
+
     // Outputs an area of memory with a leading message
     void HexDump(const char* dbgTAG, const char *message, void* addr, int len, MessageType type = VERBOSE);
 
+    // As above, but a large area is output a few lines at a time by loop(). The memory must remain valid until it's done
+    void HexDumpChunked(const char* dbgTAG, const char *message, void* addr, int len, MessageType type = VERBOSE);
+
+    // As above, with the file & line shown before the message
+    void HexDump(const char* dbgTAG, const MkCallSite &site, const char *message, void* addr, int len, MessageType type = VERBOSE);
+    void HexDumpChunked(const char* dbgTAG, const MkCallSite &site, const char *message, void* addr, int len,
+      MessageType type = VERBOSE);
+
     // Indicates if any control characters are available to be read (from either Serial port or TCP socket if connected)
     int available();
 
@@ -130,6 +1151,57 @@ class MkWifiDev : public Stream
     // Reads the next byte from Serial port (or TCP socket) without removing it
     int peek();
 
+    // Queue messages in a buffer of 'capacity' bytes and write them out from loop(), so logging doesn't wait for
+    // the outputs. The policy selects which messages are lost if the queue fills. A capacity of 0 disables queueing
+    bool setAsyncLogging(size_t capacity, QueuePolicy policy = DROP_NEWEST);
+
+    // Writes out all queued messages immediately (eg before a restart or OTA update)
+    void flushLogs();
+
+    // Returns the metric with this name, registering it the first time. Names should follow the Prometheus conventions
+    // (eg "sensor_reads_total" or "temperature_celsius") & help is an optional description, both are kept so must remain
+    // valid (eg string literals). Keep the reference rather than looking it up for each update. If there's no room left
+    // (see MKWIFIDEV_MAX_METRICS & MKWIFIDEV_METRIC_BUCKETS) an error is logged & a metric which isn't served is returned
+    MkMetric &counter(const char *name, const char *help = nullptr);
+    MkMetric &gauge(const char *name, const char *help = nullptr);
+
+    // bounds are the upper bounds of the buckets in ascending order, eg { 0.01, 0.1, 1 }, and must remain valid
+    MkMetric &histogram(const char *name, const float *bounds, uint8_t nBounds, const char *help = nullptr);
+    template<size_t N>
+    MkMetric &histogram(const char *name, const float (&bounds)[N], const char *help = nullptr) {
+      return histogram(name, bounds, N, help);
+    }
+
+#ifdef MKWIFIDEV_HEAP_MONITOR
+    // Samples the free heap, largest free block, allocated blocks & free PSRAM every intervalMs (0 stops sampling). The
+    // last MKWIFIDEV_HEAP_SAMPLES are shown by pressing 'h' in Command Mode. The default interval is 1 second
+    void setHeapMonitor(uint16_t intervalMs);
+
+    // Logs a warning when a sample shows the free heap or largest free block below these sizes, or fragmentation (the
+    // percentage of free heap not in the largest block) above maxFragPct, and again when it recovers. 0 disables each
+    void setHeapAlerts(uint32_t minFree, uint32_t minBlock = 0, uint8_t maxFragPct = 0);
+#endif
+
+#if MKWIFIDEV_CRASH_LOG
+    // Copies the crash log to RTC user memory on the ESP8266, which is done by the library's custom_crash_callback()
+    // unless MKWIFIDEV_OWN_CRASH_CALLBACK is defined (call this from yours). Nothing is needed on the ESP32
+    void saveCrashLog();
+
+    // Number of lines kept from before the last reset
+    uint16_t getCrashLogLines() { return crashLog.prevLines; }
+#endif
+
+    // Keep the most recent 'capacity' bytes of log output (in PSRAM if available) and send it to each remote terminal
+    // when it connects, so messages from before it connected (eg during startup) aren't missed. 0 disables the backlog
+    bool setBacklog(size_t capacity);
+
+    // Send compact binary records instead of formatted text (decode them with tools/mkdecode.py and the firmware .elf file)
+    void setBinaryLogging(bool enable);
+
+    // Send messages to the given outputs (eg SERIAL_OUTPUT | FILE_OUTPUT) as JSON Lines for a log collector, one object
+    // per message holding ts, level, tag, src (file:line of DBG_xxx_KV messages), msg & any fields. The others stay as text
+    void setJsonLines(uint8_t outputs);
+
     // Set display mode flags
     void setDisplayModeFlags(uint8_t flags);
 
@@ -148,16 +1220,155 @@ class MkWifiDev : public Stream
 
     // Check whether an OTA update is currently in progress
     bool isOtaBusy();
+
+    // Remote terminal output is sent once a full TCP segment is ready, or this many ms after it was generated
+    void setTcpFlushDelay(uint16_t ms);
+
+    // Gets the number of TCP writes & the total bytes sent to remote terminals
+    void getTcpStats(uint32_t &segments, uint32_t &bytes);
+
+    // Send log messages to a syslog server (RFC 5424 format over UDP) as well as the other outputs. host may be a name
+    // or IP address, null stops. Messages are dropped (and counted) while WiFi isn't connected. Returns false if the
+    // buffer couldn't be allocated
+    bool setSyslog(const char *host, uint16_t port = 514, uint8_t facility = 16);
+
+    // Messages are combined (one per line) into datagrams of up to MKWIFIDEV_UDP_BUFFER bytes, sent when full or this many
+    // ms after the first message. 0 sends each message in its own datagram, as expected by most syslog servers
+    void setSyslogFlushDelay(uint16_t ms);
+
+    // Gets the number of datagrams & messages sent to the syslog server, and the number of messages dropped
+    void getSyslogStats(uint32_t &datagrams, uint32_t &sent, uint32_t &dropped);
+
+    // Serves the registered metrics, and built-in ones (heap, RSSI, uptime, dropped messages & loop() time), in
+    // Prometheus text format at http://<device>:<port>/metrics. 0 stops serving them
+    void setMetricsPort(uint16_t port = 9100);
 #endif
 
   private:
     void checkMemUsage();
+#ifdef MKWIFIDEV_HEAP_MONITOR
+    void sampleHeap();
+    void checkHeapAlert(uint8_t bit, bool low, const char *what, uint32_t value, uint32_t limit);
+    void showHeapMonitor(char *line);
+#endif
+#if MKWIFIDEV_CRASH_LOG
+    void crashLogStart();
+    void crashLogReplay(uint8_t outputs, int8_t client = -1);
+#endif
     void connect_loop();
+    void command_loop();
+#ifndef LOCAL_SERIAL_ONLY
+    void wifiUp();
+    void startOta();
+    void terminal_loop();
+    void termWrite(const char *data, size_t len, bool crlf = false);
+    void termFlush();
+    bool clientWrite(TermClient &c, const char *data, size_t len, bool crlf);
+    void clientBeginLine(TermClient &c);
+    void clientPart(TermClient &c, const char *data, size_t len);
+    void clientEndLine(TermClient &c, bool crlf);
+    void clientAppend(TermClient &c, const char *data, size_t len);
+    void clientFlush(TermClient &c);
+    void zipFlush(TermClient &c);
+    int clientSend(TermClient &c, const void *data, size_t len);
+    void zipStart(TermClient &c);
+    void clientReplay(TermClient &c);
+    void showNetworkStats(char *line);
+    void syslogWrite(const char *data, size_t len);
+    void syslogBegin();
+    void syslogPart(const char *data, size_t len);
+    void syslogEnd();
+    void syslogFlush();
+    void syslog_loop();
+    void startMetricsServer();
+    void metrics_loop();
+    void writeMetrics(WiFiClient &client);
+    void reportSyslog(const char* dbgTAG, MessageType type, const char *file, int line, const char *format, const MkArgs *args,
+                      const MkField *fields, int nFields);
+#endif
     void print(const char *buff);
-    void println(const char *buff);
+    void println(const char *buff, uint8_t outputs = CONSOLE_OUTPUTS);
+    void fileWrite(const char *data, size_t len);
+    void fileFlush();
+    void fileEndMessage(MessageType type);
+#ifdef MKWIFIDEV_HAS_FS
+    void rotateLogFile();
+#endif
+    void outputBegin(MessageType type, uint8_t outputs, bool text);
+    void outputPart(const char *data, size_t len);
+    void outputEnd();
+    void emitBegin(MessageType type, uint8_t outputs, bool text);
+    void emitPart(const char *data, size_t len);
+    void emitEnd();
+    void emitLine(const char *buff, MessageType type, uint8_t outputs);
+    void emitRecord(const uint8_t *rec, size_t len, MessageType type, uint8_t outputs);
+    void drainLogs(uint32_t budgetMs);
+    void isrPush(const MkIsrRecord &rec);
+    void drainIsrLogs();
+    void messageTime(struct timeval &tv);
     void printFullLine(char *line);
     void printWithEnd(char *line);
+    int formatTimestamp(char *buff, MessageType type);
+    void lockReport();
+    void unlockReport();
+    void reportText(const char* dbgTAG, MessageType type, const char *format, ...);
+    void reportLocked(const char* dbgTAG, MessageType type, const char *format, ...);
+    void reportTyped(const char* dbgTAG, MessageType type, const char *format, const MkArg *args, int nArgs);
+    bool isRepeat(const char* dbgTAG, MessageType type, const char *format, const MkArgs &args);
+    void reportRepeats();
+    void showSuppressionStats(char *line);
+#ifdef MKWIFIDEV_TIMERS
+    void showTimers(char *line);
+#endif
+#ifdef MKWIFIDEV_PROFILE_LOOP
+    uint32_t profileAdd(int item, uint32_t tStart);
+    void reportLoopProfile();
+    void showLoopProfile(char *line);
+#endif
+    void vReport(const char* dbgTAG, MessageType type, const char *format, va_list args, bool binary = false);
+    void reportArgs(const char* dbgTAG, MessageType type, const char *format, const MkArgs &args, bool binary);
+    void reportFormatted(const char* dbgTAG, MessageType type, const char *format, const MkArgs &args, uint8_t outputs);
+    void reportBinary(const char* dbgTAG, MessageType type, const char *format, const MkArgs &args, uint8_t outputs);
+    void reportJson(const char* dbgTAG, MessageType type, const char *file, int line, const char *format, const MkArgs *args,
+                    const MkField *fields, int nFields, uint8_t outputs);
+    void reportFields(const char* dbgTAG, MessageType type, const char *file, int line, const char *msg,
+                      const MkField *fields, int nFields);
+    uint8_t activeOutputs();
+    struct LineWriter;
+    void addPrefix(LineWriter &w, const char* dbgTAG, MessageType type);
+    void endTextLine(LineWriter &w, MessageType type);
+
+    template<typename T>
+    static inline __attribute__((always_inline)) uintptr_t isrArg(T value) {
+      static_assert(((std::is_integral<T>::value || std::is_enum<T>::value) && sizeof(T) <= 4) || std::is_pointer<T>::value,
+                    "DBG_ISR_xxx arguments must be integers of up to 32 bits, characters or pointers");
+      return (uintptr_t)value;
+    }
+
+    static void setArgs(MkArg *) {}
+    template<typename V, typename... Rest>
+    static void setArgs(MkArg *a, const V &value, const Rest&... rest) {
+      a->set(value);
+      setArgs(a+1, rest...);
+    }
+
+    static void setFields(MkField *) {}
+    template<typename V, typename... Rest>
+    static void setFields(MkField *f, const char *key, const V &value, const Rest&... rest) {
+      f->key = key;
+      f->set(value);
+      setFields(f+1, rest...);
+    }
+    void lockedHexDump(const char* dbgTAG, const MkCallSite *site, const char *message, void* addr, int len,
+                       MessageType type, int maxLines);
+    bool beginHexDump(const char* dbgTAG, const MkCallSite *site, const char *message, void* addr, int len, MessageType type);
+    bool hexDumpLines(int maxLines);
     bool IsMessageMuted(MessageType type);
+    bool IsTagMuted(const char *tag, MessageType type);
+    int findTag(const char *name, bool add);
+    void addSeenTag(const char *name);
+    void removeSeenTag(const char *name);
+    MkMetric &addMetric(const char *name, const char *help, MkMetric::Type type, const float *bounds, uint8_t nBounds);
     uint8_t toggleTypeEnableFlag(uint8_t flagIndex);
 
 }; 
@@ -0,0 +1,22 @@
+/* bench_main.cpp - Runs the examples/benchmark sketch on the host. Its results (one JSON line each) go to stdout,
+   so they can be piped to tools/benchreport.py, eg
+
+     ./benchmark | python3 ../../tools/benchreport.py - --baseline host-baseline.jsonl
+
+   Host results are for comparing builds of the library with each other on the same machine, not with a board.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include <Arduino.h>
+
+void setup();
+
+int main() {
+  setup();
+  return 0;
+}
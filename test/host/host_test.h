@@ -0,0 +1,146 @@
+/* host_test.h - Checks & helpers shared by the MkWifiDev host tests
+
+   Each test is a program which returns non-zero if any CHECK() failed, as run by ctest. Failed checks are printed
+   with their line & continue, so one run shows everything that's wrong.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include <MkWifiDev.h>
+#include <arpa/inet.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond)   do { if(!(cond)) { testFailures++; \
+                        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } } while(0)
+#define CHECK_EQ(a, b)  do { auto _a = (a); auto _b = (b); if(!(_a == _b)) { testFailures++; \
+                          fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed\n  got:      [%s]\n  expected: [%s]\n", \
+                                  __FILE__, __LINE__, #a, #b, testText(_a).c_str(), testText(_b).c_str()); } } while(0)
+
+static inline std::string testText(const std::string &s) { return s; }
+static inline std::string testText(const char *s) { return s ? s : "(null)"; }
+template<typename T> std::string testText(T v) { return std::to_string(v); }
+
+static inline int testResult(const char *name) {
+  if(testFailures)
+    fprintf(stderr, "%s: %d check(s) failed\n", name, testFailures);
+  else
+    printf("%s: passed\n", name);
+  return testFailures != 0;
+}
+
+// Keeps everything written to it. Input can be supplied to simulate key presses
+class CaptureStream : public Stream
+{
+  public:
+    std::string text;
+    std::string input;
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override {
+      std::lock_guard<std::mutex> lock(mutex);
+      text.append((const char*)buffer, size);
+      return size;
+    }
+    using Print::write;
+    int availableForWrite() override { return 4096; }
+    int available() override { return input.size(); }
+    int read() override {
+      if(input.empty())
+        return -1;
+      int c = (uint8_t)input[0];
+      input.erase(0, 1);
+      return c;
+    }
+    int peek() override { return input.empty() ? -1 : (uint8_t)input[0]; }
+
+    // Returns & clears what has been written. The capacity is kept, so writes needn't allocate (see test_json)
+    std::string take() {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::string s = text;
+      text.clear();
+      return s;
+    }
+
+  private:
+    std::mutex mutex;
+};
+
+// Splits text into lines, without their line ends
+static inline std::vector<std::string> testLines(const std::string &text) {
+  std::vector<std::string> lines;
+  size_t pos = 0, end;
+  while((end = text.find('\n', pos)) != std::string::npos) {
+    size_t len = end - pos;
+    if(len && text[end-1] == '\r')
+      len--;
+    lines.push_back(text.substr(pos, len));
+    pos = end + 1;
+  }
+  if(pos < text.size())
+    lines.push_back(text.substr(pos));
+  return lines;
+}
+
+// Returns the text of a message without its timestamp (which is " : " terminated) or colour codes
+static inline std::string testMessage(const std::string &line) {
+  std::string s;
+  for(size_t i=0; i<line.size(); i++) {
+    if(line[i] == '\033') {
+      while(i < line.size() && line[i] != 'm')
+        i++;
+      continue;
+    }
+    s += line[i];
+  }
+  return s;
+}
+
+// Connects a terminal to the remote terminal server, as a loopback socket
+static inline int connectTerminal() {
+  uint16_t port = WiFiServer::hostPort(23);
+  CHECK(port != 0);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0);
+  return fd;
+}
+
+// Returns what the terminal has received, waiting up to ms for the first of it
+static inline std::string receive(int fd, int ms = 200) {
+  std::string data;
+  char buff[4096];
+  pollfd p = { fd, POLLIN, 0 };
+  while(poll(&p, 1, data.empty() ? ms : 20) == 1) {
+    ssize_t n = recv(fd, buff, sizeof(buff), 0);
+    if(n <= 0)
+      break;
+    data.append(buff, n);
+  }
+  return data;
+}
+
+// Runs loop() until the terminal has had its welcome & is receiving output
+static inline void waitForTerminal(int fd) {
+  for(int i=0; i<50 && receive(fd, 10).find("Ctrl-A") == std::string::npos; i++) {
+    WifiDev.loop();
+    hostAdvanceMillis(20);
+  }
+  for(int i=0; i<5; i++)
+    WifiDev.loop();     // Replay the (empty) backlog
+  receive(fd, 20);
+}
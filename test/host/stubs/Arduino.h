@@ -0,0 +1,173 @@
+/* Arduino.h - Minimal stand-in for the ESP32 Arduino core, used to build MkWifiDev on a Linux host
+
+   Only what the library, the examples & the host tests use is provided. The host build is ESP32 flavoured (ESP32 is
+   defined by CMakeLists.txt) so tasks are real threads, remote terminals are real loopback sockets & the file system
+   is a local directory. millis() & micros() follow the host clock, plus an offset tests can advance.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define constrain(amt, low, high)  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define IRAM_ATTR
+
+// RTC memory is a section of its own, so a test can fill it (from __start_rtc_noinit) as a previous boot would have
+#define RTC_NOINIT_ATTR __attribute__((section("rtc_noinit")))
+
+#define HIGH    1
+#define LOW     0
+#define OUTPUT  1
+#define INPUT   0
+
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void hostAdvanceMillis(uint32_t ms);    // Moves millis() & micros() forward, for tests of delays & timeouts
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+class String
+{
+  public:
+    String(const char *s = "") : s(s ? s : "") { }
+    String(const std::string &s) : s(s) { }
+    String(int v) : s(std::to_string(v)) { }
+
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+    String &operator=(const char *c) { s = c ? c : ""; return *this; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    bool operator==(const char *c) const { return s == c; }
+
+  private:
+    std::string s;
+};
+
+class Print
+{
+  public:
+    virtual ~Print() { }
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+      for(size_t i=0; i<size; i++)
+        write(buffer[i]);
+      return size;
+    }
+    size_t write(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() { }
+
+    size_t print(const char *s) { return write(s); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return printf("%d", v); }
+    size_t print(unsigned v) { return printf("%u", v); }
+    size_t print(long v) { return printf("%ld", v); }
+    size_t print(unsigned long v) { return printf("%lu", v); }
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(const T &v) { size_t n = print(v); return n + println(); }
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+      char buff[256];
+      va_list args;
+      va_start(args, format);
+      int len = vsnprintf(buff, sizeof(buff), format, args);
+      va_end(args);
+      return (len > 0) ? write((const uint8_t*)buff, min((size_t)len, sizeof(buff) - 1)) : 0;
+    }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// Writes to stdout, or discards the output if quiet is set. Input can be supplied for Command Mode
+class HardwareSerial : public Stream
+{
+  public:
+    bool quiet = false;
+    std::string input;
+
+    void begin(unsigned long) { }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override {
+      return quiet ? size : fwrite(buffer, 1, size, stdout);
+    }
+    using Print::write;
+    int availableForWrite() override { return 128; }
+    int available() override { return input.size(); }
+    int read() override;
+    int peek() override { return input.empty() ? -1 : (uint8_t)input[0]; }
+    void flush() override { fflush(stdout); }
+};
+
+extern HardwareSerial Serial;
+
+// FreeRTOS & ESP-IDF
+#define portNUM_PROCESSORS  2
+uint32_t xPortGetCoreID();
+bool xPortInIsrContext();
+uint32_t getCpuFrequencyMhz();
+void *ps_malloc(size_t size);
+bool psramFound();
+
+typedef int esp_reset_reason_t;
+esp_reset_reason_t esp_reset_reason();
+void esp_restart();
+uint32_t esp_get_free_heap_size();
+uint32_t esp_get_minimum_free_heap_size();
+int64_t esp_timer_get_time();
+
+class EspClass
+{
+  public:
+    const char *getChipModel() { return "Host"; }
+    uint8_t getChipRevision() { return 0; }
+    uint8_t getChipCores() { return portNUM_PROCESSORS; }
+    unsigned long long getEfuseMac() { return 0; }     // uint64_t, which is long long on the ESP32
+    uint32_t getCpuFreqMHz() { return getCpuFrequencyMhz(); }
+    uint32_t getCycleCount();
+    uint32_t getFlashChipSize() { return 4 << 20; }
+    uint32_t getHeapSize() { return 320 << 10; }
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap() { return esp_get_minimum_free_heap_size(); }
+    uint32_t getMaxAllocHeap() { return 110 << 10; }
+    uint32_t getPsramSize() { return 0; }
+    uint32_t getFreePsram() { return 0; }
+    void restart() { esp_restart(); }
+};
+
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,41 @@
+/* ArduinoOTA.h - Stand-in for ArduinoOTA, for the MkWifiDev host build. Updates never arrive, but the calls made
+   are counted so tests can check the library sets it up once
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include "WiFi.h"
+#include <functional>
+
+typedef int ota_error_t;
+#define OTA_AUTH_ERROR      0
+#define OTA_BEGIN_ERROR     1
+#define OTA_CONNECT_ERROR   2
+#define OTA_RECEIVE_ERROR   3
+#define OTA_END_ERROR       4
+#define U_FLASH             0
+#define U_SPIFFS            100
+
+class ArduinoOTAClass
+{
+  public:
+    void setHostname(const char *) { }
+    void setPassword(const char *) { }
+    void onStart(std::function<void()>) { }
+    void onEnd(std::function<void()>) { }
+    void onProgress(std::function<void(unsigned int, unsigned int)>) { }
+    void onError(std::function<void(ota_error_t)>) { }
+    void begin() { begins++; }
+    void handle() { }
+    int getCommand() { return U_FLASH; }
+
+    uint32_t begins = 0;
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+// Time functions which come with the ESP32 core
+void configTime(long gmtOffset, int daylightOffset, const char *server1, const char *server2 = nullptr,
+                const char *server3 = nullptr);
+bool getLocalTime(struct tm *info, uint32_t ms = 5000);
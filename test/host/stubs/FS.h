@@ -0,0 +1,59 @@
+/* FS.h - Stand-in for the Arduino file system API, for the MkWifiDev host build
+
+   An fs::FS is a directory on the host (eg made by the test), and a File is a stdio FILE in it.
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include "Arduino.h"
+#include <memory>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+class File : public Stream
+{
+  public:
+    File() { }
+    explicit File(FILE *f);
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int peek() override;
+    void flush() override;
+
+    size_t size() const;
+    size_t position() const;
+    void close() { file.reset(); }
+    operator bool() const { return (bool)file; }
+
+  private:
+    std::shared_ptr<FILE> file;
+};
+
+class FS
+{
+  public:
+    explicit FS(const char *root) : root(root) { }
+
+    File open(const char *path, const char *mode = FILE_READ);
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+
+  private:
+    std::string hostPath(const char *path) const { return root + path; }
+    std::string root;
+};
+
+}
+
+using fs::File;
+using fs::FS;
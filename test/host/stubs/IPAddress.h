@@ -0,0 +1,26 @@
+/* IPAddress.h - Stand-in for the Arduino IPAddress class, for the MkWifiDev host build
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include "Arduino.h"
+#include <arpa/inet.h>
+
+class IPAddress
+{
+  public:
+    IPAddress() { }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : addr((uint32_t)a | b << 8 | c << 16 | (uint32_t)d << 24) { }
+
+    operator uint32_t() const { return addr; }      // In network order, as on the device
+    bool fromString(const char *s) { return inet_pton(AF_INET, s, &addr) == 1; }
+    String toString() const {
+      char s[16];
+      snprintf(s, sizeof(s), "%u.%u.%u.%u", addr & 0xFF, (addr >> 8) & 0xFF, (addr >> 16) & 0xFF, addr >> 24);
+      return String(s);
+    }
+
+  private:
+    uint32_t addr = 0;
+};
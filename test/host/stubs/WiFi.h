@@ -0,0 +1,151 @@
+/* WiFi.h - Stand-in for the ESP32 WiFi library, for the MkWifiDev host build
+
+   WiFiServer, WiFiClient & WiFiUDP are real sockets on the loopback interface, so tests can connect to the
+   remote terminal & metrics servers & receive syslog datagrams. A server listens on a free port rather than the one
+   asked for (23 would need root), which tests find with WiFiServer::hostPort(). The connection is simulated: WiFi
+   starts disconnected and setConnected() changes the status & sends the events the library listens for.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include "Arduino.h"
+#include "IPAddress.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+  ARDUINO_EVENT_WIFI_STA_START = 2,
+  ARDUINO_EVENT_WIFI_STA_CONNECTED = 4,
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED = 5,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP = 7,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP = 8
+} arduino_event_id_t;
+
+typedef union {
+  uint32_t reason;
+} arduino_event_info_t;
+
+// A socket shared by the copies of a WiFiClient, closed when the last copy goes
+struct HostSocket {
+  int fd;
+  explicit HostSocket(int fd) : fd(fd) { }
+  ~HostSocket();
+};
+
+class WiFiClient : public Stream
+{
+  public:
+    WiFiClient() { }
+    explicit WiFiClient(int fd);
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int availableForWrite() override;
+    int available() override;
+    int read() override;
+    int peek() override;
+    void flush() override { }
+
+    bool connected();
+    void stop() { sock.reset(); }
+    operator bool() const { return (bool)sock; }
+    int fd() const { return sock ? sock->fd : -1; }
+    IPAddress remoteIP() const { return IPAddress(127, 0, 0, 1); }
+    void setNoDelay(bool) { }
+
+  private:
+    std::shared_ptr<HostSocket> sock;
+};
+
+class WiFiServer
+{
+  public:
+    WiFiServer(uint16_t port = 80) : port(port) { }
+    ~WiFiServer() { close(); }
+
+    void begin(uint16_t port = 0);
+    void close();
+    void stop() { close(); }
+    bool hasClient();
+    WiFiClient accept();
+    WiFiClient available() { return accept(); }
+    void setNoDelay(bool) { }
+
+    // Loopback port of the (most recently started) server which was asked to use port, 0 if there isn't one
+    static uint16_t hostPort(uint16_t port);
+
+  private:
+    uint16_t port;
+    uint16_t boundPort = 0;
+    int fd = -1;
+};
+
+class WiFiUDP : public Stream
+{
+  public:
+    ~WiFiUDP();
+
+    uint8_t begin(uint16_t port);
+    int beginPacket(IPAddress ip, uint16_t port);
+    int endPacket();
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override { packet.append((const char*)buffer, size); return size; }
+    using Print::write;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+  private:
+    int fd = -1;
+    uint16_t destPort = 0;
+    std::string packet;
+};
+
+class WiFiClass
+{
+  public:
+    typedef std::function<void(arduino_event_id_t, arduino_event_info_t)> EventHandler;
+
+    wl_status_t status() { statusCalls++; return connected ? WL_CONNECTED : WL_DISCONNECTED; }
+    bool begin(const char *, const char *) { return true; }
+    bool reconnect() { reconnects++; return true; }
+    bool setAutoReconnect(bool) { return true; }
+    bool hostname(const char *) { return true; }
+    bool setHostname(const char *) { return true; }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    int8_t RSSI() { return -60; }
+    String macAddress() { return String("24:0A:C4:00:00:01"); }
+    int hostByName(const char *, IPAddress &ip) { ip = IPAddress(127, 0, 0, 1); return 1; }
+    int onEvent(EventHandler handler, arduino_event_id_t event) {
+      handlers.push_back({ event, handler });
+      return handlers.size();
+    }
+
+    // Changes the simulated connection, sending the got IP or disconnected event
+    void setConnected(bool up);
+
+    uint32_t statusCalls = 0;
+    uint32_t reconnects = 0;
+
+  private:
+    bool connected = false;
+    std::vector<std::pair<arduino_event_id_t, EventHandler>> handlers;
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,7 @@
+/* WiFiUdp.h - WiFiUDP is declared with the rest of the WiFi stand-in, for the MkWifiDev host build
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include "WiFi.h"
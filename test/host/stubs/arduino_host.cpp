@@ -0,0 +1,347 @@
+/* arduino_host.cpp - Implementation of the Arduino, ESP32 & WiFi stand-ins for the MkWifiDev host build
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "Arduino.h"
+#include "ArduinoOTA.h"
+#include "FS.h"
+#include "WiFi.h"
+#include "esp_heap_caps.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+
+static const auto tStart = std::chrono::steady_clock::now();
+static std::atomic<uint64_t> usOffset{0};
+
+// Writing to a socket the other end has closed should fail, as on the device, rather than end the program
+static const bool sigpipeIgnored = (signal(SIGPIPE, SIG_IGN), true);
+
+unsigned long micros() {
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count();
+  return (unsigned long)(uint32_t)(us + usOffset.load());
+}
+
+unsigned long millis() {
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tStart).count();
+  return (unsigned long)(uint32_t)(ms + usOffset.load() / 1000);
+}
+
+void hostAdvanceMillis(uint32_t ms) {
+  usOffset += (uint64_t)ms * 1000;
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+void pinMode(uint8_t, uint8_t) { }
+void digitalWrite(uint8_t, uint8_t) { }
+
+int HardwareSerial::read() {
+  if(input.empty())
+    return -1;
+  int c = (uint8_t)input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+// FreeRTOS & ESP-IDF. Threads are spread over the two "cores" so the per-core interrupt rings are both used
+uint32_t xPortGetCoreID() {
+  return std::hash<std::thread::id>()(std::this_thread::get_id()) & 1;
+}
+
+bool xPortInIsrContext() {
+  return false;
+}
+
+uint32_t getCpuFrequencyMhz() {
+  return 240;
+}
+
+uint32_t EspClass::getCycleCount() {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart).count();
+  return (uint32_t)(ns * getCpuFrequencyMhz() / 1000);
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return esp_get_free_heap_size();
+}
+
+void *ps_malloc(size_t size) {
+  return malloc(size);
+}
+
+bool psramFound() {
+  return false;
+}
+
+esp_reset_reason_t esp_reset_reason() {
+  return 1;     // Power on
+}
+
+void esp_restart() {
+  exit(0);
+}
+
+uint32_t esp_get_free_heap_size() {
+  return 200 << 10;
+}
+
+uint32_t esp_get_minimum_free_heap_size() {
+  return 180 << 10;
+}
+
+int64_t esp_timer_get_time() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tStart).count() +
+         usOffset.load();
+}
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t) {
+  memset(info, 0, sizeof(*info));
+  info->total_free_bytes = esp_get_free_heap_size();
+  info->largest_free_block = ESP.getMaxAllocHeap();
+  info->minimum_free_bytes = esp_get_minimum_free_heap_size();
+  info->allocated_blocks = 100;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  return (caps & MALLOC_CAP_SPIRAM) ? 0 : esp_get_free_heap_size();
+}
+
+void configTime(long, int, const char *, const char *, const char *) { }
+
+bool getLocalTime(struct tm *info, uint32_t) {
+  time_t now = time(nullptr);
+  localtime_r(&now, info);
+  return true;
+}
+
+// Sockets
+HostSocket::~HostSocket() {
+  ::close(fd);
+}
+
+WiFiClient::WiFiClient(int fd) : sock(std::make_shared<HostSocket>(fd)) { }
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size) {
+  if(!sock)
+    return 0;
+  ssize_t n = send(sock->fd, buffer, size, MSG_NOSIGNAL);
+  return (n > 0) ? n : 0;
+}
+
+int WiFiClient::availableForWrite() {
+  if(!sock)
+    return 0;
+  int queued = 0, sndbuf = 0;
+  socklen_t len = sizeof(sndbuf);
+  ioctl(sock->fd, TIOCOUTQ, &queued);
+  getsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+  return max(sndbuf / 2 - queued, 0);
+}
+
+int WiFiClient::available() {
+  int n = 0;
+  if(sock)
+    ioctl(sock->fd, FIONREAD, &n);
+  return n;
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return (sock && recv(sock->fd, &c, 1, MSG_DONTWAIT) == 1) ? c : -1;
+}
+
+int WiFiClient::peek() {
+  uint8_t c;
+  return (sock && recv(sock->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 1) ? c : -1;
+}
+
+bool WiFiClient::connected() {
+  if(!sock)
+    return false;
+  uint8_t c;
+  ssize_t n = recv(sock->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static std::mutex serverMutex;
+static std::map<uint16_t, uint16_t> serverPorts;    // Port asked for -> loopback port
+
+void WiFiServer::begin(uint16_t port) {
+  if(port)
+    this->port = port;
+  close();
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if(bind(fd, (sockaddr*)&addr, len) || listen(fd, 4) || getsockname(fd, (sockaddr*)&addr, &len)) {
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  boundPort = ntohs(addr.sin_port);
+  std::lock_guard<std::mutex> lock(serverMutex);
+  serverPorts[this->port] = boundPort;
+}
+
+void WiFiServer::close() {
+  if(fd < 0)
+    return;
+  ::close(fd);
+  fd = -1;
+  std::lock_guard<std::mutex> lock(serverMutex);
+  if(serverPorts[port] == boundPort)
+    serverPorts.erase(port);
+}
+
+bool WiFiServer::hasClient() {
+  pollfd p = { fd, POLLIN, 0 };
+  return fd >= 0 && poll(&p, 1, 0) == 1;
+}
+
+WiFiClient WiFiServer::accept() {
+  int c = (fd >= 0) ? ::accept(fd, nullptr, nullptr) : -1;
+  if(c < 0)
+    return WiFiClient();
+  int one = 1;
+  setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return WiFiClient(c);
+}
+
+uint16_t WiFiServer::hostPort(uint16_t port) {
+  std::lock_guard<std::mutex> lock(serverMutex);
+  auto it = serverPorts.find(port);
+  return (it == serverPorts.end()) ? 0 : it->second;
+}
+
+WiFiUDP::~WiFiUDP() {
+  if(fd >= 0)
+    ::close(fd);
+}
+
+uint8_t WiFiUDP::begin(uint16_t) {
+  if(fd < 0)
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+  return fd >= 0;
+}
+
+int WiFiUDP::beginPacket(IPAddress, uint16_t port) {
+  if(!begin(0))
+    return 0;
+  destPort = port;
+  packet.clear();
+  return 1;
+}
+
+int WiFiUDP::endPacket() {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(destPort);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return sendto(fd, packet.data(), packet.size(), 0, (sockaddr*)&addr, sizeof(addr)) == (ssize_t)packet.size();
+}
+
+void WiFiClass::setConnected(bool up) {
+  connected = up;
+  arduino_event_id_t event = up ? ARDUINO_EVENT_WIFI_STA_GOT_IP : ARDUINO_EVENT_WIFI_STA_DISCONNECTED;
+  arduino_event_info_t info = {};
+  for(auto &h : handlers)
+    if(h.first == event)
+      h.second(event, info);
+}
+
+// Files
+namespace fs {
+
+// Unbuffered, so each write reaches the host file as it would the card
+File::File(FILE *f) : file(f, fclose) {
+  setvbuf(f, nullptr, _IONBF, 0);
+}
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  return file ? fwrite(buffer, 1, size, file.get()) : 0;
+}
+
+int File::available() {
+  return file ? (int)(size() - position()) : 0;
+}
+
+int File::read() {
+  return file ? fgetc(file.get()) : -1;
+}
+
+int File::peek() {
+  if(!file)
+    return -1;
+  int c = fgetc(file.get());
+  if(c >= 0)
+    ungetc(c, file.get());
+  return c;
+}
+
+void File::flush() {
+  if(file)
+    fflush(file.get());
+}
+
+size_t File::size() const {
+  if(!file)
+    return 0;
+  long pos = ftell(file.get());
+  fseek(file.get(), 0, SEEK_END);
+  long end = ftell(file.get());
+  fseek(file.get(), pos, SEEK_SET);
+  return end;
+}
+
+size_t File::position() const {
+  return file ? ftell(file.get()) : 0;
+}
+
+File FS::open(const char *path, const char *mode) {
+  FILE *f = fopen(hostPath(path).c_str(), mode);
+  return f ? File(f) : File();
+}
+
+bool FS::exists(const char *path) {
+  return access(hostPath(path).c_str(), F_OK) == 0;
+}
+
+bool FS::remove(const char *path) {
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to) {
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+}
@@ -0,0 +1,28 @@
+/* esp_heap_caps.h - Stand-in for the ESP-IDF heap capabilities API, for the MkWifiDev host build
+
+   The heap is reported as a fixed size with a free amount that follows the host's allocations (see
+   arduino_host.cpp), so the heap monitor has something to show.
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT       (1 << 2)
+#define MALLOC_CAP_SPIRAM     (1 << 10)
+#define MALLOC_CAP_INTERNAL   (1 << 11)
+
+typedef struct {
+  size_t total_free_bytes;
+  size_t total_allocated_bytes;
+  size_t largest_free_block;
+  size_t minimum_free_bytes;
+  size_t allocated_blocks;
+  size_t free_blocks;
+  size_t total_blocks;
+} multi_heap_info_t;
+
+void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps);
+size_t heap_caps_get_free_size(uint32_t caps);
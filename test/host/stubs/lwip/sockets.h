@@ -0,0 +1,9 @@
+/* lwip/sockets.h - The ESP32's lwIP socket API is the BSD one, so the host's is used for the MkWifiDev host build
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#pragma once
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
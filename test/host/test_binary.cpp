@@ -0,0 +1,151 @@
+/* test_binary.cpp - Binary log records (see setBinaryLogging()) are written as documented & decode to the same
+   text that printf gives
+
+   The records are written to a capture stream & checked here. If the Python interpreter & tools/mkdecode.py are
+   given as arguments, the capture is also decoded by mkdecode.py using this program's own format strings (it's
+   built without PIE so their addresses fit in a record) & compared with the expected text.
+
+   Arguments are encoded with the device's sizes, where long, size_t & pointers are 32 bits. On the host they're 64
+   bits, so %ld, %zu & %p aren't used here.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+
+static CaptureStream out;
+static std::string expected;        // Text mkdecode.py should give for the capture
+static int records = 0;
+
+// Adds the text a message should decode to
+static void __attribute__((format(printf, 2, 3))) expectText(const char *tag, const char *format, ...) {
+  char text[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if(tag)
+    expected += std::string(tag) + " : ";
+  expected += std::string(text) + "\r\n";
+  records++;
+}
+
+#define LOGGED(level, format, ...)  do { level(format, ##__VA_ARGS__); expectText(dbgTAG, format, ##__VA_ARGS__); } while(0)
+
+static std::string longText(300, 'x');
+
+static void logMessages() {
+  LOGGED(DBG_INFO, "Sensor %d reading %u, state %s", -3, 4000000000u, "ok");
+  LOGGED(DBG_WARNING, "Hex %02x %08X %c|%-4c|", 0xab, 0xdeadbeefu, 'Z', 'y');
+  LOGGED(DBG_ERROR, "Float %.2f %8.3f %e %g %.0f", 3.14159, -2.5, 12345.678, 0.0001, 1e6);
+  LOGGED(DBG_DEBUG, "Long long %lld %llu %llx", -1234567890123LL, 18446744073709551615ULL, 0x123456789abcULL);
+  LOGGED(DBG_INFO, "Width %*d|%-*s|%.*s|%5s|%-5s|", 6, 42, 5, "ab", 3, "truncate", "r", "l");
+  LOGGED(DBG_CRITICAL, "Percent 100%% done");
+  LOGGED(DBG_PRINT, "Printed %s", "text");
+  {
+    const char *dbgTAG = "Net";
+    LOGGED(DBG_ALERT, "Tagged %s %d", "message", 7);
+  }
+
+  // The hex dump is sent as text, which mkdecode.py passes through unchanged
+  static const uint8_t data[20] = { 0, 1, 2, 3, 'a', 'b', 'c' };
+  std::string before = out.take();
+  DBG_HEXDUMP("Data", data, sizeof(data));
+  std::string dump = out.take();
+  CHECK(dump.find("00 01 02 03") != std::string::npos);
+  CHECK(dump.find('\x1E') == std::string::npos);
+  expected += dump;
+  out.text = before + dump;
+
+  // Strings are cut short to fit in the 255 byte record
+  DBG_INFO("Long: %s", longText.c_str());
+  expected += "Long: " + longText.substr(0, 255 - 15 - 1) + "\r\n";
+  records++;
+}
+
+// Checks the layout of each record: mark, length, type, seconds, ms, format & tag addresses, arguments
+static void checkRecords(const std::string &data) {
+  static const uint8_t types[] = { MkWifiDev::INFO, MkWifiDev::WARNING, MkWifiDev::ERROR, MkWifiDev::DEBUG,
+                                   MkWifiDev::INFO, MkWifiDev::CRITICAL, MkWifiDev::NORMAL, MkWifiDev::ALERT,
+                                   MkWifiDev::INFO };
+  int n = 0;
+  size_t pos = 0;
+  while((pos = data.find('\x1E', pos)) != std::string::npos) {
+    const uint8_t *rec = (const uint8_t*)data.data() + pos;
+    uint8_t len = rec[1];
+    CHECK(pos + 2 + len <= data.size());
+    CHECK(len >= 15);
+    if(n < (int)sizeof(types))
+      CHECK_EQ(rec[2], types[n]);
+
+    uint32_t sec, fmt, tag;
+    uint16_t ms;
+    memcpy(&sec, rec + 3, 4);
+    memcpy(&ms, rec + 7, 2);
+    memcpy(&fmt, rec + 9, 4);
+    memcpy(&tag, rec + 13, 4);
+    CHECK(ms < 1000);
+    CHECK(fmt != 0 && strchr((const char*)(uintptr_t)fmt, '\0'));
+    if(n == 7)
+      CHECK_EQ(std::string((const char*)(uintptr_t)tag), std::string("Net"));
+    else
+      CHECK_EQ(tag, 0u);
+    if(n == 0) {
+      int32_t d;
+      uint32_t u;
+      memcpy(&d, rec + 17, 4);
+      memcpy(&u, rec + 21, 4);
+      CHECK_EQ(d, -3);
+      CHECK_EQ(u, 4000000000u);
+      CHECK_EQ(std::string((const char*)rec + 25), std::string("ok"));
+      CHECK_EQ((int)len, 15 + 4 + 4 + 3);
+    }
+    if(n == 8)
+      CHECK_EQ((int)len, 255);
+    pos += 2 + len;
+    n++;
+  }
+  CHECK_EQ(n, records);
+}
+
+// Decodes the capture with mkdecode.py
+static void checkDecoded(const char *python, const char *mkdecode, const char *exe) {
+  const char *capture = "test_binary.bin";
+  FILE *f = fopen(capture, "wb");
+  fwrite(out.text.data(), 1, out.text.size(), f);
+  fclose(f);
+
+  std::string cmd = std::string(python) + " " + mkdecode + " --no-colour --no-timestamps " + exe + " " + capture;
+  FILE *p = popen(cmd.c_str(), "r");
+  CHECK(p != nullptr);
+  if(!p)
+    return;
+  std::string decoded;
+  char buff[1024];
+  size_t n;
+  while((n = fread(buff, 1, sizeof(buff), p)) > 0)
+    decoded.append(buff, n);
+  CHECK_EQ(pclose(p), 0);
+
+  auto got = testLines(decoded), want = testLines(expected);
+  CHECK_EQ(got.size(), want.size());
+  for(size_t i=0; i<min(got.size(), want.size()); i++)
+    CHECK_EQ(got[i], want[i]);
+}
+
+int main(int argc, char **argv) {
+  WifiDev.setSerial(out);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_TIMESTAMPS | MkWifiDev::SHOW_COLOUR);
+  WifiDev.setBinaryLogging(true);
+  logMessages();
+  WifiDev.setBinaryLogging(false);
+
+  checkRecords(out.text);
+  if(argc >= 3)
+    checkDecoded(argv[1], argv[2], argv[0]);
+  return testResult("test_binary");
+}
@@ -0,0 +1,153 @@
+/* test_crashlog.cpp - The crash log ring (see MKWIFIDEV_CRASH_LOG) keeps whole lines across a reset, rejects a
+   damaged ring & the lines are shown once after the restart
+
+   MkCrashRing is checked on its own first: lines added in parts, wrapping, long lines, lines not committed before
+   the "reset", & damage to the text or the positions. Then the library's RTC memory (a section in the host build)
+   is filled as a previous boot would have left it, & the lines should be shown on the serial port & sent to the
+   first remote terminal to connect, but not to the next.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+
+extern uint8_t __start_rtc_noinit[], __stop_rtc_noinit[];
+
+static CaptureStream serialOut;
+
+static void addLine(MkCrashRing &ring, const std::string &text) {
+  ring.begin();
+  ring.append(text.data(), text.size() / 2);      // In two parts
+  ring.append(text.data() + text.size() / 2, text.size() - text.size() / 2);
+  ring.commit();
+}
+
+// Attaches a second ring to the memory, as after a reset, & returns its lines
+static std::vector<std::string> linesAfterReset(void *mem, size_t size, int &count) {
+  MkCrashRing ring;
+  count = ring.attach(mem, size);
+  std::vector<std::string> lines;
+  char buff[1024];
+  uint32_t pos = ring.first();
+  int len;
+  while((len = ring.read(pos, buff, sizeof(buff))) >= 0)
+    lines.push_back(std::string(buff, len));
+  return lines;
+}
+
+static void checkRing() {
+  static uint32_t mem[256];
+  int count;
+  memset(mem, 0xA5, sizeof(mem));
+  MkCrashRing ring;
+  CHECK_EQ(ring.attach(mem, sizeof(mem)), -1);     // Not a ring, so it's cleared
+  CHECK(ring.isActive());
+  CHECK(linesAfterReset(mem, sizeof(mem), count).empty());
+  CHECK_EQ(count, 0);
+
+  // Only committed lines survive
+  addLine(ring, "First line");
+  addLine(ring, "Second line");
+  ring.begin();
+  ring.append("Not committed", 13);
+  auto lines = linesAfterReset(mem, sizeof(mem), count);
+  CHECK_EQ(count, 2);
+  CHECK_EQ(lines.size(), (size_t)2);
+  if(lines.size() == 2) {
+    CHECK_EQ(lines[0], std::string("First line"));
+    CHECK_EQ(lines[1], std::string("Second line"));
+  }
+
+  // The oldest lines are dropped to make room
+  ring.attach(mem, sizeof(mem));
+  for(int i=0; i<100; i++)
+    addLine(ring, "Line " + std::to_string(i) + " of the ring");
+  lines = linesAfterReset(mem, sizeof(mem), count);
+  CHECK_EQ(count, (int)lines.size());
+  CHECK(lines.size() > 10 && lines.size() < 100);
+  for(size_t i=0; i<lines.size(); i++)
+    CHECK_EQ(lines[i], "Line " + std::to_string(100 - lines.size() + i) + " of the ring");
+
+  // Long lines are cut short
+  addLine(ring, std::string(2000, 'x'));
+  lines = linesAfterReset(mem, sizeof(mem), count);
+  CHECK(!lines.empty() && lines.back() == std::string(ring.maxLine(), 'x'));
+
+  // Damaged text isn't shown as if it were a line from before the reset
+  uint8_t *text = (uint8_t*)memmem(mem, sizeof(mem), "Line 99", 7);
+  CHECK(text != nullptr);
+  if(text) {
+    text[5] ^= 0x01;
+    CHECK_EQ(linesAfterReset(mem, sizeof(mem), count).size(), (size_t)0);
+    CHECK_EQ(count, -1);
+  }
+
+  // If the copy of the positions written last is damaged, the other is used
+  ring.attach(mem, sizeof(mem));
+  addLine(ring, "One");
+  addLine(ring, "Two");
+  int newer = (mem[1] > mem[6]) ? 0 : 1;     // Each copy is magic, seq, tail, used, check
+  mem[newer*5 + 3] ^= 1;
+  lines = linesAfterReset(mem, sizeof(mem), count);
+  CHECK_EQ(count, 1);
+  CHECK(lines.size() == 1 && lines[0] == "One");
+  mem[(newer^1)*5 + 4] ^= 1;
+  linesAfterReset(mem, sizeof(mem), count);
+  CHECK_EQ(count, -1);
+}
+
+// Connects a terminal & returns what it receives while loop() runs
+static std::string terminalOutput(int &fd) {
+  fd = connectTerminal();
+  std::string received;
+  for(int i=0; i<20; i++) {
+    WifiDev.loop();
+    hostAdvanceMillis(20);
+    received += receive(fd, 10);
+  }
+  return received;
+}
+
+static void checkReplay() {
+  MkCrashRing ring;
+  ring.attach(__start_rtc_noinit, __stop_rtc_noinit - __start_rtc_noinit);
+  addLine(ring, "Before the crash 1");
+  addLine(ring, "Before the crash 2");
+  addLine(ring, "Before the crash 3");
+
+  WifiDev.setSerial(serialOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+  WifiDev.begin("ssid", "password", "host");
+  WiFi.setConnected(true);
+  WifiDev.loop();
+  CHECK_EQ(WifiDev.getCrashLogLines(), 3);
+
+  std::string shown = serialOut.take();
+  CHECK(shown.find("*** Last 3 lines before the restart") != std::string::npos);
+  CHECK(shown.find("Before the crash 1\r\nBefore the crash 2\r\nBefore the crash 3\r\n"
+                   "*** End of lines from before the restart ***") != std::string::npos);
+
+  int first, second;
+  std::string received = terminalOutput(first);
+  CHECK(received.find("*** Last 3 lines before the restart") != std::string::npos);
+  CHECK(received.find("Before the crash 3") != std::string::npos);
+
+  received = terminalOutput(second);
+  CHECK(received.find("Ctrl-A") != std::string::npos || received.find("View only") != std::string::npos);
+  CHECK(received.find("Before the crash") == std::string::npos);
+  CHECK(receive(first, 20).find("Before the crash") == std::string::npos);
+  CHECK(serialOut.take().find("Before the crash") == std::string::npos);
+
+  close(first);
+  close(second);
+}
+
+int main() {
+  checkRing();
+  checkReplay();
+  return testResult("test_crashlog");
+}
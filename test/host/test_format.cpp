@@ -0,0 +1,77 @@
+/* test_format.cpp - Messages are formatted as printf() would, & a named array can be used as the format
+
+   Numbers go through the library's own integer & %f formatting, so every line is compared with snprintf()'s text for
+   the same format & value, including exact halves (which round to even) & values printf rounds either way. Formats in
+   named arrays aren't checked against their arguments at compile time, but must still compile (the check itself is
+   tested by test_format_bad.cpp, which mustn't compile).
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+
+static CaptureStream serialOut;
+
+extern const char externFormat[];
+const char externFormat[] = "Extern %d %s";
+
+// Returns the text of the one message logged since the last call
+static std::string takeMessage() {
+  auto lines = testLines(serialOut.take());
+  CHECK_EQ(lines.size(), (size_t)1);
+  return lines.empty() ? "" : lines[0];
+}
+
+template<typename... Args>
+static std::string printed(const char *format, Args... args) {
+  char text[128];
+  snprintf(text, sizeof(text), format, args...);
+  return text;
+}
+
+int main() {
+  WifiDev.setSerial(serialOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR | MkWifiDev::SHOW_TIMESTAMPS);
+
+  // Named arrays as formats
+  static const char staticFormat[] = "Static %d";
+  DBG_INFO(staticFormat, 1);
+  CHECK_EQ(takeMessage(), "Static 1");
+  DBG_INFO(externFormat, 2, "x");
+  CHECK_EQ(takeMessage(), "Extern 2 x");
+  char buffer[] = "Buffer %u";
+  DBG_INFO(buffer, 3u);
+  CHECK_EQ(takeMessage(), "Buffer 3");
+
+  // Exact halves & values either side of a tie (as stored)
+  static const double values[] = { 0.5, 1.5, 2.5, 3.5, -0.5, -2.5, 0.125, 0.375, 0.625, 2.675, 1.005, 1.015, 9.5,
+                                   99.95, 0.05, 0.15, 0.25, 0.35, 1e15 + 0.5, 12345.6789, -0.0, 0.0 };
+  static const char *formats[] = { "%.0f", "%.1f", "%.2f", "%.3f", "%f", "%8.2f", "%-8.1f|", "%08.1f" };
+  for(double d : values)
+    for(const char *f : formats) {
+      DBG_INFO(f, d);
+      CHECK_EQ(takeMessage(), printed(f, d));
+    }
+
+  // Spread over the range, at every precision
+  uint32_t seed = 1;
+  for(int i=0; i<2000; i++) {
+    seed = seed * 1664525 + 1013904223;
+    double d = (int32_t)seed / (double)(1 << (seed % 31));
+    char f[8];
+    snprintf(f, sizeof(f), "%%.%uf", i % 10);
+    DBG_INFO(f, d);
+    CHECK_EQ(takeMessage(), printed(f, d));
+  }
+
+  // Integers
+  DBG_INFO("%d %5d %-5d| %05d %u %x %X %ld %lld", -42, 7, -7, -3, 4000000000u, 0xbeef, 0xBEEF, -1L, -9000000000LL);
+  CHECK_EQ(takeMessage(), printed("%d %5d %-5d| %05d %u %x %X %ld %lld", -42, 7, -7, -3, 4000000000u, 0xbeef, 0xBEEF,
+                                  -1L, -9000000000LL));
+
+  return testResult("test_format");
+}
@@ -0,0 +1,16 @@
+/* test_format_bad.cpp - Mustn't compile: a literal format that doesn't match its arguments is an error
+
+   Built with -fsyntax-only by ctest, which expects it to fail (see test_format.cpp).
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include <MkWifiDev.h>
+
+void mismatched() {
+  DBG_INFO("%d", 1.5);
+}
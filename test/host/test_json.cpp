@@ -0,0 +1,204 @@
+/* test_json.cpp - JSON Lines output (see setJsonLines()) is valid JSON holding the message & its fields, and
+   messages are output without allocating memory
+
+   Serial output is JSON & the log file (a capture stream) gets the same messages as text. Allocations are counted
+   by replacing operator new & by linking with --wrap for malloc, calloc & realloc, which catches the library's own
+   calls (allocations made inside the C & C++ runtimes aren't seen).
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+#include <new>
+
+static CaptureStream jsonOut, textOut;
+static const size_t maxLine = 256;      // EVENT_MSG_MAX_LEN in MkWifiDev.cpp
+
+static std::atomic<int> allocations{0};
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) { allocations++; return __real_malloc(size); }
+void *__wrap_calloc(size_t n, size_t size) { allocations++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t size) { allocations++; return __real_realloc(p, size); }
+}
+
+void *operator new(size_t size) {
+  allocations++;
+  if(void *p = __real_malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Checks text is one JSON value (with no trailing text). Just enough of a parser for the library's output
+class JsonChecker
+{
+  public:
+    explicit JsonChecker(const std::string &text) : p(text.c_str()) { }
+
+    bool valid() { return value() && !*p; }
+
+  private:
+    const char *p;
+
+    bool value() {
+      switch(*p) {
+        case '{' : return container('}', true);
+        case '[' : return container(']', false);
+        case '"' : return string();
+        case 't' : return word("true");
+        case 'f' : return word("false");
+        case 'n' : return word("null");
+        default  : return number();
+      }
+    }
+
+    bool container(char close, bool object) {
+      p++;
+      if(*p == close)
+        return ++p;
+      for(;;) {
+        if(object && !(string() && *p++ == ':'))
+          return false;
+        if(!value())
+          return false;
+        if(*p == close)
+          return ++p;
+        if(*p++ != ',')
+          return false;
+      }
+    }
+
+    bool string() {
+      if(*p++ != '"')
+        return false;
+      for(; *p != '"'; p++) {
+        if((uint8_t)*p < 0x20)
+          return false;
+        if(*p == '\\') {
+          p++;
+          if(*p == 'u') {
+            for(int i=0; i<4; i++)
+              if(!isxdigit((uint8_t)*++p))
+                return false;
+          } else if(!strchr("\"\\/bfnrt", *p) || !*p)
+            return false;
+        }
+      }
+      p++;
+      return true;
+    }
+
+    bool word(const char *w) {
+      size_t n = strlen(w);
+      if(strncmp(p, w, n))
+        return false;
+      p += n;
+      return true;
+    }
+
+    bool number() {
+      char *end;
+      strtod(p, &end);
+      if(end == p || *p == '+' || *p == '.')
+        return false;
+      p = end;
+      return true;
+    }
+};
+
+// Returns the one line of output since the last call
+static std::string takeLine(CaptureStream &s) {
+  auto lines = testLines(s.take());
+  CHECK_EQ(lines.size(), (size_t)1);
+  return lines.empty() ? "" : lines[0];
+}
+
+static bool contains(const std::string &s, const char *part) {
+  if(s.find(part) != std::string::npos)
+    return true;
+  fprintf(stderr, "  [%s] doesn't contain [%s]\n", s.c_str(), part);
+  return false;
+}
+
+int main() {
+  jsonOut.text.reserve(1 << 16);
+  textOut.text.reserve(1 << 16);
+  WifiDev.setSerial(jsonOut);
+  WifiDev.setLogFile(textOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR | MkWifiDev::SHOW_TIMESTAMPS);
+  WifiDev.setJsonLines(MkWifiDev::SERIAL_OUTPUT);
+  DBG_INFO("Warm up %d", 1);      // Anything allocated once, on first use
+  WifiDev.flushLogs();
+  jsonOut.take();
+  textOut.take();
+
+  // Fields of each type, with the text output getting key=value
+  int before = allocations;
+  DBG_INFO_KV("sensor read", "temp", 21.5f, "rssi", -60, "count", 7u, "ok", true, "name", "a\"b\\c\nd\te");
+  WifiDev.flushLogs();
+  CHECK_EQ(allocations - before, 0);
+  std::string json = takeLine(jsonOut);
+  CHECK(JsonChecker(json).valid());
+  CHECK(contains(json, "{\"ts\":"));
+  CHECK(contains(json, "\"level\":\"info\""));
+  CHECK(contains(json, "\"msg\":\"sensor read\",\"temp\":21.5,\"rssi\":-60,\"count\":7,\"ok\":true,"
+                       "\"name\":\"a\\\"b\\\\c\\nd\\te\"}"));
+  CHECK(contains(takeLine(textOut), "sensor read temp=21.5 rssi=-60 count=7 ok=true"));
+
+  // Formatted messages are escaped, & the tag & level are given
+  before = allocations;
+  {
+    const char *dbgTAG = "Net";
+    DBG_WARNING("Path \"%s\" %d%%", "C:\\temp", 50);
+  }
+  WifiDev.flushLogs();
+  CHECK_EQ(allocations - before, 0);
+  json = takeLine(jsonOut);
+  CHECK(JsonChecker(json).valid());
+  CHECK(contains(json, "\"level\":\"warning\",\"tag\":\"Net\""));
+  CHECK(contains(json, "\"msg\":\"Path \\\"C:\\\\temp\\\" 50%\"}"));
+  CHECK(contains(takeLine(textOut), "Path \"C:\\temp\" 50%"));
+
+  // Control characters are escaped as \u00XX
+  DBG_ERROR("Bell\a");
+  json = takeLine(jsonOut);
+  CHECK(JsonChecker(json).valid());
+  CHECK(contains(json, "\"level\":\"error\""));
+  CHECK(contains(json, "Bell\\u0007"));
+  textOut.take();
+
+  // Fields that don't fit are left out whole, & the line is still valid
+  static std::string longText(maxLine / 3, 'x');
+  DBG_INFO_KV("long", "a", longText.c_str(), "b", longText.c_str(), "c", longText.c_str(), "d", 4);
+  json = takeLine(jsonOut);
+  CHECK(JsonChecker(json).valid());
+  CHECK(json.size() < maxLine);
+  CHECK(contains(json, "\"truncated\":true}"));
+  CHECK(json.find("\"d\":") == std::string::npos);
+  textOut.take();
+
+  // The checks do catch what they should
+  before = allocations;
+  WifiDev.setBacklog(1024);
+  CHECK(allocations > before);
+  WifiDev.setBacklog(0);
+  CHECK(!JsonChecker("{\"a\":1,}").valid());
+  CHECK(!JsonChecker("{\"a\":\"x\ny\"}").valid());
+  CHECK(!JsonChecker("{\"a\":1} x").valid());
+
+  return testResult("test_json");
+}
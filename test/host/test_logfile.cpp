@@ -0,0 +1,117 @@
+/* test_logfile.cpp - The log file sink writes whole sectors, flushes after its delay & rotates
+   (see setLogFile())
+
+   The file system stand-in is a temporary directory. Writes should end on MKWIFIDEV_FILE_BUFFER boundaries of the
+   file (including what was already in it), ERROR messages & the flush delay should write out the rest, and once
+   the file reaches maxSize it should be renamed to path.0 (path.0 to path.1 etc), keeping maxFiles old files. The
+   files should hold exactly what the serial port got.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+static CaptureStream serialOut;
+static std::string dir;
+
+// Returns the contents of a file in the log directory ("" if there isn't one)
+static std::string readFile(const char *path) {
+  std::ifstream f(dir + path, std::ios::binary);
+  std::stringstream s;
+  s << f.rdbuf();
+  return s.str();
+}
+
+static size_t fileSize(const char *path) {
+  return readFile(path).size();
+}
+
+static bool fileExists(const char *path) {
+  return std::filesystem::exists(dir + path);
+}
+
+// Writes are whole blocks, aligned to the start of the file
+static void checkAlignedWrites(fs::FS &fs) {
+  const std::string existing(100, '#');
+  std::ofstream(dir + "/log.txt", std::ios::binary) << existing << std::flush;
+
+  CHECK(WifiDev.setLogFile(fs, "/log.txt"));
+  WifiDev.setLogFileFlushDelay(100);
+  serialOut.take();
+  for(int i=0; i<60; i++) {
+    DBG_INFO("Sensor %d reading %d, state %s", i & 7, 1000 + i, "ok");
+    size_t size = fileSize("/log.txt");
+    CHECK(size == existing.size() || size % MKWIFIDEV_FILE_BUFFER == 0);
+  }
+  CHECK(fileSize("/log.txt") >= 2 * MKWIFIDEV_FILE_BUFFER);
+  CHECK(fileSize("/log.txt") < existing.size() + serialOut.text.size());
+
+  // The rest is written once the delay has passed
+  WifiDev.loop();
+  CHECK(fileSize("/log.txt") % MKWIFIDEV_FILE_BUFFER == 0);
+  hostAdvanceMillis(150);
+  WifiDev.loop();
+  CHECK_EQ(readFile("/log.txt"), existing + serialOut.text);
+
+  // Errors are written straight away
+  DBG_INFO("Before the error");
+  DBG_ERROR("Failed");
+  CHECK_EQ(readFile("/log.txt"), existing + serialOut.text);
+
+  // As is everything when the file is closed
+  DBG_INFO("Last message");
+  WifiDev.closeLogFile();
+  DBG_INFO("Not logged");
+  std::string logged = serialOut.take();
+  CHECK_EQ(readFile("/log.txt"), existing + logged.substr(0, logged.rfind('\n', logged.rfind("Not logged")) + 1));
+}
+
+// The file is rotated between messages once it reaches maxSize, keeping maxFiles old files
+static void checkRotation(fs::FS &fs) {
+  const uint32_t maxSize = 1000;
+  CHECK(WifiDev.setLogFile(fs, "/rot.txt", maxSize, 2));
+  serialOut.take();
+  for(int i=0; i<100; i++)
+    DBG_INFO("Sensor %d reading %d, state %s", i & 7, 1000 + i, "ok");
+  WifiDev.closeLogFile();
+  std::string logged = serialOut.take();
+
+  CHECK(fileExists("/rot.txt.0"));
+  CHECK(fileExists("/rot.txt.1"));
+  CHECK(!fileExists("/rot.txt.2"));
+  for(const char *path : { "/rot.txt.1", "/rot.txt.0" }) {
+    size_t size = fileSize(path);
+    CHECK(size >= maxSize && size < maxSize + 80);     // Less than one message over
+  }
+
+  // The files hold the most recent messages, whole & in order
+  std::string kept = readFile("/rot.txt.1") + readFile("/rot.txt.0") + readFile("/rot.txt");
+  CHECK(kept.size() < logged.size());
+  if(kept.size() < logged.size()) {
+    CHECK(logged.compare(logged.size() - kept.size(), kept.size(), kept) == 0);
+    CHECK_EQ(logged[logged.size() - kept.size() - 1], '\n');
+  }
+  CHECK_EQ(readFile("/rot.txt.0").back(), '\n');
+}
+
+int main() {
+  char tmp[] = "/tmp/mkwifidev_logXXXXXX";
+  CHECK(mkdtemp(tmp) != nullptr);
+  dir = tmp;
+  fs::FS fs(tmp);
+
+  WifiDev.setSerial(serialOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+  checkAlignedWrites(fs);
+  checkRotation(fs);
+
+  std::filesystem::remove_all(dir);
+  return testResult("test_logfile");
+}
@@ -0,0 +1,63 @@
+/* test_tags.cpp - Tag levels (see setTagLevel()) mute a tag's messages, however many other tags have logged
+
+   Only tags given a level take one of the MKWIFIDEV_MAX_TAGS slots, so logging from more tags than that mustn't
+   stop setTagLevel() working, and a level set after a tag has logged (and its pointer was cached) must apply.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+
+static CaptureStream out;
+
+// Logs a message with the given tag & returns whether it was output
+static bool logged(const char *dbgTAG, MkWifiDev::MessageType type) {
+  out.take();
+  if(type == MkWifiDev::INFO)
+    DBG_INFO("Message");
+  else
+    DBG_WARNING("Message");
+  return out.take().find("Message") != std::string::npos;
+}
+
+int main() {
+  WifiDev.setSerial(out);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+
+  // More tags log than can have levels
+  static char names[2*MKWIFIDEV_MAX_TAGS][8];
+  for(int i=0; i<2*MKWIFIDEV_MAX_TAGS; i++) {
+    snprintf(names[i], sizeof(names[i]), "Tag%d", i);
+    CHECK(logged(names[i], MkWifiDev::INFO));
+  }
+
+  // A tag which has already logged can still be given a level
+  CHECK(WifiDev.setTagLevel("Tag3", MkWifiDev::WARNING));
+  CHECK(!logged(names[3], MkWifiDev::INFO));
+  CHECK(logged(names[3], MkWifiDev::WARNING));
+  CHECK(logged(names[4], MkWifiDev::INFO));
+  CHECK_EQ(WifiDev.getTagLevel("Tag3"), MkWifiDev::WARNING);
+
+  // As can a new one, until MKWIFIDEV_MAX_TAGS have levels
+  CHECK(WifiDev.setTagLevel("New", MkWifiDev::WARNING));
+  CHECK(!logged("New", MkWifiDev::INFO));
+  for(int i=2; i<MKWIFIDEV_MAX_TAGS; i++)
+    CHECK(WifiDev.setTagLevel(names[10+i], MkWifiDev::WARNING));
+  CHECK(!WifiDev.setTagLevel("OneTooMany", MkWifiDev::WARNING));
+  CHECK(logged("OneTooMany", MkWifiDev::INFO));
+
+  // Levels can be changed back
+  CHECK(WifiDev.setTagLevel("Tag3", MkWifiDev::NORMAL));
+  CHECK(logged(names[3], MkWifiDev::INFO));
+
+  // Messages without a tag are always shown
+  out.take();
+  DBG_INFO("Untagged");
+  CHECK(out.take().find("Untagged") != std::string::npos);
+
+  return testResult("test_tags");
+}
@@ -0,0 +1,66 @@
+/* test_tcp.cpp - Remote terminal output is collected into full TCP segments & flushed after the flush delay
+
+   A terminal connects to the remote terminal server over the loopback interface. Messages logged in a burst should
+   be sent in blocks of as many whole lines as fit in MKWIFIDEV_TCP_BUFFER bytes, a message on its own only once
+   tcpFlushMs has passed, and the terminal should receive exactly the lines the serial port got.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+
+static CaptureStream serialOut;
+
+int main() {
+  WifiDev.setSerial(serialOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+  WifiDev.begin("ssid", "password", "host");
+  WiFi.setConnected(true);
+  WifiDev.loop();
+
+  int fd = connectTerminal();
+  waitForTerminal(fd);
+  serialOut.take();
+
+  // A burst of messages goes in full segments, apart from the last one
+  uint32_t segments0, bytes0, segments, bytes;
+  WifiDev.getTcpStats(segments0, bytes0);
+  for(int i=0; i<200; i++)
+    DBG_INFO("Sensor %d reading %d, state %s", i & 7, 1000 + i, "ok");
+  WifiDev.getTcpStats(segments, bytes);
+  uint32_t full = segments - segments0;
+  CHECK(full > 0);
+  CHECK(bytes - bytes0 <= full * MKWIFIDEV_TCP_BUFFER);
+  CHECK(bytes - bytes0 > full * (MKWIFIDEV_TCP_BUFFER - 64));     // Less at most one line each
+
+  // The rest waits for the flush delay
+  WifiDev.setTcpFlushDelay(50);
+  WifiDev.loop();
+  WifiDev.getTcpStats(segments, bytes);
+  CHECK_EQ(segments - segments0, full);
+  hostAdvanceMillis(60);
+  WifiDev.loop();
+  WifiDev.getTcpStats(segments, bytes);
+  CHECK_EQ(segments - segments0, full + 1);
+
+  std::string sent = serialOut.take();
+  std::string received = receive(fd);
+  CHECK_EQ(bytes - bytes0, (uint32_t)received.size());
+  CHECK_EQ(testLines(received).size(), (size_t)200);
+  CHECK(received == sent);
+
+  // A single message is sent on its own once the delay has passed
+  DBG_WARNING("Single message");
+  WifiDev.loop();
+  CHECK(receive(fd, 20).empty());
+  hostAdvanceMillis(60);
+  WifiDev.loop();
+  CHECK_EQ(testMessage(receive(fd)), testMessage(serialOut.take()));
+
+  close(fd);
+  return testResult("test_tcp");
+}
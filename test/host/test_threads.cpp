@@ -0,0 +1,144 @@
+/* test_threads.cpp - Messages logged from several tasks at once come out as whole lines on every output
+
+   Four threads log messages, one logs chunked hex dumps (finished by loop()) & one keeps calling flushLogs() &
+   switching asynchronous logging off & on again, while the main thread runs loop() with a remote terminal
+   connected. Every line of the serial port & log file must be one that was logged, each message exactly once & in
+   order. Build with -DMKWIFIDEV_SANITIZE=thread to also check for data races.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+#include <atomic>
+#include <map>
+#include <set>
+#include <thread>
+
+static CaptureStream serialOut, fileOut;
+static const int loggers = 4, messages = 400, dumps = 40;
+static uint8_t dumpData[200];
+
+// The text of a message, without its timestamp (which is " : " terminated)
+static std::string withoutTime(const std::string &line) {
+  size_t pos = line.find(" : ");
+  return (pos != std::string::npos && pos < 16 && isdigit((uint8_t)line[0])) ? line.substr(pos + 3) : line;
+}
+
+static std::string messageText(int thread, int n) {
+  char text[80];
+  snprintf(text, sizeof(text), "Thread %d message %d %.*s", thread, n, 10 + n % 20, "abcdefghijklmnopqrstuvwxyz0123");
+  return text;
+}
+
+// Checks every line is one that was logged (or a notice from the library) & each message is there once, in order
+static void checkLines(const char *name, const std::string &output, const std::set<std::string> &dumpLines) {
+  std::map<std::string, std::pair<int, int>> logged;
+  for(int t=0; t<loggers; t++)
+    for(int i=0; i<messages; i++)
+      logged[messageText(t, i)] = { t, i };
+
+  int next[loggers] = {}, nDumps = 0, unknown = 0;
+  for(auto &line : testLines(output)) {
+    std::string text = withoutTime(line);
+    auto it = logged.find(text);
+    if(it != logged.end()) {
+      int t = it->second.first;
+      CHECK_EQ(it->second.second, next[t]);
+      next[t] = it->second.second + 1;
+    } else if(text == "Dump")
+      nDumps++;
+    else if(!dumpLines.count(text) && text.find("Client connected") == std::string::npos && unknown++ < 5)
+      fprintf(stderr, "%s: unexpected line [%s]\n", name, line.c_str());
+  }
+  CHECK_EQ(unknown, 0);
+  CHECK_EQ(nDumps, dumps);
+  for(int t=0; t<loggers; t++)
+    CHECK_EQ(next[t], messages);
+}
+
+int main() {
+  for(size_t i=0; i<sizeof(dumpData); i++)
+    dumpData[i] = i * 7;
+
+  WifiDev.setSerial(serialOut);
+  WifiDev.setLogFile(fileOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+  WifiDev.begin("ssid", "password", "host");
+  WiFi.setConnected(true);
+  WifiDev.loop();
+  int fd = connectTerminal();
+  waitForTerminal(fd);
+
+  // The lines of a dump, to recognise them later
+  DBG_HEXDUMP("Dump", dumpData, sizeof(dumpData), MkWifiDev::INFO);
+  WifiDev.flushLogs();
+  std::set<std::string> dumpLines;
+  for(auto &line : testLines(serialOut.take()))
+    dumpLines.insert(withoutTime(line));
+  fileOut.take();
+
+  CHECK(WifiDev.setAsyncLogging(1 << 20));
+
+  // The terminal's output is read as it comes, so it isn't held up
+  std::atomic<bool> done{false};
+  std::string termOutput;
+  std::thread reader([&] {
+    while(!done)
+      termOutput += receive(fd, 10);
+    termOutput += receive(fd, 50);
+  });
+
+  std::atomic<int> running{loggers + 1};
+  std::vector<std::thread> threads;
+  for(int t=0; t<loggers; t++)
+    threads.emplace_back([t, &running] {
+      for(int i=0; i<messages; i++)
+        DBG_INFO("%s", messageText(t, i).c_str());
+      running--;
+    });
+  threads.emplace_back([&running] {
+    for(int i=0; i<dumps; i++)
+      DBG_HEXDUMP_CHUNKED("Dump", dumpData, sizeof(dumpData), MkWifiDev::INFO);
+    running--;
+  });
+  std::thread flusher([&running] {
+    for(int n=1; running; n++) {
+      WifiDev.flushLogs();
+      WifiDev.setAsyncLogging((n % 2) ? 0 : 1 << 20);
+    }
+  });
+
+  while(running) {
+    WifiDev.loop();
+    hostAdvanceMillis(5);
+  }
+  for(auto &t : threads)
+    t.join();
+  flusher.join();
+  for(int i=0; i<10; i++) {       // Finish the last chunked dump
+    WifiDev.loop();
+    hostAdvanceMillis(5);
+  }
+  WifiDev.flushLogs();
+  done = true;
+  reader.join();
+
+  checkLines("serial", serialOut.take(), dumpLines);
+  checkLines("file", fileOut.take(), dumpLines);
+
+  // The terminal may drop whole lines if it falls behind, but mustn't get parts of them
+  int torn = 0;
+  for(auto &line : testLines(termOutput)) {
+    std::string text = withoutTime(line);
+    if(text.find("Thread") != std::string::npos && text.rfind("Thread") != 0 && torn++ < 5)
+      fprintf(stderr, "terminal: torn line [%s]\n", line.c_str());
+  }
+  CHECK_EQ(torn, 0);
+
+  close(fd);
+  return testResult("test_threads");
+}
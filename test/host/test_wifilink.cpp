@@ -0,0 +1,167 @@
+/* test_wifilink.cpp - The WiFi connection is followed from its events & lost connections are retried with backoff
+   (see MkWifiLink)
+
+   MkWifiLink is driven with simulated times: attempts are made minWait after begin(), then straight away after the
+   connection is lost & at doubling intervals up to maxWait, and a connection lost & regained between two polls must
+   still be reported as DOWN then UP. The library is then run with the WiFi stand-in, which must set up the server &
+   OTA only once, not poll WiFi.status() while connected, & count the reconnects in the network stats.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+*/
+
+#include "host_test.h"
+#include <ArduinoOTA.h>
+
+static CaptureStream serialOut;
+
+static int count(const std::string &s, const char *part) {
+  int n = 0;
+  for(size_t pos = 0; (pos = s.find(part, pos)) != std::string::npos; pos++)
+    n++;
+  return n;
+}
+
+static void checkLink() {
+  const uint32_t minWait = 4000, maxWait = 60000;
+  MkWifiLink link(minWait, maxWait);
+  CHECK(link.isQuiet());
+  CHECK_EQ(link.poll(0), MkWifiLink::NONE);
+
+  // The first connection, with begin() as the first attempt
+  uint32_t t = 1000;
+  link.begin(t);
+  CHECK(!link.isQuiet());
+  CHECK_EQ(link.poll(t + minWait - 1), MkWifiLink::NONE);
+  CHECK_EQ(link.poll(t + minWait), MkWifiLink::RETRY);
+  CHECK_EQ(link.getAttempt(), 1u);
+  CHECK_EQ(link.getRetryIn(t + minWait), 2*minWait);
+  link.event(true);
+  CHECK_EQ(link.poll(t + 6000), MkWifiLink::UP);
+  CHECK(link.isConnected() && link.isQuiet());
+  CHECK_EQ(link.firstMs, 6000u);
+  CHECK_EQ(link.connects, 1u);
+  CHECK_EQ(link.reconnects, 0u);
+
+  // Once lost, the first attempt is straight away, then the wait doubles up to maxWait
+  link.event(false);
+  CHECK(!link.isQuiet());
+  t = 20000;
+  CHECK_EQ(link.poll(t), MkWifiLink::DOWN);
+  CHECK_EQ(link.getState(), MkWifiLink::RECONNECTING);
+  uint32_t attempts0 = link.attempts;
+  for(uint32_t wait : { 0u, 4000u, 8000u, 16000u, 32000u, 60000u, 60000u }) {
+    t += wait;
+    if(wait)
+      CHECK_EQ(link.poll(t - 1), MkWifiLink::NONE);
+    CHECK_EQ(link.poll(t), MkWifiLink::RETRY);
+  }
+  CHECK_EQ(link.getAttempt(), 7u);
+  CHECK_EQ(link.attempts - attempts0, 7u);
+  CHECK_EQ(link.getDownFor(t), t - 20000);
+  link.event(true);
+  CHECK_EQ(link.poll(t + 500), MkWifiLink::UP);
+  uint32_t first = t + 500 - 20000;
+  CHECK_EQ(link.reconnects, 1u);
+  CHECK_EQ(link.lastMs, first);
+  CHECK_EQ(link.maxMs, first);
+
+  // Lost & back again before poll() is still a reconnect, which takes as long as it's seen to
+  link.event(false);
+  link.event(true);
+  CHECK_EQ(link.poll(300000), MkWifiLink::DOWN);
+  CHECK_EQ(link.poll(300010), MkWifiLink::UP);
+  CHECK_EQ(link.reconnects, 2u);
+  CHECK_EQ(link.connects, 3u);
+  CHECK_EQ(link.lastMs, 10u);
+  CHECK_EQ(link.maxMs, first);
+  CHECK_EQ(link.totalMs, first + 10);
+
+  // Back & lost again before poll() while reconnecting isn't a connection
+  link.event(false);
+  CHECK_EQ(link.poll(400000), MkWifiLink::DOWN);
+  link.event(true);
+  link.event(false);
+  CHECK_EQ(link.poll(400001), MkWifiLink::RETRY);
+  CHECK(!link.isConnected());
+
+  // Across millis() wrapping round
+  MkWifiLink wrap(minWait, maxWait);
+  wrap.begin(0xFFFFF000u);
+  CHECK_EQ(wrap.poll(0xFFFFF000u + minWait - 1), MkWifiLink::NONE);
+  CHECK_EQ(wrap.poll(0xFFFFF000u + minWait), MkWifiLink::RETRY);
+  CHECK_EQ(wrap.getRetryIn(0xFFFFF000u + minWait), 2*minWait);
+}
+
+// Runs loop() for ms of simulated time, in steps
+static void run(uint32_t ms) {
+  for(uint32_t i=0; i<ms; i+=100) {
+    WifiDev.loop();
+    hostAdvanceMillis(100);
+  }
+  WifiDev.loop();
+}
+
+static void checkLibrary() {
+  WifiDev.setSerial(serialOut);
+  WifiDev.clearDisplayModeFlags(MkWifiDev::SHOW_COLOUR);
+  WifiDev.begin("ssid", "password", "host");
+  run(500);
+  WiFi.setConnected(true);
+  WifiDev.loop();
+  std::string out = serialOut.take();
+  CHECK_EQ(count(out, "Wifi Ready"), 1);
+  CHECK_EQ(count(out, "Press Ctrl-A"), 1);
+  CHECK_EQ(ArduinoOTA.begins, 1u);
+
+  // Nothing is asked of the WiFi while connected
+  uint32_t statusCalls = WiFi.statusCalls;
+  run(10000);
+  CHECK_EQ(WiFi.statusCalls, statusCalls);
+
+  // Reconnect attempts at 0, 4, 12 & 28 s
+  for(int cycle=0; cycle<2; cycle++) {
+    WiFi.setConnected(false);
+    uint32_t reconnects = WiFi.reconnects;
+    run(30000);
+    CHECK_EQ(WiFi.reconnects - reconnects, 4u);
+    WiFi.setConnected(true);
+    WifiDev.loop();
+  }
+
+  // Lost & regained between loop() calls
+  WiFi.setConnected(false);
+  WiFi.setConnected(true);
+  WifiDev.loop();
+  WifiDev.loop();
+  out = serialOut.take();
+  CHECK_EQ(count(out, "Lost WiFi"), 3);
+  CHECK_EQ(count(out, "WiFi reconnected"), 3);
+  CHECK_EQ(count(out, "Wifi Ready"), 0);
+  CHECK_EQ(ArduinoOTA.begins, 1u);
+
+  // The remote terminal server is listening again
+  int fd = connectTerminal();
+  waitForTerminal(fd);
+  close(fd);
+  serialOut.take();
+
+  // Shown by Command Mode 'n'
+  serialOut.input = "\x01n";
+  WifiDev.loop();
+  WifiDev.loop();
+  out = serialOut.take();
+  CHECK(out.find("3 reconnects (8 attempts)") != std::string::npos);
+  CHECK(out.find(" s, average ") != std::string::npos);
+  serialOut.input = "\x01";
+  WifiDev.loop();
+}
+
+int main() {
+  checkLink();
+  checkLibrary();
+  return testResult("test_wifilink");
+}
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""benchreport.py - Tabulates the results of the MkWifiDev benchmark & compares them with a baseline
+
+   The examples/benchmark sketch prints one JSON line per measurement. This tool collects them (from a
+   serial port, capture file or stdin), prints a table and optionally saves them as a baseline. When a
+   baseline is given each result is compared with it, and the exit status is 1 if any has slowed down
+   by more than the threshold (or a stack high-water mark has grown by more than it), so it can be used
+   to check for regressions between releases:
+     python3 tools/benchreport.py /dev/ttyUSB0 --save baseline.jsonl
+     python3 tools/benchreport.py /dev/ttyUSB0 --baseline baseline.jsonl --threshold 5
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+"""
+
+import argparse
+import json
+import os
+import sys
+
+
+def read_lines(name):
+    """Yields lines from a file, stdin or serial port, stopping at the benchmark's 'done' line"""
+    if name == "-":
+        yield from sys.stdin
+    elif os.path.exists(name) and not name.startswith("/dev/"):
+        with open(name) as f:
+            yield from f
+    else:
+        import serial           # pyserial (installed with PlatformIO)
+        port = serial.Serial(name, 115200, timeout=120)
+        while True:
+            line = port.readline()
+            if not line:
+                raise SystemExit("Timed out waiting for benchmark results (reset the device to restart them)")
+            yield line.decode("utf-8", "replace")
+
+
+def collect(name):
+    info, results = {}, {}
+    for line in read_lines(name):
+        line = line.strip()
+        if not line.startswith("{"):
+            continue        # Boot messages etc
+        try:
+            rec = json.loads(line)
+        except ValueError:
+            continue
+        bench = rec.get("bench")
+        if bench == "info":
+            info, results = rec, {}     # Device restarted, start again
+        elif bench == "done":
+            break
+        elif bench:
+            results[(bench, rec["case"])] = rec
+    return info, results
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Report & compare MkWifiDev benchmark results")
+    parser.add_argument("input", nargs="?", default="-", help="serial port, capture file or - for stdin")
+    parser.add_argument("--baseline", help="results file to compare with (as written by --save)")
+    parser.add_argument("--save", help="write the results to this file")
+    parser.add_argument("--threshold", type=float, default=10,
+                        help="%% slower (or more stack) than baseline reported as a regression")
+    parser.add_argument("--csv", action="store_true", help="machine readable output")
+    opts = parser.parse_args()
+
+    info, results = collect(opts.input)
+    if not results:
+        raise SystemExit("No benchmark results found")
+
+    if opts.save:
+        with open(opts.save, "w") as f:
+            for rec in [info] + list(results.values()):
+                if rec:
+                    f.write(json.dumps(rec) + "\n")
+
+    base = collect(opts.baseline)[1] if opts.baseline else {}
+    if info:
+        sys.stderr.write("%s @ %dMHz\n" % (info.get("chip", "?"), info.get("cpu_mhz", 0)))
+
+    if opts.csv:
+        print("bench,case,ns,per_s,baseline_ns,change_pct")
+    else:
+        print("%-10s %-22s %10s %12s %12s %8s" % ("Bench", "Case", "ns", "per sec", "baseline ns", "change"))
+
+    regressions = 0
+    for (bench, case), rec in results.items():
+        # Stack results are a high-water mark in bytes, shown in the ns column & compared the same way
+        key = "bytes" if bench == "stack" else "ns"
+        ns = rec[key]
+        per_s = rec.get("per_s", 0)
+        old = base.get((bench, case), {}).get(key)
+        change = (ns - old) * 100.0 / old if old else None
+        flag = ""
+        if change is not None and change > opts.threshold:
+            regressions += 1
+            flag = "  <-- more stack" if bench == "stack" else "  <-- slower"
+        if opts.csv:
+            print("%s,%s,%d,%d,%s,%s" % (bench, case, ns, per_s, old if old else "",
+                                          "%.1f" % change if change is not None else ""))
+        else:
+            print("%-10s %-22s %10d %12s %12s %8s%s" % (bench, case, ns, per_s if per_s else "-", old if old else "-",
+                                                      "%+.1f%%" % change if change is not None else "-", flag))
+
+    if regressions:
+        sys.stderr.write("%d result(s) more than %g%% worse than the baseline\n" % (regressions, opts.threshold))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
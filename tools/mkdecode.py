@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""mkdecode.py - Decodes MkWifiDev binary log records into coloured terminal text
+
+   When binary logging is enabled (WifiDev.setBinaryLogging(true)) each DBG_xxx message is sent as a
+   compact record holding the address of its format string and the raw argument values. This tool
+   looks the strings up in the firmware .elf file and formats the message the same way the device
+   would. Any text outside of records (eg Command Mode, hex dumps) is passed through unchanged.
+
+   With --src, the file IDs shown by DEBUG_SHOW_FILE_ID (eg "@1a0a:42") are replaced by the names of the source files
+   they belong to, found under the given folders, in binary records & text alike.
+
+   Usage examples:
+     python3 tools/mkdecode.py .pio/build/esp32dev/firmware.elf ESP32-1:23
+     python3 tools/mkdecode.py --ms --type firmware.elf /dev/ttyUSB0
+     python3 tools/mkdecode.py firmware.elf captured.bin
+     python3 tools/mkdecode.py --src src --src .pio/libdeps firmware.elf ESP32-1:23
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+"""
+
+import argparse
+import os
+import re
+import socket
+import struct
+import sys
+import time
+
+RECORD_MARK = 0x1E
+COLOURS = [37, 36, 32, 94, 33, 35, 31, 91]      # Same order as colors[] in MkWifiDev.cpp
+TYPE_CHARS = " VDIWAEC"
+OVERRIDE = 128
+RAW_NO_TS = 8
+
+# Argument sizes on the ESP8266/ESP32 (32 bit int, long and pointers)
+SPEC_RE = re.compile(rb"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+)?)?(hh|h|ll|l|L|j|z|t)?([diouxXcsfFeEgGaApn%])")
+INT_SIZES = {b"ll": 8, b"j": 8}
+FILE_ID_RE = re.compile(rb"@([0-9a-f]{4}):(\d+)")
+SOURCE_EXTS = (".c", ".cc", ".cpp", ".h", ".hpp", ".ino")
+
+
+class ElfStrings:
+    """Reads null terminated strings from the loadable sections of an ELF file"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            fmt = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            fmt = endian + "IIIIII"
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from(fmt, self.data, shoff + i * shentsize)
+            if sh_type == 1 and addr:           # SHT_PROGBITS, loaded at a run-time address
+                self.sections.append((addr, offset, size))
+        self.cache = {}
+
+    def string(self, addr):
+        if addr in self.cache:
+            return self.cache[addr]
+        result = None
+        for start, offset, size in self.sections:
+            if start <= addr < start + size:
+                pos = offset + addr - start
+                end = self.data.find(b"\0", pos, offset + size)
+                result = self.data[pos:end if end >= 0 else offset + size]
+                break
+        self.cache[addr] = result
+        return result
+
+
+def file_id(name):
+    """Same as mkFileId() in MkWifiDev.h, a 32 bit FNV-1a hash of the file name folded to 16 bits"""
+    h = 2166136261
+    for c in name.encode():
+        h = (h ^ c) * 16777619 & 0xFFFFFFFF
+    return (h >> 16) ^ (h & 0xFFFF)
+
+
+class SourceIds:
+    """Expands DEBUG_SHOW_FILE_ID file IDs into the names of the source files with those IDs"""
+
+    def __init__(self, folders):
+        self.names = {}
+        for folder in folders:
+            for _, _, files in os.walk(folder):
+                for name in files:
+                    if name.endswith(SOURCE_EXTS):
+                        self.names.setdefault(file_id(name), set()).add(name)
+        self.held = b""
+
+    def expand(self, data):
+        def name(m):
+            names = self.names.get(int(m.group(1), 16))
+            return "|".join(sorted(names)).encode() + b":" + m.group(2) if names else m.group(0)
+        return FILE_ID_RE.sub(name, data)
+
+    def text(self, data):
+        """As expand(), but an ID may be split between reads, so anything from an "@" without a space after it waits"""
+        data = self.held + data
+        at = data.rfind(b"@")
+        if at >= 0 and not re.search(rb"[ \r\n]", data[at:]):
+            data, self.held = data[:at], data[at:]
+        else:
+            self.held = b""
+        return self.expand(data)
+
+    def flush(self):
+        data, self.held = self.held, b""
+        return self.expand(data)
+
+
+def format_message(fmt, args):
+    """Formats the message using printf rules, taking raw argument values from args"""
+    out = []
+    pos = 0
+    state = {"ofs": 0}
+
+    def take(n, code):
+        if state["ofs"] + n > len(args):
+            raise IndexError
+        value, = struct.unpack_from("<" + code, args, state["ofs"])
+        state["ofs"] += n
+        return value
+
+    def take_str():
+        end = args.find(b"\0", state["ofs"])
+        if end < 0:
+            raise IndexError
+        value = args[state["ofs"]:end]
+        state["ofs"] = end + 1
+        return value.decode("utf-8", "replace")
+
+    for m in SPEC_RE.finditer(fmt):
+        out.append(fmt[pos:m.start()].decode("utf-8", "replace"))
+        pos = m.end()
+        flags, width, prec, length, conv = m.groups()
+        conv = conv.decode()
+        if conv == "%":
+            out.append("%")
+            continue
+        try:
+            spec = "%" + flags.decode()
+            if width == b"*":
+                spec += str(take(4, "i"))
+            elif width:
+                spec += width.decode()
+            if prec == b"*":
+                spec += "." + str(take(4, "i"))
+            elif prec is not None:
+                spec += "." + prec.decode()
+            elif m.group(0).find(b".") >= 0:
+                spec += ".0"
+
+            if conv in "diouxXc":
+                size = INT_SIZES.get(length, 4)
+                signed = conv in "di"
+                value = take(size, {4: "i", 8: "q"}[size] if signed else {4: "I", 8: "Q"}[size])
+                if conv == "c":
+                    out.append((spec + "c") % chr(value & 0xFF))
+                else:
+                    out.append((spec + {"i": "d", "u": "d"}.get(conv, conv)) % value)
+            elif conv in "fFeEgGaA":
+                value = take(8, "d")
+                out.append(value.hex() if conv in "aA" else (spec + conv) % value)
+            elif conv == "s":
+                out.append((spec + "s") % take_str())
+            elif conv == "p":
+                out.append("0x%x" % take(4, "I"))
+        except IndexError:
+            out.append("<?>")     # Record was truncated on the device
+    out.append(fmt[pos:].decode("utf-8", "replace"))
+    return "".join(out)
+
+
+class Decoder:
+    def __init__(self, elf, opts):
+        self.elf = elf
+        self.opts = opts
+        self.src = SourceIds(opts.src) if opts.src else None
+
+    def record(self, rec):
+        mtype, sec, msec, fmt_addr, tag_addr = struct.unpack_from("<BIHII", rec, 0)
+        fmt = self.elf.string(fmt_addr)
+        if fmt is None:
+            return "<unknown format @0x%08X>" % fmt_addr
+        text = format_message(fmt, rec[15:]).rstrip("\n")
+        if self.src:
+            text = self.src.expand(text.encode()).decode("utf-8", "replace")
+
+        line = ""
+        colour = self.opts.colour and mtype != RAW_NO_TS
+        if colour:
+            line += "\033[%dm" % ((mtype & 0x7F) if mtype & OVERRIDE else COLOURS[mtype & 7])
+        if self.opts.timestamps and mtype != RAW_NO_TS:
+            clock_set = sec > 50 * 365 * 24 * 3600
+            t = time.localtime(sec) if clock_set else time.gmtime(sec)
+            line += time.strftime("%Y/%m/%d %H:%M:%S" if self.opts.date else "%H:%M:%S", t)
+            if self.opts.ms:
+                line += ".%03d" % msec
+            line += " : "
+        if tag_addr:
+            tag = self.elf.string(tag_addr)
+            line += (tag.decode("utf-8", "replace") if tag is not None else "<tag @0x%08X>" % tag_addr) + " : "
+        if self.opts.type and not (mtype & OVERRIDE) and mtype & 7:
+            line += "[%c]" % TYPE_CHARS[mtype & 7]
+        line += text
+        if colour:
+            line += "\033[0m"
+        return line + "\r\n"
+
+    def run(self, read, write):
+        def text(data):
+            write(self.src.text(data) if self.src else data)
+
+        buf = b""
+        while True:
+            data = read()
+            if not data:
+                break
+            buf += data
+            while buf:
+                mark = buf.find(bytes([RECORD_MARK]))
+                if mark < 0:
+                    text(buf)
+                    buf = b""
+                    break
+                if mark:
+                    text(buf[:mark])
+                    buf = buf[mark:]
+                if len(buf) < 2 or len(buf) < 2 + buf[1]:
+                    break           # Wait for the rest of the record
+                if self.src:
+                    write(self.src.flush())
+                write(self.record(buf[2:2 + buf[1]]).encode())
+                buf = buf[2 + buf[1]:]
+        if self.src:
+            write(self.src.flush())
+
+
+def open_input(name):
+    if name == "-":
+        return lambda: sys.stdin.buffer.read1(4096)
+    if os.path.exists(name) and not name.startswith("/dev/"):
+        f = open(name, "rb")
+        return lambda: f.read(4096)
+    if name.startswith("/dev/") or name.upper().startswith("COM"):
+        import serial           # pyserial (installed with PlatformIO)
+        port = serial.Serial(name, 115200)
+        return lambda: port.read(max(1, port.in_waiting))
+    host, _, port = name.rpartition(":")
+    sock = socket.create_connection((host or name, int(port) if host else 23))
+    return lambda: sock.recv(4096)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode MkWifiDev binary log records")
+    parser.add_argument("elf", help="firmware .elf file that produced the log")
+    parser.add_argument("input", nargs="?", default="-",
+                        help="host:port (eg ESP32-1:23), serial port, capture file or - for stdin")
+    parser.add_argument("--no-colour", dest="colour", action="store_false", help="disable message colouring")
+    parser.add_argument("--no-timestamps", dest="timestamps", action="store_false", help="hide timestamps")
+    parser.add_argument("--ms", action="store_true", help="show milliseconds in timestamps")
+    parser.add_argument("--date", action="store_true", help="show date in timestamps")
+    parser.add_argument("--type", action="store_true", help="show message type, eg [E]")
+    parser.add_argument("--src", action="append", metavar="FOLDER",
+                        help="expand DEBUG_SHOW_FILE_ID file IDs using the source files under FOLDER (may be repeated)")
+    opts = parser.parse_args()
+
+    decoder = Decoder(ElfStrings(opts.elf), opts)
+    out = sys.stdout.buffer
+
+    def write(data):
+        out.write(data)
+        out.flush()
+
+    try:
+        decoder.run(open_input(opts.input), write)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+"""mkzcat.py - Connects to a MkWifiDev remote terminal with compressed output
+
+   The remote terminal port (23) normally sends plain text. A client that sends the request below as soon as it
+   connects gets the same output compressed with a small LZ77 compressor, typically to a quarter of the size or less
+   as it's mostly repeated colour codes, timestamps & message text. This tool makes the request, decompresses the
+   output to the terminal and sends key presses to the device (Ctrl-A for Command Mode, Ctrl-] to quit). If the
+   device doesn't accept the request, eg older firmware, the output is shown as it is.
+
+   It can also decompress a capture of a compressed stream, or measure the compression of a captured (plain) log:
+     python3 tools/mkzcat.py ESP32-1                          # Port 23
+     python3 tools/mkzcat.py ESP32-1:23 | python3 tools/mkdecode.py firmware.elf -
+     python3 tools/mkzcat.py --bench captured.log
+
+   Format, each token is one of:
+     0x00-0x7F          Literal run, the next n+1 bytes are copied
+     1LLLLDDD DDDDDDDD  Copy L+3 bytes from D+1 bytes back. L=15 is followed by a byte giving the length-18
+   The device ends each block it sends on a whole token, so everything received can be decoded at once.
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+"""
+
+import argparse
+import os
+import select
+import socket
+import sys
+import time
+
+HELLO = b"\x1bMKZ1"         # Request for compressed output, sent back by the device if accepted
+MAX_DIST = 2048
+MIN_MATCH = 3
+MAX_MATCH = 18 + 255
+QUIT_KEY = b"\x1d"          # Ctrl-]
+
+
+class Decompressor:
+    """Decodes the stream in pieces of any size, keeping the history that later copies refer to"""
+
+    def __init__(self):
+        self.history = bytearray()
+        self.pending = b""      # Incomplete token
+
+    def feed(self, data):
+        data = self.pending + data
+        out = self.history
+        start = len(out)
+        i = 0
+        while i < len(data):
+            c = data[i]
+            if c < 0x80:
+                if i + 1 + c + 1 > len(data):
+                    break
+                out += data[i + 1:i + c + 2]
+                i += c + 2
+                continue
+            length = (c >> 3 & 15) + MIN_MATCH
+            size = 3 if length == 18 else 2
+            if i + size > len(data):
+                break
+            dist = ((c & 7) << 8 | data[i + 1]) + 1
+            if size == 3:
+                length += data[i + 2]
+            if dist > len(out):
+                raise ValueError("Corrupt stream, copy from %d bytes back with %d decoded" % (dist, len(out)))
+            for _ in range(length):          # May overlap the bytes being added
+                out.append(out[-dist])
+            i += size
+        self.pending = data[i:]
+        result = bytes(out[start:])
+        del out[:-MAX_DIST]
+        return result
+
+
+class Compressor:
+    """Same as MkLzStream on the device (& gives the same output), used to measure the compression of captured logs"""
+
+    HASH_BITS = 10
+
+    def __init__(self, window=MAX_DIST, chain=4):
+        self.window = window
+        self.chain = chain
+        self.data = bytearray()
+        self.head = {}          # Latest position with each hash
+        self.prev = {}          # Previous position with the same hash as each one
+
+    def hash(self, at):
+        d = self.data
+        return ((d[at] << 16 | d[at + 1] << 8 | d[at + 2]) * 2654435761 & 0xFFFFFFFF) >> (32 - self.HASH_BITS)
+
+    def insert(self, at):
+        h = self.hash(at)
+        if self.chain > 1:
+            self.prev[at] = self.head.get(h)
+        self.head[h] = at
+
+    def compress(self, block):
+        data = self.data
+        pos = len(data)
+        data += block
+        end = len(data)
+        out = bytearray()
+        literals = pos
+        while pos < end:
+            best = dist = 0
+            if end - pos >= MIN_MATCH:
+                max_len = min(end - pos, MAX_MATCH)
+                cand = self.head.get(self.hash(pos))
+                tries = self.chain
+                while cand is not None and tries and pos - cand <= self.window:
+                    n = 0
+                    while n < max_len and data[cand + n] == data[pos + n]:
+                        n += 1
+                    if n > best:
+                        best, dist = n, pos - cand
+                        if n == max_len:
+                            break
+                    cand = self.prev.get(cand)
+                    tries -= 1
+                self.insert(pos)
+            if best < MIN_MATCH:
+                pos += 1
+                continue
+            out += literal_runs(data[literals:pos])
+            l = best - MIN_MATCH
+            out.append(0x80 | min(l, 15) << 3 | (dist - 1) >> 8)
+            out.append((dist - 1) & 255)
+            if l >= 15:
+                out.append(l - 15)
+            for i in range(pos + 1, pos + best):
+                if end - i >= MIN_MATCH:
+                    self.insert(i)
+            pos += best
+            literals = pos
+        out += literal_runs(data[literals:end])
+        return bytes(out)
+
+
+def literal_runs(data):
+    out = bytearray()
+    for i in range(0, len(data), 128):
+        run = data[i:i + 128]
+        out.append(len(run) - 1)
+        out += run
+    return out
+
+
+def bench(path, block):
+    with open(path, "rb") as f:
+        data = f.read()
+    if not data:
+        raise SystemExit("%s is empty" % path)
+    print("%s: %d bytes in %d byte blocks" % (path, len(data), block))
+    print("%-8s %-6s %10s %8s %12s" % ("Window", "Chain", "Bytes", "Ratio", "Host us/KB"))
+    for window, chain in ((1024, 1), (1024, 4), (2048, 1), (2048, 4), (2048, 16)):
+        comp, dec = Compressor(window, chain), Decompressor()
+        size, decoded = 0, bytearray()
+        t = time.perf_counter()
+        for i in range(0, len(data), block):
+            z = comp.compress(data[i:i + block])
+            size += len(z)
+            decoded += dec.feed(z)
+        us = (time.perf_counter() - t) * 1e6
+        if decoded != data:
+            raise SystemExit("Decompressed data doesn't match with window %d chain %d" % (window, chain))
+        print("%-8d %-6d %10d %7.2f:1 %12.0f" % (window, chain, size, len(data) / size, us * 1024 / len(data)))
+    print("The defaults are window 1024 chain 1 on the ESP8266, 2048 & 4 on the ESP32 (the device's time per KB is "
+          "shown by 'n' in Command Mode)")
+
+
+class RawKeys:
+    """Puts a terminal on stdin into raw mode, so each key is sent to the device as it's pressed"""
+
+    def __init__(self):
+        self.saved = None
+        if os.name == "posix" and sys.stdin.isatty():
+            import termios
+            import tty
+            self.saved = termios.tcgetattr(sys.stdin)
+            tty.setraw(sys.stdin)
+
+    def restore(self):
+        if self.saved:
+            import termios
+            termios.tcsetattr(sys.stdin, termios.TCSADRAIN, self.saved)
+
+
+def connect(name, write):
+    host, _, port = name.rpartition(":")
+    sock = socket.create_connection((host or name, int(port) if host else 23))
+    sock.sendall(HELLO)
+
+    # The reply comes before the welcome message. Anything else is plain text
+    reply = b""
+    while len(reply) < len(HELLO) and HELLO.startswith(reply):
+        data = sock.recv(len(HELLO) - len(reply))
+        if not data:
+            break
+        reply += data
+    decoder = Decompressor() if reply == HELLO else None
+    if not decoder:
+        sys.stderr.write("Device didn't accept compression, output is uncompressed\r\n")
+        write(reply)
+
+    keys = RawKeys()
+    received = shown = 0
+    try:
+        inputs = [sock, sys.stdin] if keys.saved else [sock]
+        while True:
+            ready = select.select(inputs, [], [])[0]
+            if sys.stdin in ready:
+                key = os.read(sys.stdin.fileno(), 64)
+                if QUIT_KEY in key:
+                    break
+                sock.sendall(key)
+            if sock in ready:
+                data = sock.recv(4096)
+                if not data:
+                    break
+                received += len(data)
+                data = decoder.feed(data) if decoder else data
+                shown += len(data)
+                write(data)
+    finally:
+        keys.restore()
+        sock.close()
+    if decoder and received:
+        sys.stderr.write("\r\nReceived %d bytes for %d (%.1f:1)\r\n" % (received, shown, shown / received))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Show compressed MkWifiDev remote terminal output")
+    parser.add_argument("input", help="host[:port] (eg ESP32-1:23), compressed capture file, or captured log for --bench")
+    parser.add_argument("--bench", action="store_true", help="measure the compression of a captured (plain) log")
+    parser.add_argument("--block", type=int, default=536, help="block size for --bench (MKWIFIDEV_TCP_BUFFER)")
+    opts = parser.parse_args()
+
+    if opts.bench:
+        bench(opts.input, opts.block)
+        return
+
+    out = sys.stdout.buffer
+
+    def write(data):
+        out.write(data)
+        out.flush()
+
+    try:
+        if os.path.exists(opts.input):
+            with open(opts.input, "rb") as f:
+                data = f.read()
+            write(Decompressor().feed(data[len(HELLO):] if data.startswith(HELLO) else data))
+        else:
+            connect(opts.input, write)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
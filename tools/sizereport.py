@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""sizereport.py - Compares firmware flash & RAM usage for each MKWIFIDEV_MIN_LEVEL setting
+
+   Builds an example with PlatformIO once per level and prints a table of the flash and RAM used,
+   along with the saving compared to a build containing all log messages. Run from the library
+   root (where platformio.ini is), for example:
+     python3 tools/sizereport.py --env esp32dev --example full
+
+   This file is part of MkWifiDev, a library which simplifies cable-free development. It
+   enables colorised logging to local & remote terminals and supports Arduino OTA firmware
+   updates.  Available at https://github.com/zaddi/MkWifiDev
+
+   MkWifiDev is distributed under the MIT License
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+LEVELS = ["(all)", "VERBOSE", "DEBUG", "INFO", "WARNING", "ALERT", "ERROR", "CRITICAL", "(none)"]
+USAGE_RE = re.compile(r"^(RAM|Flash):.*used (\d+) bytes from (\d+) bytes", re.M)
+
+
+def build(env, example, level):
+    cmd_env = dict(os.environ)
+    cmd_env["PLATFORMIO_SRC_DIR"] = os.path.join("examples", example)
+    cmd_env["PLATFORMIO_BUILD_FLAGS"] = "-D MKWIFIDEV_MIN_LEVEL=%d" % level
+    result = subprocess.run(["pio", "run", "-e", env, "-t", "size"], env=cmd_env,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    if result.returncode:
+        sys.stderr.write(result.stdout)
+        raise SystemExit("Build failed for MKWIFIDEV_MIN_LEVEL=%d" % level)
+    usage = {name: int(used) for name, used, _ in USAGE_RE.findall(result.stdout)}
+    return usage["Flash"], usage["RAM"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Report flash & RAM usage for each MKWIFIDEV_MIN_LEVEL")
+    parser.add_argument("--env", default="esp32dev", help="platformio.ini environment to build")
+    parser.add_argument("--example", default="full", help="example folder to build")
+    parser.add_argument("--csv", action="store_true", help="machine readable output")
+    opts = parser.parse_args()
+
+    results = [build(opts.env, opts.example, level) for level in range(len(LEVELS))]
+    flash0, ram0 = results[0]
+
+    if opts.csv:
+        print("min_level,name,flash,ram,flash_saved,ram_saved")
+    else:
+        print("%-10s %-9s %10s %10s %10s %10s" % ("MIN_LEVEL", "", "Flash", "RAM", "Flash -", "RAM -"))
+    for level, (flash, ram) in enumerate(results):
+        row = (level, LEVELS[level], flash, ram, flash0 - flash, ram0 - ram)
+        print(("%d,%s,%d,%d,%d,%d" if opts.csv else "%-10d %-9s %10d %10d %10d %10d") % row)
+
+
+if __name__ == "__main__":
+    main()